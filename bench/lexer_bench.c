@@ -0,0 +1,80 @@
+// Parse throughput of lex_line over multi-megabyte command lines, against the
+// strtok split shell.c used before (which knew nothing about quotes or operators
+// glued to words, and left the operator strcmp pass to process_arglist).
+//
+// gcc -O2 -I. -o lexer_bench lexer.c bench/lexer_bench.c        (SSE2)
+// gcc -O2 -mavx2 -I. -o lexer_bench lexer.c bench/lexer_bench.c (AVX2)
+// ./lexer_bench [megabytes] [rounds]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lexer.h"
+
+static const char* pieces[] = {
+  "ls", "-la", "/usr/local/share/some/long/path", "|", "grep", "\"quoted string with | and >\"",
+  "'single quoted'", "<", "input.txt", ">", "output.txt", "arg\\ with\\ escapes", "&", "x=1",
+};
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A line of about size bytes made of random pieces
+char* make_line(size_t size, size_t* length) {
+  char* line = malloc(size + 64);
+  size_t used = 0;
+  srand(1);
+  while (used < size) {
+    const char* piece = pieces[rand() % (sizeof(pieces) / sizeof(pieces[0]))];
+    used += sprintf(line + used, "%s ", piece);
+  }
+  line[used] = '\0';
+  *length = used;
+  return line;
+}
+
+int main(int argc, char** argv) {
+  size_t megabytes = argc > 1 ? atoi(argv[1]) : 8;
+  int rounds = argc > 2 ? atoi(argv[2]) : 20;
+  size_t length;
+  char* original = make_line(megabytes << 20, &length);
+  char* line = malloc(length + 1);
+  struct token_list tokens = { 0 };
+  const char* error;
+  double lex_time = 0, strtok_time = 0;
+  long num_tokens = 0, num_words = 0, num_operators = 0;
+
+  for (int round = 0; round < rounds; round++) {
+    memcpy(line, original, length + 1);
+    double start = now();
+    num_tokens = lex_line(line, length, &tokens, &error);
+    lex_time += now() - start;
+
+    memcpy(line, original, length + 1);
+    start = now();
+    num_words = 0;
+    num_operators = 0;
+    for (char* word = strtok(line, " \t\n"); word != NULL; word = strtok(NULL, " \t\n")) {
+      num_words++;
+      num_operators += (strcmp(word, "&") == 0) + (strcmp(word, "<") == 0) + (strcmp(word, ">") == 0) + (strcmp(word, "|") == 0);
+    }
+    strtok_time += now() - start;
+  }
+
+  double total = (double)length * rounds / (1 << 20);
+#if defined(__AVX2__)
+  const char* variant = "avx2";
+#elif defined(__SSE2__)
+  const char* variant = "sse2";
+#else
+  const char* variant = "scalar";
+#endif
+  printf("{\"bench\":\"lexer\",\"variant\":\"%s\",\"line_bytes\":%zu,\"tokens\":%ld,\"mb_per_sec\":%.1f}\n",
+         variant, length, num_tokens, total / lex_time);
+  printf("{\"bench\":\"strtok_strcmp\",\"line_bytes\":%zu,\"words\":%ld,\"operators\":%ld,\"mb_per_sec\":%.1f}\n",
+         length, num_words, num_operators, total / strtok_time);
+  return 0;
+}
@@ -0,0 +1,21 @@
+#!/bin/sh
+# Throughput of `cat big | sort | wc` through the shell for several pipe sizes.
+# usage: bench/pipesize.sh [shell binary] [input size in MiB]
+# Sizes above /proc/sys/fs/pipe-max-size need CAP_SYS_RESOURCE.
+SHELL_BIN=${1:-./myshell}
+SIZE_MB=${2:-256}
+INPUT=$(mktemp)
+trap 'rm -f "$INPUT"' EXIT
+
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom | base64 > "$INPUT"
+BYTES=$(wc -c < "$INPUT")
+
+for PIPE_SIZE in 0 256k 1m; do
+  START=$(date +%s.%N)
+  echo "pipesize=$PIPE_SIZE cat $INPUT | sort | wc" | "$SHELL_BIN" > /dev/null
+  END=$(date +%s.%N)
+  echo "$PIPE_SIZE $BYTES $START $END" | awk '{
+    secs = $4 - $3
+    printf "{\"bench\":\"pipesize\",\"pipe_size\":\"%s\",\"bytes\":%d,\"seconds\":%.3f,\"mb_per_sec\":%.1f}\n",
+           $1, $2, secs, $2 / secs / 1048576 }'
+done
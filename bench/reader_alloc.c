@@ -0,0 +1,68 @@
+// Microbenchmark: heap allocations per command made by the line reader and lexer in shell.c.
+// Links shell.c against stub prepare/process_tokens/finalize and counts the
+// allocator calls it makes through the linker's --wrap option.
+//
+// gcc -O2 -I. -o reader_alloc shell.c lexer.c bench/reader_alloc.c -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc
+// yes 'cmd arg1 arg2 arg3 | filter -x > out' | head -n 1000000 | ./reader_alloc
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define WARMUP_COMMANDS 1000
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+static unsigned long allocations;
+static unsigned long warmup_allocations;
+static unsigned long commands;
+static struct timespec start_time;
+
+void* __wrap_malloc(size_t size) {
+  allocations++;
+  return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t nmemb, size_t size) {
+  allocations++;
+  return __real_calloc(nmemb, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+  allocations++;
+  return __real_realloc(ptr, size);
+}
+
+int prepare(void) {
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+  return 0;
+}
+
+int process_tokens(int count, char** arglist, unsigned char* types) {
+  (void)count;
+  (void)arglist;
+  (void)types;
+  if (++commands == WARMUP_COMMANDS) {
+    warmup_allocations = allocations;
+  }
+  return 1;
+}
+
+void wait_for_input(int fd) {
+  (void)fd;
+}
+
+int finalize(void) {
+  struct timespec end_time;
+  clock_gettime(CLOCK_MONOTONIC, &end_time);
+  double seconds = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+  unsigned long steady_commands = commands > WARMUP_COMMANDS ? commands - WARMUP_COMMANDS : 0;
+
+  printf("commands: %lu\n", commands);
+  printf("allocations: %lu total, %lu during warmup\n", allocations, warmup_allocations);
+  printf("steady-state allocations per command: %.4f\n",
+         steady_commands ? (double)(allocations - warmup_allocations) / steady_commands : 0.0);
+  printf("commands/sec: %.0f\n", commands / seconds);
+  return 0;
+}
@@ -0,0 +1,427 @@
+// End-to-end benchmarks of a myshell binary, driven through a pipe (default) or
+// a pty (-t, the interactive path: stdin is a terminal). Every result is one
+// JSON line on stdout, labelled with -l (make bench uses the git commit), so
+// runs can be diffed or loaded side by side.
+//
+//   commands   commands/sec of external commands (execute_standard_command) and of a builtin
+//   redirect   latency distribution of `cmd < file` and `cmd > file`, plus the bare round trip
+//   pipeline   GB/s through head -c | cat ... | wc -c chains of 1..N pipes
+//   reap       launching thousands of & jobs, then how long wait takes to reap them all
+//   spawn      /bin/true latency with the shell at its normal RSS, then grown by -r MiB
+//              (compare ./myshell-fork with and without -z, the zygote launcher)
+//
+// gcc -O2 -o shellbench bench/shellbench.c
+// ./shellbench [-t] [-z] [-l label] [-n commands] [-s pipeline MiB] [-p max pipes] [-j jobs] [-r MiB]
+//              [shell binary] [bench...]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+struct shell_process {
+  pid_t pid;
+  int in_fd;  // what the shell reads
+  int out_fd; // what the shell writes to stdout
+  char output[OUTPUT_BUFFER_SIZE];
+  size_t output_length;
+  unsigned long markers;
+};
+
+static const char* label = "";
+static const char* mode = "pipe";
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void die(const char* what) {
+  perror(what);
+  exit(1);
+}
+
+// Starts shell_path with its stdin and stdout connected to us, through a pty
+// in raw mode (so our input is not echoed back) or through two pipes
+void start_shell(struct shell_process* shell, const char* shell_path, int use_pty) {
+  int child_in, child_out;
+
+  memset(shell, 0, sizeof(*shell));
+  if (use_pty) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+      die("posix_openpt");
+    }
+    child_in = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (child_in == -1) {
+      die("open pty");
+    }
+    struct termios raw;
+    tcgetattr(child_in, &raw);
+    cfmakeraw(&raw);
+    tcsetattr(child_in, TCSANOW, &raw);
+    child_out = child_in;
+    shell->in_fd = master;
+    shell->out_fd = master;
+  } else {
+    int to_shell[2], from_shell[2];
+    if (pipe2(to_shell, O_CLOEXEC) == -1 || pipe2(from_shell, O_CLOEXEC) == -1) {
+      die("pipe");
+    }
+    child_in = to_shell[0];
+    child_out = from_shell[1];
+    shell->in_fd = to_shell[1];
+    shell->out_fd = from_shell[0];
+  }
+
+  shell->pid = fork();
+  if (shell->pid == -1) {
+    die("fork");
+  }
+  if (shell->pid == 0) {
+    dup2(child_in, STDIN_FILENO);
+    dup2(child_out, STDOUT_FILENO);
+    execl(shell_path, shell_path, (char*)NULL);
+    perror(shell_path);
+    _exit(127);
+  }
+  close(child_in);
+  if (child_out != child_in) {
+    close(child_out);
+  }
+}
+
+void stop_shell(struct shell_process* shell) {
+  int status;
+  close(shell->in_fd);
+  if (shell->out_fd != shell->in_fd) {
+    close(shell->out_fd);
+  }
+  waitpid(shell->pid, &status, 0);
+}
+
+void send_line(struct shell_process* shell, const char* format, ...) {
+  char* line;
+  va_list args;
+  va_start(args, format);
+  int length = vasprintf(&line, format, args);
+  va_end(args);
+  if (length == -1) {
+    die("vasprintf");
+  }
+
+  line[length++] = '\n'; // in place of the terminating NUL
+
+  for (int written = 0; written < length;) {
+    ssize_t bytes = write(shell->in_fd, line + written, length - written);
+    if (bytes == -1 && errno != EINTR) {
+      die("write to shell");
+    }
+    written += bytes > 0 ? bytes : 0;
+  }
+  free(line);
+}
+
+// Makes the shell echo a fresh marker and reads its output up to that marker.
+// Everything the shell printed before it is left in shell->output.
+void sync_shell(struct shell_process* shell) {
+  char marker[64];
+  int marker_length = snprintf(marker, sizeof(marker), "__mark_%lu__", ++shell->markers);
+
+  send_line(shell, "echo %s", marker);
+  shell->output_length = 0;
+  while (1) {
+    shell->output[shell->output_length] = '\0';
+    if (memmem(shell->output, shell->output_length, marker, marker_length) != NULL) {
+      return;
+    }
+    if (shell->output_length + 1 >= sizeof(shell->output)) {
+      // Only the tail can still hold the marker
+      size_t keep = marker_length;
+      memmove(shell->output, shell->output + shell->output_length - keep, keep);
+      shell->output_length = keep;
+    }
+    ssize_t bytes = read(shell->out_fd, shell->output + shell->output_length,
+                         sizeof(shell->output) - shell->output_length - 1);
+    if (bytes <= 0) {
+      if (bytes == -1 && errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "shell exited before printing %s\n", marker);
+      exit(1);
+    }
+    shell->output_length += bytes;
+  }
+}
+
+int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+void print_header(const char* bench) {
+  printf("{\"label\":\"%s\",\"mode\":\"%s\",\"bench\":\"%s\"", label, mode, bench);
+}
+
+// Sends count copies of command, then waits for the shell to get through them
+void bench_commands(struct shell_process* shell, const char* name, const char* command, int count) {
+  for (int i = 0; i < count / 10; i++) { // Warm up the command hash and page cache
+    send_line(shell, "%s", command);
+  }
+  sync_shell(shell);
+
+  double start = now();
+  for (int i = 0; i < count; i++) {
+    send_line(shell, "%s", command);
+  }
+  sync_shell(shell);
+  double seconds = now() - start;
+
+  print_header("commands");
+  printf(",\"name\":\"%s\",\"command\":\"%s\",\"count\":%d,\"seconds\":%.6f,\"per_second\":%.1f}\n",
+         name, command, count, seconds, count / seconds);
+  fflush(stdout);
+}
+
+// Round trip of command followed by the marker, one at a time, count times.
+// Prints the distribution in microseconds as the end of a JSON line.
+void measure_latency(struct shell_process* shell, const char* command, int count) {
+  double* latencies = malloc(sizeof(double) * count);
+  if (latencies == NULL) {
+    die("malloc");
+  }
+  for (int i = 0; i < count / 10; i++) {
+    if (command != NULL) {
+      send_line(shell, "%s", command);
+    }
+    sync_shell(shell);
+  }
+
+  for (int i = 0; i < count; i++) {
+    double start = now();
+    if (command != NULL) {
+      send_line(shell, "%s", command);
+    }
+    sync_shell(shell);
+    latencies[i] = (now() - start) * 1e6;
+  }
+  qsort(latencies, count, sizeof(double), compare_doubles);
+
+  printf(",\"command\":\"%s\",\"count\":%d,\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+         command != NULL ? command : "", count, latencies[count / 2], latencies[count * 9 / 10],
+         latencies[count * 99 / 100], latencies[count - 1]);
+  fflush(stdout);
+  free(latencies);
+}
+
+void bench_latency(struct shell_process* shell, const char* name, const char* command, int count) {
+  print_header("redirect");
+  printf(",\"name\":\"%s\"", name);
+  measure_latency(shell, command, count);
+}
+
+long shell_rss_kb(struct shell_process* shell) {
+  char path[64], line[256];
+  long rss = -1;
+  snprintf(path, sizeof(path), "/proc/%d/status", shell->pid);
+  FILE* status = fopen(path, "r");
+  while (status != NULL && fgets(line, sizeof(line), status) != NULL) {
+    if (sscanf(line, "VmRSS: %ld", &rss) == 1) {
+      break;
+    }
+  }
+  if (status != NULL) {
+    fclose(status);
+  }
+  return rss;
+}
+
+// Grows the shell's line buffer (and so its RSS) by sending it a command line of
+// about megabytes MiB: the true builtin followed by that many spaces
+void inflate_shell(struct shell_process* shell, long megabytes) {
+  char* spaces = malloc(1024 * 1024);
+  if (spaces == NULL) {
+    die("malloc");
+  }
+  memset(spaces, ' ', 1024 * 1024);
+  if (write(shell->in_fd, "true", 4) != 4) {
+    die("write to shell");
+  }
+  for (long i = 0; i < megabytes; i++) {
+    for (size_t written = 0; written < 1024 * 1024;) {
+      ssize_t bytes = write(shell->in_fd, spaces + written, 1024 * 1024 - written);
+      if (bytes == -1 && errno != EINTR) {
+        die("write to shell");
+      }
+      written += bytes > 0 ? bytes : 0;
+    }
+  }
+  send_line(shell, "");
+  sync_shell(shell);
+  free(spaces);
+}
+
+// /bin/true latency at the shell's RSS now and after growing it by inflate_mb MiB
+void bench_spawn(struct shell_process* shell, int count, long inflate_mb, int zygote) {
+  for (int round = 0; round < 2; round++) {
+    if (round == 1) {
+      inflate_shell(shell, inflate_mb);
+    }
+    print_header("spawn");
+    printf(",\"zygote\":%s,\"rss_kb\":%ld", zygote ? "true" : "false", shell_rss_kb(shell));
+    measure_latency(shell, "/bin/true", count);
+  }
+}
+
+// head -c bytes /dev/zero | cat | ... | wc -c with num_pipes pipes
+void bench_pipeline(struct shell_process* shell, long long bytes, int num_pipes) {
+  size_t size = 64 + strlen(" | cat") * num_pipes;
+  char* command = malloc(size);
+  if (command == NULL) {
+    die("malloc");
+  }
+  int length = snprintf(command, size, "head -c %lld /dev/zero", bytes);
+  for (int i = 1; i < num_pipes; i++) {
+    length += snprintf(command + length, size - length, " | cat");
+  }
+  snprintf(command + length, size - length, " | wc -c");
+
+  double start = now();
+  send_line(shell, "%s", command);
+  sync_shell(shell);
+  double seconds = now() - start;
+  free(command);
+  long long counted = strtoll(shell->output, NULL, 10);
+
+  print_header("pipeline");
+  printf(",\"pipes\":%d,\"processes\":%d,\"bytes\":%lld,\"ok\":%s,\"seconds\":%.6f,\"gb_per_sec\":%.3f}\n",
+         num_pipes, num_pipes + 1, bytes, counted == bytes ? "true" : "false", seconds, bytes / seconds / 1e9);
+  fflush(stdout);
+}
+
+// Launches num_jobs background jobs, then times the wait builtin reaping the rest
+void bench_reap(struct shell_process* shell, int num_jobs) {
+  double start = now();
+  for (int i = 0; i < num_jobs; i++) {
+    send_line(shell, "/bin/true &");
+  }
+  sync_shell(shell);
+  double launched = now();
+  send_line(shell, "wait");
+  sync_shell(shell);
+  double reaped = now();
+
+  print_header("reap");
+  printf(",\"jobs\":%d,\"launch_seconds\":%.6f,\"wait_seconds\":%.6f,\"jobs_per_second\":%.1f,"
+         "\"us_per_job\":%.2f}\n", num_jobs, launched - start, reaped - launched,
+         num_jobs / (reaped - start), (reaped - start) * 1e6 / num_jobs);
+  fflush(stdout);
+}
+
+int wants(char** benches, int num_benches, const char* bench) {
+  if (num_benches == 0) {
+    return 1;
+  }
+  for (int i = 0; i < num_benches; i++) {
+    if (strcmp(benches[i], bench) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  int use_pty = 0;
+  int num_commands = 2000;
+  long long pipeline_mb = 256;
+  int max_pipes = 8;
+  int num_jobs = 2000;
+  long inflate_mb = 1024;
+  int zygote = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "tzl:n:s:p:j:r:")) != -1) {
+    switch (opt) {
+      case 't': use_pty = 1; mode = "pty"; break;
+      case 'z': zygote = 1; break;
+      case 'r': inflate_mb = atol(optarg); break;
+      case 'l': label = optarg; break;
+      case 'n': num_commands = atoi(optarg); break;
+      case 's': pipeline_mb = atoll(optarg); break;
+      case 'p': max_pipes = atoi(optarg); break;
+      case 'j': num_jobs = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-t] [-z] [-l label] [-n commands] [-s pipeline MiB] [-p max pipes] [-j jobs] "
+                        "[-r MiB] [shell] [commands|redirect|pipeline|reap|spawn...]\n", argv[0]);
+        return 2;
+    }
+  }
+  const char* shell_path = optind < argc ? argv[optind++] : "./myshell";
+  char** benches = argv + optind;
+  int num_benches = argc - optind;
+  if (num_commands < 10 || max_pipes < 1 || num_jobs < 1 || pipeline_mb < 1 || inflate_mb < 1) {
+    fprintf(stderr, "%s: counts must be positive (at least 10 commands)\n", argv[0]);
+    return 2;
+  }
+
+  signal(SIGPIPE, SIG_IGN); // A dying shell shows up as a write error
+  if (zygote) {
+    setenv("MYSHELL_ZYGOTE", "1", 1);
+  }
+  struct shell_process* shell = malloc(sizeof(struct shell_process));
+  if (shell == NULL) {
+    die("malloc");
+  }
+  start_shell(shell, shell_path, use_pty);
+  sync_shell(shell);
+
+  if (wants(benches, num_benches, "commands")) {
+    bench_commands(shell, "external", "/bin/true", num_commands);
+    bench_commands(shell, "builtin", "true", num_commands);
+  }
+
+  if (wants(benches, num_benches, "redirect")) {
+    char file[] = "/tmp/shellbench.XXXXXX";
+    char command[128];
+    int fd = mkstemp(file);
+    if (fd == -1) {
+      die("mkstemp");
+    }
+    close(fd);
+    bench_latency(shell, "roundtrip", NULL, num_commands);
+    snprintf(command, sizeof(command), "/bin/true > %s", file);
+    bench_latency(shell, "output", command, num_commands);
+    snprintf(command, sizeof(command), "/bin/true < %s", file);
+    bench_latency(shell, "input", command, num_commands);
+    unlink(file);
+  }
+
+  if (wants(benches, num_benches, "pipeline")) {
+    for (int pipes = 1; pipes <= max_pipes; pipes++) {
+      bench_pipeline(shell, pipeline_mb * 1024 * 1024, pipes);
+    }
+  }
+
+  if (wants(benches, num_benches, "reap")) {
+    bench_reap(shell, num_jobs);
+  }
+
+  // Last, the shell stays big afterwards. Not part of the default run.
+  if (num_benches > 0 && wants(benches, num_benches, "spawn")) {
+    bench_spawn(shell, num_commands, inflate_mb, zygote);
+  }
+
+  stop_shell(shell);
+  free(shell);
+  return 0;
+}
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Throughput of pipelines of cat, grep, head, tail and wc run as external
+# commands (set streams off) and as threads of the shell (set streams on).
+# usage: bench/streams.sh [shell binary] [input size in MiB] [runs]
+SHELL_BIN=${1:-./myshell}
+SIZE_MB=${2:-256}
+RUNS=${3:-3}
+INPUT=$(mktemp)
+trap 'rm -f "$INPUT"' EXIT
+
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom | base64 > "$INPUT"
+BYTES=$(wc -c < "$INPUT")
+
+run() {
+  NAME=$1
+  PIPELINE=$2
+  for MODE in off on; do
+    BEST=
+    for RUN in $(seq "$RUNS"); do
+      START=$(date +%s.%N)
+      printf 'set streams %s\n%s\n' "$MODE" "$PIPELINE" | "$SHELL_BIN" > /dev/null
+      END=$(date +%s.%N)
+      BEST=$(echo "$START $END $BEST" | awk '{ secs = $2 - $1; print ($3 == "" || secs < $3) ? secs : $3 }')
+    done
+    echo "$NAME $MODE $BYTES $BEST" | awk '{
+      printf "{\"bench\":\"streams\",\"pipeline\":\"%s\",\"streams\":\"%s\",\"bytes\":%d,\"seconds\":%.3f,\"mb_per_sec\":%.1f}\n",
+             $1, $2, $3, $4, $3 / $4 / 1048576 }'
+  done
+}
+
+run cat-grep-wc "cat $INPUT | grep -F AbC | wc -l"
+run cat-grep-v-tail "cat $INPUT | cat | grep -v Q | tail -n 10"
+run cat-tee-wc "cat $INPUT | tee /dev/null | wc -c"
+run head-early-exit "cat $INPUT | head -n 1000 | wc -l"
+run mixed-sort "cat $INPUT | head -n 200000 | sort | grep -F x | wc -l"
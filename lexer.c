@@ -0,0 +1,300 @@
+#include <stdlib.h>
+#include <string.h>
+#include "lexer.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Single-pass command line lexer. The bytes that end a run of plain word
+// characters outside quotes (separators, operators, quotes and backslash) are
+// found 32 (AVX2) or 16 (SSE2) at a time, everything in between is copied as is.
+
+static char pipe_token[] = "|";
+static char input_token[] = "<";
+static char output_token[] = ">";
+static char background_token[] = "&";
+static char append_token[] = ">>";
+static char error_output_token[] = "2>";
+static char heredoc_token[] = "<<";
+static char herestring_token[] = "<<<";
+static char status_token[] = "$?";
+
+static const char special_bytes[] = { ' ', '\t', '\n', '\r', '|', '<', '>', '&', '\'', '"', '\\' };
+
+static unsigned char special_table[256];
+
+static void init_special_table(void) {
+  for (size_t i = 0; i < sizeof(special_bytes); i++) {
+    special_table[(unsigned char)special_bytes[i]] = 1;
+  }
+}
+
+// returns the number of plain word bytes at the start of data
+static size_t scan_plain(const char* data, size_t size) {
+  size_t i = 0;
+
+#if defined(__AVX2__)
+  const __m256i space = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t');
+  const __m256i newline = _mm256_set1_epi8('\n'), carriage = _mm256_set1_epi8('\r');
+  const __m256i bar = _mm256_set1_epi8('|'), less = _mm256_set1_epi8('<');
+  const __m256i greater = _mm256_set1_epi8('>'), amp = _mm256_set1_epi8('&');
+  const __m256i single = _mm256_set1_epi8('\''), dbl = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  for (; i + 32 <= size; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*)(data + i));
+    __m256i hits = _mm256_or_si256(
+        _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, space), _mm256_cmpeq_epi8(chunk, tab)),
+                        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, newline), _mm256_cmpeq_epi8(chunk, carriage))),
+        _mm256_or_si256(
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, bar), _mm256_cmpeq_epi8(chunk, less)),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, greater), _mm256_cmpeq_epi8(chunk, amp))),
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, single), _mm256_cmpeq_epi8(chunk, dbl)),
+                            _mm256_cmpeq_epi8(chunk, backslash))));
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(hits);
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#elif defined(__SSE2__)
+  const __m128i space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+  const __m128i newline = _mm_set1_epi8('\n'), carriage = _mm_set1_epi8('\r');
+  const __m128i bar = _mm_set1_epi8('|'), less = _mm_set1_epi8('<');
+  const __m128i greater = _mm_set1_epi8('>'), amp = _mm_set1_epi8('&');
+  const __m128i single = _mm_set1_epi8('\''), dbl = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  for (; i + 16 <= size; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)(data + i));
+    __m128i hits = _mm_or_si128(
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, tab)),
+                     _mm_or_si128(_mm_cmpeq_epi8(chunk, newline), _mm_cmpeq_epi8(chunk, carriage))),
+        _mm_or_si128(
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, bar), _mm_cmpeq_epi8(chunk, less)),
+                         _mm_or_si128(_mm_cmpeq_epi8(chunk, greater), _mm_cmpeq_epi8(chunk, amp))),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, single), _mm_cmpeq_epi8(chunk, dbl)),
+                         _mm_cmpeq_epi8(chunk, backslash))));
+    int mask = _mm_movemask_epi8(hits);
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#endif
+
+  for (; i < size; i++) {
+    if (special_table[(unsigned char)data[i]]) {
+      return i;
+    }
+  }
+  return size;
+}
+
+// returns 0 if the arrays cannot hold one more token and the terminating NULL
+static int reserve_token(struct token_list* tokens, size_t count) {
+  if (count + 1 < tokens->capacity) {
+    return 1;
+  }
+  size_t capacity = tokens->capacity == 0 ? 64 : tokens->capacity * 2;
+  char** argv = realloc(tokens->argv, sizeof(char*) * capacity);
+  if (argv == NULL) {
+    return 0;
+  }
+  tokens->argv = argv;
+  unsigned char* types = realloc(tokens->types, capacity);
+  if (types == NULL) {
+    return 0;
+  }
+  tokens->types = types;
+  tokens->capacity = capacity;
+  return 1;
+}
+
+int lex_line(char* line, size_t length, struct token_list* tokens, const char** error) {
+  size_t read = 0; // next byte to look at
+  size_t write = 0; // where the next word byte goes, never after read
+  size_t word_start = 0;
+  int in_word = 0;
+  int word_quoted = 0; // the current word used quotes or a backslash
+  int count = 0;
+
+  if (special_table[' '] == 0) {
+    init_special_table();
+  }
+
+  while (1) {
+    size_t plain = scan_plain(line + read, length - read);
+    if (plain > 0) {
+      if (!in_word) {
+        in_word = 1;
+        word_start = write;
+      }
+      if (write != read) {
+        memmove(line + write, line + read, plain);
+      }
+      write += plain;
+      read += plain;
+    }
+
+    char c = read < length ? line[read] : ' ';
+    char* operator_token = NULL;
+    enum token_type operator_type = TOKEN_WORD;
+    size_t operator_length = 1;
+
+    switch (c) {
+      case '|': operator_token = pipe_token; operator_type = TOKEN_PIPE; break;
+      case '<':
+        if (read + 2 < length && line[read + 1] == '<' && line[read + 2] == '<') {
+          operator_token = herestring_token;
+          operator_type = TOKEN_HERESTRING;
+          operator_length = 3;
+        } else if (read + 1 < length && line[read + 1] == '<') {
+          operator_token = heredoc_token;
+          operator_type = TOKEN_HEREDOC;
+          operator_length = 2;
+        } else {
+          operator_token = input_token;
+          operator_type = TOKEN_INPUT;
+        }
+        break;
+      case '>':
+        if (read + 1 < length && line[read + 1] == '>') {
+          operator_token = append_token;
+          operator_type = TOKEN_APPEND;
+          operator_length = 2;
+        } else if (in_word && !word_quoted && write - word_start == 1 && line[word_start] == '2') {
+          // The 2 was the start of the operator, not a word
+          in_word = 0;
+          write = word_start;
+          operator_token = error_output_token;
+          operator_type = TOKEN_ERROR_OUTPUT;
+        } else {
+          operator_token = output_token;
+          operator_type = TOKEN_OUTPUT;
+        }
+        break;
+      case '&': operator_token = background_token; operator_type = TOKEN_BACKGROUND; break;
+
+      case '\'': {
+        // Everything up to the closing quote is literal
+        const char* end = memchr(line + read + 1, '\'', length - read - 1);
+        if (end == NULL) {
+          *error = "unterminated single quote";
+          return -1;
+        }
+        size_t size = end - (line + read + 1);
+        if (!in_word) {
+          in_word = 1;
+          word_start = write;
+        }
+        word_quoted = 1;
+        memmove(line + write, line + read + 1, size);
+        write += size;
+        read += size + 2;
+        continue;
+      }
+
+      case '"': {
+        // Literal too, except that \" and \\ stand for " and backslash
+        if (!in_word) {
+          in_word = 1;
+          word_start = write;
+        }
+        word_quoted = 1;
+        read++;
+        while (read < length && line[read] != '"') {
+          if (line[read] == '\\' && read + 1 < length && (line[read + 1] == '"' || line[read + 1] == '\\')) {
+            read++;
+          }
+          line[write++] = line[read++];
+        }
+        if (read == length) {
+          *error = "unterminated double quote";
+          return -1;
+        }
+        read++;
+        continue;
+      }
+
+      case '\\':
+        // The next byte is taken literally
+        if (!in_word) {
+          in_word = 1;
+          word_start = write;
+        }
+        word_quoted = 1;
+        read++;
+        if (read < length) {
+          line[write++] = line[read++];
+        }
+        continue;
+    }
+
+    // A separator, an operator or the end of the line ends the current word.
+    // The byte at read was already looked at, so the terminator may overwrite it.
+    if (in_word) {
+      if (!reserve_token(tokens, count)) {
+        *error = "out of memory";
+        return -1;
+      }
+      // A here-document delimiter is never expanded
+      if (!word_quoted && write - word_start == 2 && line[word_start] == '$' && line[word_start + 1] == '?' &&
+          (count == 0 || tokens->types[count - 1] != TOKEN_HEREDOC)) {
+        // A static string like the operators, not a word read_heredocs has to keep
+        tokens->argv[count] = status_token;
+        tokens->types[count++] = TOKEN_STATUS;
+      } else {
+        line[write++] = '\0';
+        tokens->argv[count] = line + word_start;
+        tokens->types[count++] = TOKEN_WORD;
+      }
+      in_word = 0;
+    }
+    word_quoted = 0;
+    if (operator_token != NULL) {
+      if (!reserve_token(tokens, count)) {
+        *error = "out of memory";
+        return -1;
+      }
+      tokens->argv[count] = operator_token;
+      tokens->types[count++] = operator_type;
+    }
+    if (read >= length) {
+      break;
+    }
+    read += operator_length;
+  }
+
+  if (!reserve_token(tokens, count)) {
+    *error = "out of memory";
+    return -1;
+  }
+  tokens->argv[count] = NULL;
+  return count;
+}
+
+enum token_type classify_word(const char* word) {
+  if (strcmp(word, ">>") == 0) {
+    return TOKEN_APPEND;
+  }
+  if (strcmp(word, "2>") == 0) {
+    return TOKEN_ERROR_OUTPUT;
+  }
+  if (strcmp(word, "<<") == 0) {
+    return TOKEN_HEREDOC;
+  }
+  if (strcmp(word, "<<<") == 0) {
+    return TOKEN_HERESTRING;
+  }
+  if (strcmp(word, status_token) == 0) {
+    return TOKEN_STATUS;
+  }
+  if (word[0] == '\0' || word[1] != '\0') {
+    return TOKEN_WORD;
+  }
+  switch (word[0]) {
+    case '|': return TOKEN_PIPE;
+    case '<': return TOKEN_INPUT;
+    case '>': return TOKEN_OUTPUT;
+    case '&': return TOKEN_BACKGROUND;
+  }
+  return TOKEN_WORD;
+}
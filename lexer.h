@@ -0,0 +1,39 @@
+#ifndef LEXER_H
+#define LEXER_H
+
+#include <stddef.h>
+
+// What a token of a command line is. Operators are only recognized outside quotes,
+// so a quoted "|" is a TOKEN_WORD.
+enum token_type {
+  TOKEN_WORD,
+  TOKEN_PIPE,       // |
+  TOKEN_INPUT,      // <
+  TOKEN_OUTPUT,     // >
+  TOKEN_BACKGROUND, // &
+  TOKEN_APPEND,     // >>
+  TOKEN_ERROR_OUTPUT, // 2> (a 2 glued to > at the start of a word)
+  TOKEN_HEREDOC,    // << (the next word is the delimiter, replaced by the body once read)
+  TOKEN_HERESTRING, // <<<
+  TOKEN_STATUS,     // $? as a whole unquoted word (not a delimiter), a word once process_tokens expands it
+};
+
+// Growable token arrays filled by lex_line: argv[i] is the text of token i and
+// types[i] its type. argv is NULL terminated, like the arglist of process_arglist.
+struct token_list {
+  char** argv;
+  unsigned char* types;
+  size_t capacity;
+};
+
+// Splits line (length bytes, with line[length] == '\0') in a single pass into
+// words and operators. Words are unquoted and unescaped in place inside line,
+// operator and TOKEN_STATUS tokens point to static strings.
+// returns the number of tokens, -1 with *error set on a syntax error
+// (unterminated quote) or when growing the token arrays fails
+int lex_line(char* line, size_t length, struct token_list* tokens, const char** error);
+
+// The type a single word would get from lex_line if it was not quoted
+enum token_type classify_word(const char* word);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <signal.h>
 #include <string.h>
@@ -7,299 +8,5171 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sched.h>
+#include "lexer.h"
+#include "trace.h"
+#include "streams.h"
+
+#define COMMAND_HASH_INITIAL_SIZE 64
+#define DEFAULT_PATH "/bin:/usr/bin"
+#define PIPESIZE_ENV "MYSHELL_PIPESIZE"
+#define PIPESIZE_PREFIX "pipesize="
+#define TIME_PREFIX "time"
+#define PROFILE_PREFIX "profile"
+#define SCHED_PREFIX "sched"
+#define LIMIT_PREFIX "limit"
+#define PROFILE_SPLICE_SIZE (1024 * 1024)
+#define PROFILE_MAX_SPLICES 16 // per link and wakeup, so that a fast pipe does not starve the others
+#define TRACE_ENV "MYSHELL_TRACE"
+#define ZYGOTE_ENV "MYSHELL_ZYGOTE"
+#define ZYGOTE_MAX_MESSAGE (64 * 1024) // bigger spawn requests are launched by the shell itself
+#define ZYGOTE_MAX_FDS 7
+#define MAX_EVENTS 64
+#define JOB_OUTPUT_READ_SIZE (64 * 1024)
+#define JOB_OUTPUT_MAX_LINE (64 * 1024) // a longer partial line is written out as it is
+#define JOB_OUTPUT_SPLICE_SIZE (1024 * 1024)
+#define JOB_OUTPUT_DEFAULT_MEMORY (64 * 1024 * 1024)
+#define SPAWN_MAX_RETRIES 10
+#define SPAWN_BACKOFF_MIN_NS 1000000L // first wait after EAGAIN, doubled at every retry
+#define SPAWN_BACKOFF_MAX_NS 500000000L
+#define CLONE_STACK_SIZE (256 * 1024) // of a child until its exec, see clone_in_shell
+#define HEREDOC_PIPE_MAX (64 * 1024) // bigger here-documents go to a memfd without trying a pipe
+#define MAX_PARALLEL_LINE_WORDS 256 // words kept from each line of a parallel -a file
+#define BATCH_READ_SIZE (64 * 1024)
+#define BATCH_ARG_HEADROOM 2048 // bytes of ARG_MAX left unused, like xargs
+#define BATCH_MAX_ARG_LENGTH (32 * 4096) // MAX_ARG_STRLEN, the longest single argument Linux takes
+#define JOB_INDEX_INITIAL_SIZE 64
+#define FANOUT_BLOCK_SIZE (64 * 1024) // most input bytes sent to one instance at a time
+#define FANOUT_MAX_PENDING (1024 * 1024) // stop reading input, or an ordered instance's output, at this much queued
+#define FANOUT_READ_SIZE (64 * 1024)
+#define PLACEMENT_SAMPLE_NS 100000000ULL // /proc/stat is read again once the last sample is this old
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+// Children are launched with posix_spawn by default. glibc implements it with
+// clone(CLONE_VM | CLONE_VFORK), so the shell's page tables are never copied.
+// Build with -DMYSHELL_SPAWN_FORK to go back to plain fork + exec, which is
+// useful to compare the two launch paths (commands/sec) on the same workload.
+
+extern char** environ;
+
+// Resources a command can be limited in (set joblimit, the limit prefix)
+enum limit_resource {
+  LIMIT_AS,     // address space, bytes
+  LIMIT_CPU,    // CPU time, seconds
+  LIMIT_NOFILE, // open files
+  LIMIT_NPROC,  // processes of the user
+  NUM_LIMITS,
+};
+
+// Limits a child sets on itself with setrlimit. Each one is the soft and the
+// hard limit at once, so the command cannot raise it again, except that the
+// hard CPU limit is a second later: the process gets SIGXCPU before SIGKILL.
+struct resource_limits {
+  unsigned int set; // bit 1 << resource for every limit given
+  rlim_t values[NUM_LIMITS]; // RLIM_INFINITY lifts a default (limit prefix only)
+};
+
+// What a child changes about itself between fork and exec (set placement, set
+// jobnice, set jobionice, set joblimit, the sched and limit prefixes).
+// posix_spawn cannot do any of it, so a request with a setup is launched by the
+// zygote or with clone_in_shell.
+struct child_setup {
+  int has_cpus;
+  cpu_set_t cpus; // CPU affinity
+  int has_nice;
+  int nice;       // nice value, not an increment
+  int ioprio;     // I/O priority as ioprio_set takes it, 0 keeps the shell's
+  struct resource_limits limits;
+};
+
+// Describes a child to launch. in_fd / out_fd / err_fd are -1 to keep the
+// shell's own stdin / stdout / stderr, otherwise they are dup2'd onto them.
+// Every other descriptor the shell opens for a child is O_CLOEXEC, so nothing
+// else needs to be closed explicitly before the exec.
+struct spawn_request {
+  char** argv;
+  int in_fd;
+  int out_fd;
+  int err_fd;
+  int is_background;
+  const struct child_setup* setup; // NULL if the child changes nothing
+};
+
+// One command of a command line with its own redirections, which are taken out
+// of argv. A redirection of a pipeline stage wins over the pipe on that side.
+struct stage_plan {
+  char** argv;
+  int argc;
+  const char* input;        // < file, NULL if none
+  const char* here_data;    // body of << or word of <<<, NULL if none. Replaces input
+  int here_string;          // here_data came from <<<, a newline follows it
+  const char* output;       // > or >> file, NULL if none
+  int append;               // output was given with >>
+  const char* error_output; // 2> file, NULL if none
+};
+
+// A whole command line: the stages connected by pipes, and whether it ends with &
+struct command_plan {
+  struct stage_plan* stages;
+  int num_stages;
+  int capacity;
+  int background;
+};
+
+// Where the output of background commands goes, see struct output_mux
+enum job_output_mode {
+  JOB_OUTPUT_DIRECT, // straight to the shell's stdout and stderr
+  JOB_OUTPUT_LINES,  // through the shell, whole lines at a time
+  JOB_OUTPUT_JOBS,   // through the shell, the whole output of a job at once when it is done
+};
+
+// How the processes of jobs are spread over the CPUs, see struct cpu_placement
+enum placement_policy {
+  PLACEMENT_OFF,
+  PLACEMENT_ROUND_ROBIN, // one CPU each, in turn
+  PLACEMENT_LEAST_LOADED, // one CPU each, the least busy one
+  PLACEMENT_NUMA,        // all the CPUs of one NUMA node, filling the nodes in order
+};
+
+// Shell-wide settings changed with the set builtin
+struct shell_settings {
+  size_t pipe_size; // capacity requested for pipeline pipes, 0 keeps the kernel default
+  int timing; // print a time: summary after every foreground command
+  char* trace_path; // file the spawn trace goes to, NULL while tracing is off
+  enum job_output_mode job_output;
+  size_t job_output_memory; // job output held in memory before spilling to files
+  long spawn_limit; // most background processes running at once, 0 for no limit
+  int stream_builtins; // run cat, head, tail, grep, wc and tee pipeline stages as threads
+  enum placement_policy placement; // CPUs given to the processes of jobs
+  int has_job_nice;
+  int job_nice; // nice value of the processes of jobs
+  int job_ioprio; // I/O priority of the processes of jobs, 0 keeps the shell's
+  struct resource_limits job_limits; // of the processes of jobs
+};
+
+static struct shell_settings settings;
+
+// What the spawn scheduler had to do, shown by set spawnlimit
+struct spawn_stats {
+  unsigned long queued;  // commands that waited for running jobs to free a slot
+  unsigned long retried; // launches tried again after EAGAIN / ENOMEM
+  unsigned long dropped; // commands not run because processes could not be created
+};
+
+static struct spawn_stats spawn_stats;
+
+// A command started with & and what became of it
+struct job {
+  int id;
+  pid_t pid;
+  char* command;
+  int running;
+  int pidfd; // -1 if the kernel would not give one, the job is then found through SIGCHLD
+  int status; // wait status, valid once running is 0
+  struct rusage usage;
+  struct timespec start_time;
+  struct timespec end_time;
+  struct resource_limits limits; // what it was started with, to tell which one ended it
+};
+
+// Jobs are kept in launch order. index maps a pid to its position in jobs
+// (open addressing, 0 marks an empty slot, otherwise position + 1) so that
+// recording thousands of exits does not scan the whole table.
+struct job_table {
+  struct job* jobs;
+  int num_jobs;
+  int capacity;
+  int* index;
+  int index_size; // power of two
+  int next_id;
+  int num_running;
+  int num_without_pidfd; // running jobs that have no pidfd
+};
+
+static struct job_table job_table;
+
+// Child management runs on an epoll loop instead of a SIGCHLD handler.
+// SIGCHLD is blocked for the whole life of the shell and only read through a
+// signalfd, and every background job has a pidfd that becomes readable when it
+// exits. Nothing ever calls wait on "any child", so a foreground child can only
+// be reaped by the code waiting for it, and no system call gets EINTR.
+// While there are running jobs, the shell waits for input in this loop too, so
+// jobs are reaped as soon as they finish even when the shell is idle.
+enum event_source {
+  EVENT_STDIN,
+  EVENT_SIGNAL,
+  EVENT_CHILD, // the low 32 bits of the event data hold the pid
+  EVENT_OUTPUT, // captured job output, the low 32 bits hold the slot and stream
+};
+
+struct event_loop {
+  int epoll_fd;
+  int signal_fd;
+  int stdin_pollable; // 0 if stdin is a regular file, which is always readable
+  int interrupt_fd; // SIGINT signalfd, read while stream stages run
+};
+
+static struct event_loop event_loop = { -1, -1, 0, -1 };
+
+// Exit status of the last foreground command, as reported by $?
+static int last_status;
+
+// Exit status requested by the exit builtin
+static int exit_code;
+
+// Set while a builtin reads a redirection or a pipe on stdin rather than the
+// shell's own stdin, which may be the rest of the commands
+static int builtin_stdin_redirected;
+
+// Resources used by one foreground process, reported by time and set timing on
+struct stage_stats {
+  const char* name;
+  pid_t pid; // 0 if the command could not be executed
+  int status;
+  struct timespec start_time;
+  struct timespec end_time;
+  struct rusage usage;
+};
+
+// The processes of the foreground command being timed, in pipeline order
+struct timing_report {
+  int active;
+  struct stage_stats* stages;
+  int num_stages;
+  int capacity;
+};
+
+static struct timing_report timing;
+
+// Pipeline profiling (the profile prefix): the shell sits in every pipe of a
+// foreground pipeline. Stage i writes into a pipe read by the shell, which
+// splices it into the pipe stage i + 1 reads from, see relay_profiled_pipeline.
+enum link_state {
+  LINK_EMPTY, // waiting for stage i to write
+  LINK_FULL,  // waiting for stage i + 1 to read
+  LINK_DONE,  // stage i closed its output or stage i + 1 its input
+};
+
+struct profile_link {
+  int from; // read end of the pipe stage i writes to, -1 once closed
+  int to;   // write end of the pipe stage i + 1 reads from, -1 once closed
+  enum link_state state;
+  uint64_t bytes;
+  uint64_t empty_ns;
+  uint64_t full_ns;
+  uint64_t end_ns; // when the link was done
+};
+
+struct pipeline_profile {
+  int active;
+  int num_stages; // 0 until a pipeline was set up for profiling
+  struct profile_link* links; // num_stages - 1
+  uint64_t* limiting_ns; // per stage: time it was the one holding the pipeline back
+  uint64_t start_ns;
+};
+
+static struct pipeline_profile profile;
+
+// Closes the shell's ends of the profiled pipeline's pipes
+void close_profile_links(void) {
+  for (int i = 0; profile.links != NULL && i < profile.num_stages - 1; i++) {
+    if (profile.links[i].from != -1) {
+      close(profile.links[i].from);
+      profile.links[i].from = -1;
+    }
+    if (profile.links[i].to != -1) {
+      close(profile.links[i].to);
+      profile.links[i].to = -1;
+    }
+  }
+}
+
+// Spawn tracing, see trace.h. The ring is NULL while tracing is off, so every
+// trace point costs a single well-predicted branch.
+static struct trace_header* trace_ring;
+static uint32_t trace_command; // number of the command line being run
+
+uint64_t trace_clock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void write_trace_record(enum trace_phase phase, pid_t pid, int value, uint64_t time_ns) {
+  struct trace_record* records = (struct trace_record*)(trace_ring + 1);
+  uint64_t index = __atomic_fetch_add(&trace_ring->head, 1, __ATOMIC_RELAXED);
+  struct trace_record* record = &records[index & (trace_ring->capacity - 1)];
+
+  __atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  record->time_ns = time_ns;
+  record->command = trace_command;
+  record->pid = pid;
+  record->phase = phase;
+  record->value = value;
+  __atomic_store_n(&record->seq, index + 1, __ATOMIC_RELEASE);
+}
+
+static inline void trace_event(enum trace_phase phase, pid_t pid, int value) {
+  if (__builtin_expect(trace_ring != NULL, 0)) {
+    write_trace_record(phase, pid, value, trace_clock());
+  }
+}
+
+// returns the time a spawn starts at, 0 while tracing is off
+static inline uint64_t trace_spawn_start(void) {
+  return __builtin_expect(trace_ring != NULL, 0) ? trace_clock() : 0;
+}
+
+// Records the spawn of pid that started at spawn_start, and that it is done now
+static inline void trace_spawned(pid_t pid, uint64_t spawn_start) {
+  if (__builtin_expect(trace_ring != NULL, 0) && spawn_start != 0) {
+    write_trace_record(TRACE_SPAWN, pid, 0, spawn_start);
+    write_trace_record(TRACE_SPAWNED, pid, 0, trace_clock());
+  }
+}
+
+// Records the exit of the child waitid reported in info, with its wait status
+static inline void trace_child_exit(const siginfo_t* info) {
+  if (__builtin_expect(trace_ring != NULL, 0)) {
+    int status = info->si_code == CLD_EXITED ? (info->si_status & 0xff) << 8
+               : info->si_code == CLD_DUMPED ? info->si_status | WCOREFLAG
+               : info->si_status;
+    write_trace_record(TRACE_EXIT, info->si_pid, status, trace_clock());
+  }
+}
+
+// Records the exit of pid, which has exited but is not reaped yet
+static inline void trace_exited(pid_t pid) {
+  if (__builtin_expect(trace_ring != NULL, 0)) {
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    if (waitid(P_PID, pid, &info, WEXITED | WNOWAIT | WNOHANG) == 0 && info.si_pid == pid) {
+      trace_child_exit(&info);
+    }
+  }
+}
 
-#define MAX_PIPES 9
-#define MAX_COMMANDS (MAX_PIPES + 1)
+void stop_trace(void) {
+  if (trace_ring != NULL) {
+    munmap(trace_ring, sizeof(struct trace_header) + (size_t)trace_ring->capacity * sizeof(struct trace_record));
+    trace_ring = NULL;
+  }
+}
+
+// Starts tracing into a new ring of records entries (a power of two) in path
+// returns 1 on success, 0 with errno set on failure
+int start_trace(const char* path, uint32_t records) {
+  size_t size = sizeof(struct trace_header) + (size_t)records * sizeof(struct trace_record);
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    return 0;
+  }
+  if (ftruncate(fd, size) == -1) {
+    close(fd);
+    return 0;
+  }
+  struct trace_header* ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ring == MAP_FAILED) {
+    return 0;
+  }
 
-void find_and_remove_zombies(int signum) {
-  while (waitpid(-1, NULL, WNOHANG) > 0) {
-    // This loop will remove all terminated child processes.
-    // In the moment that there is no child process to remove, the loop will stop
-    // and execution will continue.
-  };
+  stop_trace();
+  ring->record_size = sizeof(struct trace_record);
+  ring->capacity = records;
+  ring->head = 0;
+  __atomic_store_n(&ring->magic, TRACE_MAGIC, __ATOMIC_RELEASE);
+  trace_ring = ring;
+  return 1;
 }
 
-// returns 1 if waitpid was successful or if it failed with ECHILD or EINTR, 
+// returns 1 if wait4 was successful or if it failed with ECHILD or EINTR, 
 // returns 0 if it failed with any other error
-int waitpid_which_allows_echild_eintr_errors(pid_t pid, int *status, int options) {
-  if (waitpid(pid, status, options) == -1) {
+int wait4_which_allows_echild_eintr_errors(pid_t pid, int *status, int options, struct rusage* usage) {
+  if (wait4(pid, status, options, usage) == -1) {
       if (errno == ECHILD || errno == EINTR) {
           return 1;
       } else {
-          perror("error in waitpid");
+          perror("error in wait4");
           return 0;
       }
   }
   return 1;
 }
 
-void execute_command(char** arglist, int is_background) {
-  if (is_background != 0) {
-    signal(SIGINT, SIG_IGN); 
-  } else {
-    signal(SIGINT, SIG_DFL);
+int exit_code_of(int status) {
+  if (WIFSIGNALED(status)) {
+    return 128 + WTERMSIG(status);
   }
-
-  execvp(arglist[0], arglist); 
-  perror("error in execute_command execvp"); // This row and the row below only run if execvp fails
-  exit(1);
+  return WEXITSTATUS(status);
 }
 
-int setup_and_execute_pipeline(char** commands[], int num_commands) {
-  int pipes[MAX_PIPES][2];
-  pid_t pids[MAX_COMMANDS];
-  
-  // Create all the necessary pipes
-  for (int i = 0; i < num_commands - 1; i++) {
-    if (pipe(pipes[i]) == -1) { // This creates a pipe with two file descriptors and stores them in pipes[i]
-      perror("error in setup_and_execute_pipeline pipe creation");
-      return 0;
+// Adds a foreground process started at start_time to the timing report.
+// returns its entry, or NULL when nothing is being timed
+struct stage_stats* add_stage(char** argv, const struct timespec* start_time) {
+  if (!timing.active) {
+    return NULL;
+  }
+  if (timing.num_stages == timing.capacity) {
+    int capacity = timing.capacity == 0 ? 8 : timing.capacity * 2;
+    struct stage_stats* stages = realloc(timing.stages, sizeof(struct stage_stats) * capacity);
+    if (stages == NULL) {
+      return NULL;
     }
+    timing.stages = stages;
+    timing.capacity = capacity;
   }
-  
-  // Create child processes for each command
-  for (int i = 0; i < num_commands; i++) {
-    pids[i] = fork();
-    
-    if (pids[i] < 0) {
-      perror("error in setup_and_execute_pipeline fork");
-      return 0;
-    } else if (pids[i] == 0) {
-      // Child process
 
-      // Set up stdin from previous pipe if not the first command
-      if (i > 0) {
-        dup2(pipes[i-1][0], STDIN_FILENO);
-      }
-      
-      // Set up stdout to next pipe if not the last command
-      if (i < num_commands - 1) {
-        dup2(pipes[i][1], STDOUT_FILENO);
-      }
-      
-      // Close all pipe file descriptors (will not close for other processes)
-      // No need for them because we already redirected the stdin and stdout
-      for (int j = 0; j < num_commands - 1; j++) {
-        close(pipes[j][0]);
-        close(pipes[j][1]);
+  struct stage_stats* stage = &timing.stages[timing.num_stages++];
+  memset(stage, 0, sizeof(*stage));
+  stage->name = argv[0];
+  stage->start_time = *start_time;
+  stage->end_time = *start_time;
+  stage->status = 1 << 8;
+  return stage;
+}
+
+// Fills in how a timed process ended, now
+void finish_stage(struct stage_stats* stage, pid_t pid, int status, const struct rusage* usage) {
+  if (stage == NULL) {
+    return;
+  }
+  stage->pid = pid;
+  stage->status = status;
+  stage->usage = *usage;
+  clock_gettime(CLOCK_MONOTONIC, &stage->end_time);
+}
+
+double timespec_seconds(const struct timespec* start, const struct timespec* end) {
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+double timeval_seconds(const struct timeval* time) {
+  return time->tv_sec + time->tv_usec / 1e6;
+}
+
+void print_usage_line(const char* label, double real, const struct rusage* usage) {
+  fprintf(stderr, "%-12s real %.3fs user %.3fs sys %.3fs maxrss %ldKB ctxsw %ld/%ld\n", label, real,
+          timeval_seconds(&usage->ru_utime), timeval_seconds(&usage->ru_stime), usage->ru_maxrss,
+          usage->ru_nvcsw, usage->ru_nivcsw);
+}
+
+// Prints what the timed command used to stderr: one line for the whole command,
+// followed with per_stage by one line per process for pipelines. A command that
+// did not start any process (a builtin) is reported with the shell's own CPU time.
+void print_timing_report(const struct timespec* start_time, const struct rusage* self_before, int per_stage) {
+  struct timespec end_time;
+  struct rusage total;
+
+  clock_gettime(CLOCK_MONOTONIC, &end_time);
+  memset(&total, 0, sizeof(total));
+  if (timing.num_stages == 0) {
+    getrusage(RUSAGE_SELF, &total);
+    timersub(&total.ru_utime, &self_before->ru_utime, &total.ru_utime);
+    timersub(&total.ru_stime, &self_before->ru_stime, &total.ru_stime);
+    total.ru_nvcsw -= self_before->ru_nvcsw;
+    total.ru_nivcsw -= self_before->ru_nivcsw;
+  }
+  for (int i = 0; i < timing.num_stages; i++) {
+    const struct rusage* usage = &timing.stages[i].usage;
+    timeradd(&total.ru_utime, &usage->ru_utime, &total.ru_utime);
+    timeradd(&total.ru_stime, &usage->ru_stime, &total.ru_stime);
+    total.ru_maxrss = usage->ru_maxrss > total.ru_maxrss ? usage->ru_maxrss : total.ru_maxrss;
+    total.ru_nvcsw += usage->ru_nvcsw;
+    total.ru_nivcsw += usage->ru_nivcsw;
+  }
+
+  print_usage_line("time:", timespec_seconds(start_time, &end_time), &total);
+  for (int i = 0; per_stage && i < timing.num_stages && timing.num_stages > 1; i++) {
+    char label[32];
+    snprintf(label, sizeof(label), "  [%d] %.6s", i, timing.stages[i].name);
+    print_usage_line(label, timespec_seconds(&timing.stages[i].start_time, &timing.stages[i].end_time),
+                     &timing.stages[i].usage);
+  }
+}
+
+// setrlimit resource, name, unit and option (as in ulimit, for set joblimit and
+// the limit prefix) of every enum limit_resource
+struct limit_kind {
+  int resource;
+  const char* name;
+  const char* unit;
+  char option;
+};
+
+static const struct limit_kind limit_kinds[NUM_LIMITS] = {
+  [LIMIT_AS] = { RLIMIT_AS, "as", "bytes", 'v' },
+  [LIMIT_CPU] = { RLIMIT_CPU, "cpu", "s", 't' },
+  [LIMIT_NOFILE] = { RLIMIT_NOFILE, "nofile", "files", 'n' },
+  [LIMIT_NPROC] = { RLIMIT_NPROC, "nproc", "processes", 'u' },
+};
+
+// Limits of a limit prefix, for the command after it
+static struct resource_limits limit_prefix;
+
+// Fills limits with the ones the next process gets: the set joblimit defaults
+// for a process of a job (is_job), then the limit prefix on top of them
+void current_limits(int is_job, struct resource_limits* limits) {
+  memset(limits, 0, sizeof(*limits));
+  if (is_job) {
+    *limits = settings.job_limits;
+  }
+  for (int i = 0; i < NUM_LIMITS; i++) {
+    if (limit_prefix.set & (1u << i)) {
+      limits->values[i] = limit_prefix.values[i];
+      limits->set |= 1u << i;
+      if (limit_prefix.values[i] == RLIM_INFINITY) {
+        limits->set &= ~(1u << i);
       }
-      
-      execute_command(commands[i], 0);
     }
   }
+}
 
-  // Parent process
-  // Close all pipe file descriptors
-  for (int i = 0; i < num_commands - 1; i++) {
-    close(pipes[i][0]);
-    close(pipes[i][1]);
+// Writes the limits in limits to buffer as "as 1073741824 bytes, cpu 10 s"
+void format_limits(const struct resource_limits* limits, char* buffer, size_t size) {
+  size_t length = 0;
+  buffer[0] = '\0';
+  for (int i = 0; i < NUM_LIMITS && length < size; i++) {
+    if (limits->set & (1u << i)) {
+      length += snprintf(buffer + length, size - length, "%s%s %llu %s", length > 0 ? ", " : "",
+                         limit_kinds[i].name, (unsigned long long)limits->values[i], limit_kinds[i].unit);
+    }
   }
-  
-  // Wait for all child processes to finish
-  for (int i = 0; i < num_commands; i++) {
-    if (waitpid_which_allows_echild_eintr_errors(pids[i], NULL, 0) == 0) {
+}
+
+// Tells on stderr which limit most likely ended a process started with limits.
+// SIGXCPU, or SIGKILL once past the hard limit, is the CPU limit. A crash is
+// most likely an allocation refused under the address space limit. Running out
+// of files or processes only shows as an error of the command itself, which
+// cannot be told apart from any other failure, so nothing else is reported.
+// id is 0 outside of jobs.
+void report_limit_exit(int id, pid_t pid, const char* command, int status, const struct rusage* usage,
+                       const struct resource_limits* limits) {
+  int sig = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+  char reason[256];
+
+  if (limits->set == 0 || sig == 0) {
+    return;
+  }
+  double cpu = timeval_seconds(&usage->ru_utime) + timeval_seconds(&usage->ru_stime);
+  if ((limits->set & (1u << LIMIT_CPU)) &&
+      (sig == SIGXCPU || (sig == SIGKILL && cpu >= limits->values[LIMIT_CPU]))) {
+    snprintf(reason, sizeof(reason), "killed by its cpu limit of %llu s (%s)",
+             (unsigned long long)limits->values[LIMIT_CPU], strsignal(sig));
+  } else if ((limits->set & (1u << LIMIT_AS)) && (sig == SIGSEGV || sig == SIGBUS || sig == SIGABRT)) {
+    snprintf(reason, sizeof(reason), "%s, most likely from its as limit of %llu bytes", strsignal(sig),
+             (unsigned long long)limits->values[LIMIT_AS]);
+  } else {
+    return;
+  }
+  if (id != 0) {
+    fprintf(stderr, "[%d] ", id);
+  }
+  fprintf(stderr, "%d %s: %s\n", pid, command != NULL ? command : "", reason);
+}
+
+struct job* find_job_by_pid(pid_t pid) {
+  if (job_table.index_size == 0) {
+    return NULL;
+  }
+  int mask = job_table.index_size - 1;
+  for (int slot = pid & mask; job_table.index[slot] != 0; slot = (slot + 1) & mask) {
+    struct job* job = &job_table.jobs[job_table.index[slot] - 1];
+    if (job->pid == pid && job->running) { // A finished job's pid may have been reused
+      return job;
+    }
+  }
+  return NULL;
+}
+
+// Rebuilds the pid index, at least twice as big as the job table
+// returns 0 on allocation failure
+int rebuild_job_index(int min_jobs) {
+  int size = JOB_INDEX_INITIAL_SIZE;
+  while (size < min_jobs * 2) {
+    size *= 2;
+  }
+  if (size != job_table.index_size) {
+    int* index = malloc(sizeof(int) * size);
+    if (index == NULL) {
       return 0;
     }
+    free(job_table.index);
+    job_table.index = index;
+    job_table.index_size = size;
   }
 
+  memset(job_table.index, 0, sizeof(int) * job_table.index_size);
+  for (int i = 0; i < job_table.num_jobs; i++) {
+    int slot = job_table.jobs[i].pid & (job_table.index_size - 1);
+    while (job_table.index[slot] != 0) {
+      slot = (slot + 1) & (job_table.index_size - 1);
+    }
+    job_table.index[slot] = i + 1;
+  }
   return 1;
 }
 
-int execute_background_command(char** arglist, int background_pos) {
-  pid_t pid = fork();
-  
-  if (pid == 0) { 
-    // Child process
+// Joins argv into a single string for the job listing
+char* join_arglist(char** arglist) {
+  size_t length = 1;
+  for (int i = 0; arglist[i] != NULL; i++) {
+    length += strlen(arglist[i]) + 1;
+  }
+  char* command = malloc(length);
+  if (command == NULL) {
+    return NULL;
+  }
+  command[0] = '\0';
+  for (int i = 0; arglist[i] != NULL; i++) {
+    if (i > 0) {
+      strcat(command, " ");
+    }
+    strcat(command, arglist[i]);
+  }
+  return command;
+}
+
+// Adds a job for process pid running arglist. The processes of a background
+// pipeline are one job each sharing the job id, id is 0 to take a new one.
+// returns the new job, or NULL on allocation failure
+struct job* add_job(pid_t pid, char** arglist, int id) {
+  if (job_table.num_jobs == job_table.capacity) {
+    int capacity = job_table.capacity == 0 ? JOB_INDEX_INITIAL_SIZE : job_table.capacity * 2;
+    struct job* jobs = realloc(job_table.jobs, sizeof(struct job) * capacity);
+    if (jobs == NULL) {
+      return NULL;
+    }
+    job_table.jobs = jobs;
+    job_table.capacity = capacity;
+  }
+  if ((job_table.num_jobs + 1) * 2 > job_table.index_size && !rebuild_job_index(job_table.num_jobs + 1)) {
+    return NULL;
+  }
+  if (job_table.num_jobs == 0) {
+    job_table.next_id = 1;
+  }
 
-    arglist[background_pos] = NULL; 
-    execute_command(arglist, 1); 
-  } else if (pid > 0) { 
-    // Parent process
+  struct job* job = &job_table.jobs[job_table.num_jobs++];
+  memset(job, 0, sizeof(*job));
+  job->id = id != 0 ? id : job_table.next_id++;
+  job->pid = pid;
+  job->command = join_arglist(arglist);
+  job->running = 1;
+  job->pidfd = -1;
+  clock_gettime(CLOCK_MONOTONIC, &job->start_time);
+  current_limits(1, &job->limits);
+  job_table.num_running++;
+
+  int slot = pid & (job_table.index_size - 1);
+  while (job_table.index[slot] != 0) {
+    slot = (slot + 1) & (job_table.index_size - 1);
+  }
+  job_table.index[slot] = job_table.num_jobs;
+  return job;
+}
 
-    // Do not wait for the child process to finish
-    return 1;
+void record_job_exit(pid_t pid, int status, const struct rusage* usage, const struct timespec* end_time) {
+  struct job* job = find_job_by_pid(pid);
+  if (job == NULL) {
+    return; // Not a background job
+  }
+  job->running = 0;
+  job->status = status;
+  job->usage = *usage;
+  job->end_time = *end_time;
+  job_table.num_running--;
+  if (job->pidfd != -1) {
+    close(job->pidfd); // Also removes it from the epoll set
+    job->pidfd = -1;
   } else {
-    perror("error in background option fork exec");
-    return 0;
+    job_table.num_without_pidfd--;
   }
-  
-  return 1; 
+  report_limit_exit(job->id, job->pid, job->command, status, usage, &job->limits);
 }
 
-int execute_command_with_pipes(char** arglist, int pipe_positions[], int num_pipes) {
-  char** commands[MAX_COMMANDS];
-  
-  // We will save a pointer to each command in the commands array 
-  // The location where each command starts is determined by the pipe positions 
-  // We will also put NULL at the end of each command (will replace the pipe symbol)
+// Adds a process that was waited for in the foreground as a finished job, so
+// that jobs and wait report its status like a background job's
+// returns the new job, or NULL on allocation failure
+struct job* add_finished_job(pid_t pid, char** arglist, int id, int status, const struct rusage* usage,
+                             const struct timespec* start_time) {
+  struct job* job = add_job(pid, arglist, id);
+  if (job == NULL) {
+    return NULL;
+  }
+  job->running = 0;
+  job->status = status;
+  job->usage = *usage;
+  job->start_time = *start_time;
+  clock_gettime(CLOCK_MONOTONIC, &job->end_time);
+  job_table.num_running--;
+  report_limit_exit(job->id, job->pid, job->command, status, usage, &job->limits);
+  return job;
+}
 
-  // Prepare the first command (from start to first pipe)
-  commands[0] = arglist;
-  arglist[pipe_positions[0]] = NULL;
-  
-  // Prepare middle commands 
-  for (int i = 1; i < num_pipes; i++) {
-    commands[i] = &arglist[pipe_positions[i-1] + 1];
-    arglist[pipe_positions[i]] = NULL;
+// Reaps job if it has finished, without blocking
+void reap_job(struct job* job) {
+  int status;
+  struct rusage usage;
+  struct timespec end_time;
+
+  if (job->running && wait4(job->pid, &status, WNOHANG, &usage) == job->pid) {
+    trace_event(TRACE_REAP, job->pid, status);
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    record_job_exit(job->pid, status, &usage, &end_time);
   }
-  
-  // Prepare the last command (after the last pipe)
-  commands[num_pipes] = &arglist[pipe_positions[num_pipes-1] + 1];
-  
-  // Execute all piped commands
-  return setup_and_execute_pipeline(commands, num_pipes + 1);
 }
 
-int execute_input_redirection(char** arglist, int redirection_position) {
-  pid_t pid = fork();
-  
-  if (pid == 0) { // Child process
-    // Open the input file
-    int fd = open(arglist[redirection_position + 1], O_RDONLY);
-    if (fd == -1) {
-      perror("error in execute_input_redirection open");
-      exit(1);
+// Reaps the jobs that have no pidfd, after a SIGCHLD
+void reap_jobs_without_pidfd(void) {
+  for (int j = 0; j < job_table.num_jobs && job_table.num_without_pidfd > 0; j++) {
+    if (job_table.jobs[j].pidfd == -1) {
+      reap_job(&job_table.jobs[j]);
     }
-    
-    // Redirect stdin to the file
-    dup2(fd, STDIN_FILENO);
-    close(fd);
-    
-    // Remove redirection symbols from arguments
-    arglist[redirection_position] = NULL;
-    
-    // Execute the command
-    execute_command(arglist, 0);
-  } else if (pid > 0) { // Parent process
-    // Wait for the child to complete
-    return waitpid_which_allows_echild_eintr_errors(pid, NULL, 0);
-  } else {
-    perror("error in execute_input_redirection fork exec");
-    return 0;
   }
-  
-  return 1; 
 }
 
-int execute_output_redirection(char** arglist, int redirection_position) {
-  pid_t pid = fork();
-  
-  if (pid == 0) { // Child process
-    // Open the output file, create if it doesn't exist, truncate if it does
-    int fd = open(arglist[redirection_position + 1], O_WRONLY | O_CREAT | O_TRUNC, 0600);
-    if (fd == -1) {
-      perror("error in execute_output_redirection open");
-      exit(1);
+// Captured output of background jobs (set joboutput lines|jobs). The stdout and
+// stderr of a background command go to pipes read by the shell instead of the
+// terminal, so that the output of parallel jobs is not interleaved at random
+// bytes. With lines, the complete lines read are written out right away; with
+// jobs, the whole output of a job is held until both pipes are at EOF and then
+// written out, stdout first. Held output is kept in memory up to
+// settings.job_output_memory bytes in all; past that the biggest streams go to
+// unlinked temporary files, and their pipes are spliced there from then on.
+// The read ends are in an epoll set of their own. The event loop watches that
+// set, and the shell keeps relaying while it waits for a child, so a job never
+// stalls on a full pipe behind a long foreground command.
+struct output_stream {
+  int fd;        // read end of the pipe, -1 at EOF
+  int target;    // STDOUT_FILENO or STDERR_FILENO
+  char* data;    // output held in memory
+  size_t length;
+  size_t capacity;
+  int spill_fd;  // file the output goes to once spilled, -1 before
+  off_t spilled; // bytes in spill_fd, they come before data
+};
+
+// The output of one background command
+struct output_capture {
+  int in_use;
+  int job_id;
+  enum job_output_mode mode;
+  struct output_stream streams[2]; // stdout, stderr
+};
+
+struct output_mux {
+  int epoll_fd;
+  struct output_capture* captures; // event data is (slot << 1) | stream
+  int num_slots;
+  int num_open; // captures with a stream not at EOF yet
+  size_t held;  // bytes held in memory by all the streams
+};
+
+static struct output_mux output_mux = { -1, NULL, 0, 0, 0 };
+
+// returns 1 if all of data was written to fd, 0 with errno set otherwise
+int write_all(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 0;
     }
-    
-    // Redirect stdout to the file
-    dup2(fd, STDOUT_FILENO);
-    close(fd);
-    
-    // Remove redirection symbols from arguments
-    arglist[redirection_position] = NULL;
-    
-    // Execute the command
-    execute_command(arglist, 0);
-  } else if (pid > 0) { // Parent process
-    // Wait for the child to complete
-    return waitpid_which_allows_echild_eintr_errors(pid, NULL, 0);
-  } else {
-    perror("error in execute_output_redirection fork exec");
+    data += written;
+    size -= written;
+  }
+  return 1;
+}
+
+// returns an unlinked read-write file in $TMPDIR (or /tmp), -1 on failure
+int open_spill_file(void) {
+  const char* dir = getenv("TMPDIR");
+  if (dir == NULL || dir[0] == '\0') {
+    dir = "/tmp";
+  }
+  int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    // No O_TMPFILE on this file system
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/myshell-output-XXXXXX", dir);
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd != -1) {
+      unlink(path);
+    }
+  }
+  return fd;
+}
+
+// Moves what stream holds in memory to its spill file
+// returns 0 if the file could not be written, the output then stays in memory
+int spill_stream(struct output_stream* stream) {
+  if (stream->spill_fd == -1 && (stream->spill_fd = open_spill_file()) == -1) {
+    perror("error in spill_stream open");
     return 0;
   }
-  
-  return 1; 
+  if (!write_all(stream->spill_fd, stream->data, stream->length)) {
+    perror("error in spill_stream write");
+    return 0;
+  }
+  stream->spilled += stream->length;
+  output_mux.held -= stream->length;
+  free(stream->data);
+  stream->data = NULL;
+  stream->length = stream->capacity = 0;
+  return 1;
 }
 
-int execute_standard_command(char** arglist) {
-  pid_t pid = fork();
-  
-  if (pid == 0) { // Child process
-    execute_command(arglist, 0);
-  } else if (pid > 0) { // Parent process
-    return waitpid_which_allows_echild_eintr_errors(pid, NULL, 0);
+// Spills the streams holding the most until the held output fits in memory again
+void spill_biggest_streams(void) {
+  while (output_mux.held > settings.job_output_memory) {
+    struct output_stream* biggest = NULL;
+    for (int i = 0; i < output_mux.num_slots; i++) {
+      for (int j = 0; j < 2; j++) {
+        struct output_stream* stream = &output_mux.captures[i].streams[j];
+        if (output_mux.captures[i].in_use && (biggest == NULL || stream->length > biggest->length)) {
+          biggest = stream;
+        }
+      }
+    }
+    if (biggest == NULL || biggest->length == 0 || !spill_stream(biggest)) {
+      return;
+    }
+  }
+}
+
+// Writes out and forgets everything stream holds, the spilled part first
+void flush_stream(struct output_stream* stream) {
+  fflush(stdout);
+  fflush(stderr);
+  if (stream->spill_fd != -1) {
+    off_t offset = 0;
+    while (offset < stream->spilled) {
+      ssize_t sent = sendfile(stream->target, stream->spill_fd, &offset, stream->spilled - offset);
+      if (sent == -1 && errno == EINTR) {
+        continue;
+      }
+      if (sent <= 0) {
+        // sendfile does not take every kind of output, copy the rest by hand
+        char buffer[JOB_OUTPUT_READ_SIZE];
+        ssize_t bytes;
+        while ((bytes = pread(stream->spill_fd, buffer, sizeof(buffer), offset)) > 0 &&
+               write_all(stream->target, buffer, bytes)) {
+          offset += bytes;
+        }
+        break;
+      }
+    }
+    close(stream->spill_fd);
+    stream->spill_fd = -1;
+    stream->spilled = 0;
+  }
+  write_all(stream->target, stream->data, stream->length);
+  output_mux.held -= stream->length;
+  stream->length = 0;
+}
+
+// A stream reached EOF: the capture is done once both have
+void end_stream(struct output_capture* capture, struct output_stream* stream) {
+  close(stream->fd); // Also removes it from the epoll set
+  stream->fd = -1;
+  if (capture->mode == JOB_OUTPUT_LINES) {
+    flush_stream(stream); // An unterminated last line
+  }
+  if (capture->streams[0].fd != -1 || capture->streams[1].fd != -1) {
+    return;
+  }
+  for (int i = 0; i < 2; i++) {
+    flush_stream(&capture->streams[i]);
+    free(capture->streams[i].data);
+  }
+  capture->in_use = 0;
+  output_mux.num_open--;
+}
+
+// Reads what is available on stream and writes out what the capture's mode allows
+void relay_stream(struct output_capture* capture, struct output_stream* stream) {
+  ssize_t bytes;
+
+  if (stream->spill_fd != -1) {
+    bytes = splice(stream->fd, NULL, stream->spill_fd, NULL, JOB_OUTPUT_SPLICE_SIZE,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (bytes > 0) {
+      stream->spilled += bytes;
+      return;
+    }
   } else {
-    perror("error in default option fork exec");
-    return 0;
+    if (stream->capacity - stream->length < JOB_OUTPUT_READ_SIZE) {
+      size_t capacity = stream->capacity == 0 ? JOB_OUTPUT_READ_SIZE : stream->capacity * 2;
+      char* data = realloc(stream->data, capacity);
+      if (data != NULL) {
+        stream->data = data;
+        stream->capacity = capacity;
+      } else if (capture->mode != JOB_OUTPUT_JOBS || !spill_stream(stream)) {
+        flush_stream(stream); // Out of memory, give up on keeping it whole
+      }
+      if (stream->capacity == stream->length && stream->spill_fd == -1) {
+        perror("error in relay_stream realloc");
+        end_stream(capture, stream);
+        return;
+      }
+      if (stream->spill_fd != -1) {
+        return; // Spliced at the next event
+      }
+    }
+    bytes = read(stream->fd, stream->data + stream->length, stream->capacity - stream->length);
+    if (bytes > 0) {
+      stream->length += bytes;
+      output_mux.held += bytes;
+      if (capture->mode == JOB_OUTPUT_LINES) {
+        const char* newline = memrchr(stream->data + stream->length - bytes, '\n', bytes);
+        if (newline == NULL && stream->length >= JOB_OUTPUT_MAX_LINE) {
+          flush_stream(stream);
+        } else if (newline != NULL) {
+          size_t lines = newline + 1 - stream->data;
+          fflush(stdout);
+          fflush(stderr);
+          write_all(stream->target, stream->data, lines);
+          memmove(stream->data, stream->data + lines, stream->length - lines);
+          stream->length -= lines;
+          output_mux.held -= lines;
+        }
+      } else if (output_mux.held > settings.job_output_memory) {
+        spill_biggest_streams();
+      }
+      return;
+    }
   }
-  
-  return 1; 
+
+  if (bytes == -1 && (errno == EAGAIN || errno == EINTR)) {
+    return;
+  }
+  end_stream(capture, stream);
 }
 
-int prepare(void) {
-  struct sigaction sa;
-  memset(&sa, 0, sizeof(sa)); 
-  sigemptyset(&sa.sa_mask); 
-  sa.sa_flags = SA_RESTART; 
-  sa.sa_handler = find_and_remove_zombies; 
+// Relays the captured output that is ready, waiting at most timeout milliseconds.
+// A SIGCHLD ends the wait too: the signalfd is drained and the jobs without a
+// pidfd are reaped right here, so that it never stays readable and wakes every
+// later wait at once.
+// returns 1 if a SIGCHLD arrived meanwhile
+int relay_job_output(int timeout) {
+  struct epoll_event events[MAX_EVENTS];
+  int child_signal = 0;
+
+  int num_events = epoll_wait(output_mux.epoll_fd, events, MAX_EVENTS, timeout);
+  for (int i = 0; i < num_events; i++) {
+    if (events[i].data.u64 >> 32 == EVENT_SIGNAL) {
+      struct signalfd_siginfo signal_info;
+      while (read(event_loop.signal_fd, &signal_info, sizeof(signal_info)) == sizeof(signal_info)) {
+        // Only drained, the caller looks at its children itself
+      }
+      reap_jobs_without_pidfd();
+      child_signal = 1;
+      continue;
+    }
+    uint32_t id = (uint32_t)events[i].data.u64;
+    struct output_capture* capture = &output_mux.captures[id >> 1];
+    struct output_stream* stream = &capture->streams[id & 1];
+    if (capture->in_use && stream->fd != -1) {
+      relay_stream(capture, stream);
+    }
+  }
+  return child_signal;
+}
 
-  // Set up the signal handler for SIGCHLD that will remove zombie processes whenever 
-  // a child process terminates
-  if (sigaction(SIGCHLD, &sa, NULL) == -1) {
-      perror("error in prepare SIGCHLD sigaction");
-      return 1;
+// Sets up the pipes for the output of a new background command, the command
+// gets their write ends out_fd and err_fd (to be closed by the caller)
+// returns the capture's slot, -1 if it could not be set up (the command then
+// writes to the terminal)
+int start_output_capture(int* out_fd, int* err_fd) {
+  int slot = 0;
+
+  if (output_mux.epoll_fd == -1) {
+    output_mux.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = { EPOLLIN, { .u64 = (uint64_t)EVENT_OUTPUT << 32 } };
+    if (output_mux.epoll_fd == -1 ||
+        epoll_ctl(event_loop.epoll_fd, EPOLL_CTL_ADD, output_mux.epoll_fd, &event) == -1) {
+      perror("error in start_output_capture epoll");
+      if (output_mux.epoll_fd != -1) {
+        close(output_mux.epoll_fd);
+        output_mux.epoll_fd = -1;
+      }
+      return -1;
+    }
+    // Wakes relay_job_output when a child exits, see peek_child_exit
+    event.data.u64 = (uint64_t)EVENT_SIGNAL << 32;
+    epoll_ctl(output_mux.epoll_fd, EPOLL_CTL_ADD, event_loop.signal_fd, &event);
   }
 
-  // Change the signal handler to ignore SIGINT so the shell doesn't terminate on Ctrl+C
-  sa.sa_handler = SIG_IGN; 
-  if (sigaction(SIGINT, &sa, NULL) == -1) {
-      perror("error in prepare SIGINT sigaction");
-      return 1;
+  while (slot < output_mux.num_slots && output_mux.captures[slot].in_use) {
+    slot++;
+  }
+  if (slot == output_mux.num_slots) {
+    int num_slots = output_mux.num_slots == 0 ? 16 : output_mux.num_slots * 2;
+    struct output_capture* captures = realloc(output_mux.captures, sizeof(struct output_capture) * num_slots);
+    if (captures == NULL) {
+      perror("error in start_output_capture realloc");
+      return -1;
+    }
+    memset(captures + output_mux.num_slots, 0, sizeof(struct output_capture) * (num_slots - output_mux.num_slots));
+    output_mux.captures = captures;
+    output_mux.num_slots = num_slots;
   }
 
-  return 0;
+  struct output_capture* capture = &output_mux.captures[slot];
+  int write_fds[2] = { -1, -1 };
+  memset(capture, 0, sizeof(*capture));
+  capture->mode = settings.job_output;
+  for (int i = 0; i < 2; i++) {
+    struct output_stream* stream = &capture->streams[i];
+    int pipe_fds[2];
+    stream->fd = stream->spill_fd = -1;
+    stream->target = i == 0 ? STDOUT_FILENO : STDERR_FILENO;
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+      perror("error in start_output_capture pipe");
+      break;
+    }
+    // Only the shell's end is non-blocking
+    fcntl(pipe_fds[0], F_SETFL, O_NONBLOCK);
+    struct epoll_event event = { EPOLLIN, { .u64 = ((uint64_t)EVENT_OUTPUT << 32) | (uint32_t)(slot << 1 | i) } };
+    if (epoll_ctl(output_mux.epoll_fd, EPOLL_CTL_ADD, pipe_fds[0], &event) == -1) {
+      perror("error in start_output_capture epoll_ctl");
+      close(pipe_fds[0]);
+      close(pipe_fds[1]);
+      break;
+    }
+    stream->fd = pipe_fds[0];
+    write_fds[i] = pipe_fds[1];
+  }
+  if (write_fds[1] == -1) {
+    for (int i = 0; i < 2; i++) {
+      if (capture->streams[i].fd != -1) {
+        close(capture->streams[i].fd);
+        close(write_fds[i]);
+      }
+    }
+    return -1;
+  }
+
+  capture->in_use = 1;
+  output_mux.num_open++;
+  *out_fd = write_fds[0];
+  *err_fd = write_fds[1];
+  return slot;
 }
 
-int process_arglist(int count, char** arglist) {
-  int background = 0;
-  int redirection_in_position = -1;
-  int redirection_out_position = -1;
-  int num_pipes = 0;
-  int pipe_positions[MAX_PIPES];
+// Relays the output of job id until its pipes are at EOF
+void drain_job_output(int id) {
+  for (int i = 0; i < output_mux.num_slots; i++) {
+    while (output_mux.captures[i].in_use && output_mux.captures[i].job_id == id) {
+      relay_job_output(-1);
+    }
+  }
+}
 
-  // Find special symbols and store their positions
-  for (int i = 0; i < count; i++) {
-    if (strcmp(arglist[i], "&") == 0) {
-      background = i;
+// Writes out whatever output is held, for when the shell exits. Jobs still
+// running would die of SIGPIPE at their next write once the shell closed their
+// pipes, so a process of its own takes over relaying their output until they
+// are done (without it, what they held so far is written out).
+void stop_job_output(void) {
+  if (output_mux.epoll_fd == -1) {
+    return;
+  }
+  relay_job_output(0);
+  pid_t relay = -1;
+  if (output_mux.num_open > 0) {
+    fflush(stdout);
+    fflush(stderr);
+    relay = fork();
+  }
+  if (relay == 0) {
+    while (output_mux.num_open > 0) {
+      relay_job_output(-1);
     }
-    if (strcmp(arglist[i], "<") == 0) {
-      redirection_in_position = i;
+    _exit(0);
+  }
+  for (int i = 0; i < output_mux.num_slots; i++) {
+    struct output_capture* capture = &output_mux.captures[i];
+    for (int j = 0; j < 2 && capture->in_use; j++) {
+      struct output_stream* stream = &capture->streams[j];
+      if (relay > 0) {
+        // All of it belongs to the relay now
+        if (stream->fd != -1) {
+          close(stream->fd);
+        }
+        if (stream->spill_fd != -1) {
+          close(stream->spill_fd);
+        }
+        free(stream->data);
+      } else if (stream->fd != -1) {
+        end_stream(capture, stream);
+      }
     }
-    if (strcmp(arglist[i], ">") == 0) {
-      redirection_out_position = i;
+  }
+  free(output_mux.captures);
+  close(output_mux.epoll_fd);
+  output_mux.captures = NULL;
+  output_mux.num_slots = 0;
+  output_mux.epoll_fd = -1;
+}
+
+// Blocks until a child matching idtype and id has exited, like waitid with
+// WNOWAIT, relaying captured job output meanwhile. The exit is seen through the
+// SIGCHLD signalfd in the output epoll set.
+// returns 0, or -1 with errno set (ECHILD: no such child)
+int peek_child_exit(idtype_t idtype, id_t id, siginfo_t* info) {
+  while (1) {
+    int options = WEXITED | WNOWAIT | (output_mux.num_open > 0 ? WNOHANG : 0);
+    memset(info, 0, sizeof(*info));
+    if (waitid(idtype, id, info, options) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
     }
-    if (strcmp(arglist[i], "|") == 0) {
-      pipe_positions[num_pipes++] = i;
+    if (info->si_pid != 0) {
+      return 0;
     }
+    relay_job_output(-1);
   }
+}
 
-  // make sure that there are no more than 9 pipes, if there are print an error message
-  // and continue to the next command insertion
-  if (num_pipes > MAX_PIPES) {
-    perror("Too many pipes received");
-    return 1;
+// Blocks until a child has exited. Background jobs that finish meanwhile are
+// reaped into the job table; any other child is left as a zombie for the caller.
+// returns the pid of that child, or -1 if there are no children
+pid_t wait_for_any_child(void) {
+  siginfo_t info;
+
+  while (1) {
+    // WNOWAIT only looks at the child, it is reaped by pid below like everywhere else
+    if (peek_child_exit(P_ALL, 0, &info) == -1) {
+      return -1;
+    }
+    trace_child_exit(&info);
+    struct job* job = find_job_by_pid(info.si_pid);
+    if (job == NULL) {
+      return info.si_pid;
+    }
+    reap_job(job);
   }
+}
 
-  // Execute the appropriate command based on special symbols
-  if (background) {
-    return execute_background_command(arglist, background);
+// Waits for a foreground child started by spawn_command at start_time and records
+// its exit status in last_status. pid 0 means the command could not be executed.
+// returns 1 if the shell should continue, 0 if wait4 failed unexpectedly
+int wait_for_foreground(pid_t pid, char** argv, const struct timespec* start_time) {
+  int status = 127 << 8; // What the child would have exited with after a failed execvp
+  struct rusage usage;
+
+  memset(&usage, 0, sizeof(usage));
+  if (pid != 0 && (trace_ring != NULL || output_mux.num_open > 0)) {
+    // Tracing tells the exit apart from the reap, peek at the child first
+    siginfo_t info;
+    if (peek_child_exit(P_PID, pid, &info) == 0) {
+      trace_child_exit(&info);
+    }
   }
-  else if (num_pipes > 0) {
-    return execute_command_with_pipes(arglist, pipe_positions, num_pipes);
+  if (pid != 0 && wait4_which_allows_echild_eintr_errors(pid, &status, 0, &usage) == 0) {
+    return 0;
   }
-  else if (redirection_in_position != -1) {
-    return execute_input_redirection(arglist, redirection_in_position);
+  if (pid != 0) {
+    struct resource_limits limits;
+    trace_event(TRACE_REAP, pid, status);
+    current_limits(0, &limits);
+    report_limit_exit(0, pid, argv[0], status, &usage, &limits);
   }
-  else if (redirection_out_position != -1) {
-    return execute_output_redirection(arglist, redirection_out_position);
+  last_status = exit_code_of(status);
+  finish_stage(add_stage(argv, start_time), pid, status, &usage);
+  return 1;
+}
+
+// Waits for all the processes of a pipeline in the order they finish, so that
+// each one is timed when it actually ends. pids of stages that could not be
+// started are 0. $? is the exit status of the last stage, 127 if it could not be
+// executed.
+// returns 1 if the shell should continue, 0 if waiting failed unexpectedly
+int wait_for_pipeline(pid_t* pids, const struct stage_plan* stages, const struct timespec* start_times, int num_started) {
+  pid_t last_pid = pids[num_started - 1];
+  int last_stage_status = 127 << 8; // What the last stage would have exited with after a failed execvp
+  int first_stage = timing.num_stages;
+  int remaining = 0;
+  struct resource_limits limits;
+
+  current_limits(0, &limits);
+
+  // Timed stages are added up front so that the report is in pipeline order
+  for (int i = 0; i < num_started; i++) {
+    add_stage(stages[i].argv, &start_times[i]);
+    remaining += pids[i] > 0;
   }
-  else {
-    return execute_standard_command(arglist);
+
+  while (remaining > 0) {
+    pid_t pid = wait_for_any_child();
+    int status;
+    struct rusage usage;
+    if (pid == -1) {
+      perror("error in wait_for_pipeline waitid");
+      return 0;
+    }
+    if (wait4(pid, &status, 0, &usage) != pid) {
+      continue;
+    }
+    trace_event(TRACE_REAP, pid, status);
+    for (int i = 0; i < num_started; i++) {
+      if (pids[i] == pid) {
+        report_limit_exit(0, pid, stages[i].argv[0], status, &usage, &limits);
+        if (timing.active && first_stage + i < timing.num_stages) {
+          finish_stage(&timing.stages[first_stage + i], pid, status, &usage);
+        }
+        if (pid == last_pid) {
+          last_stage_status = status;
+        }
+        remaining--;
+        break;
+      }
+    }
   }
+
+  last_status = exit_code_of(last_stage_status);
+  return 1;
 }
 
-int finalize(void) {
+// Asks for a pidfd for a new background job and adds it to the epoll set
+void watch_job(struct job* job) {
+  job->pidfd = syscall(SYS_pidfd_open, job->pid, 0);
+  if (job->pidfd != -1) {
+    struct epoll_event event = { EPOLLIN, { .u64 = ((uint64_t)EVENT_CHILD << 32) | (uint32_t)job->pid } };
+    fcntl(job->pidfd, F_SETFD, FD_CLOEXEC);
+    if (epoll_ctl(event_loop.epoll_fd, EPOLL_CTL_ADD, job->pidfd, &event) == 0) {
+      return;
+    }
+    close(job->pidfd);
+    job->pidfd = -1;
+  }
+  // No pidfd (old kernel, out of descriptors): the SIGCHLD signalfd will find it
+  job_table.num_without_pidfd++;
+}
+
+// Handles the events of the event loop, waiting at most timeout milliseconds (-1 for ever)
+// returns the number of events handled, stdin_ready is set if stdin became readable
+int run_event_loop_once(int timeout, int* stdin_ready) {
+  struct epoll_event events[MAX_EVENTS];
+
+  int num_events = epoll_wait(event_loop.epoll_fd, events, MAX_EVENTS, timeout);
+  if (num_events == -1) {
+    if (errno != EINTR) {
+      perror("error in run_event_loop_once epoll_wait");
+    }
+    *stdin_ready = 1; // Let the caller go on reading input
+    return 0;
+  }
+
+  for (int i = 0; i < num_events; i++) {
+    enum event_source source = events[i].data.u64 >> 32;
+    if (source == EVENT_STDIN) {
+      *stdin_ready = 1;
+    } else if (source == EVENT_CHILD) {
+      struct job* job = find_job_by_pid((pid_t)(uint32_t)events[i].data.u64);
+      trace_exited((pid_t)(uint32_t)events[i].data.u64);
+      if (job != NULL) {
+        reap_job(job);
+      }
+    } else if (source == EVENT_OUTPUT) {
+      relay_job_output(0);
+    } else if (source == EVENT_SIGNAL) {
+      struct signalfd_siginfo info;
+      while (read(event_loop.signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        // Only drained, the pidfds say which job finished
+      }
+      reap_jobs_without_pidfd();
+    }
+  }
+  return num_events;
+}
+
+// Reaps the jobs that finished so far, without blocking
+void collect_finished_jobs(void) {
+  int stdin_ready = 0;
+
+  if (event_loop.epoll_fd == -1) {
+    return;
+  }
+  while ((job_table.num_running > 0 || output_mux.num_open > 0) &&
+         run_event_loop_once(0, &stdin_ready) == MAX_EVENTS) {
+    // More events may be pending
+  }
+}
+
+// Called by the input reader before it blocks on fd. Keeps handling child
+// events until fd is readable, so jobs are reaped while the shell is idle.
+void wait_for_input(int fd) {
+  int stdin_ready = 0;
+
+  if (fd != STDIN_FILENO || !event_loop.stdin_pollable) {
+    collect_finished_jobs();
+    return;
+  }
+  while ((job_table.num_running > 0 || output_mux.num_open > 0) && !stdin_ready) {
+    run_event_loop_once(-1, &stdin_ready);
+  }
+}
+
+// Drops the finished jobs in [0, num_jobs) for which forget is set
+void forget_jobs(const char* forget) {
+  int kept = 0;
+  for (int i = 0; i < job_table.num_jobs; i++) {
+    if (forget[i]) {
+      free(job_table.jobs[i].command);
+    } else {
+      job_table.jobs[kept++] = job_table.jobs[i];
+    }
+  }
+  job_table.num_jobs = kept;
+  rebuild_job_index(kept);
+}
+
+void print_job(const struct job* job) {
+  char state[64];
+
+  if (job->running) {
+    snprintf(state, sizeof(state), "Running");
+  } else if (WIFSIGNALED(job->status)) {
+    snprintf(state, sizeof(state), "%s", strsignal(WTERMSIG(job->status)));
+  } else if (WEXITSTATUS(job->status) != 0) {
+    snprintf(state, sizeof(state), "Exit %d", WEXITSTATUS(job->status));
+  } else {
+    snprintf(state, sizeof(state), "Done");
+  }
+  printf("[%d] %d %-12s %s\n", job->id, job->pid, state, job->command != NULL ? job->command : "");
+}
+
+// jobs - lists the background jobs, finished jobs are listed once and then forgotten
+int builtin_jobs(int count, char** arglist) {
+  (void)count;
+  (void)arglist;
+  char* forget = calloc(job_table.num_jobs + 1, 1);
+  if (forget == NULL) {
+    perror("error in builtin_jobs calloc");
+    return 1;
+  }
+
+  for (int i = 0; i < job_table.num_jobs; i++) {
+    print_job(&job_table.jobs[i]);
+    forget[i] = !job_table.jobs[i].running;
+  }
+  fflush(stdout);
+  forget_jobs(forget);
+  free(forget);
+  last_status = 0;
+  return 1;
+}
+
+// Blocks until job finishes and its captured output is written out
+void wait_for_job(struct job* job) {
+  int status;
+  struct rusage usage;
+  siginfo_t info;
+
+  if (!job->running) {
+    drain_job_output(job->id);
+    return;
+  }
+  peek_child_exit(P_PID, job->pid, &info);
+  while (wait4(job->pid, &status, 0, &usage) == -1) {
+    if (errno != EINTR) {
+      perror("error in wait_for_job wait4");
+      return;
+    }
+  }
+  trace_event(TRACE_REAP, job->pid, status);
+  struct timespec end_time;
+  clock_gettime(CLOCK_MONOTONIC, &end_time);
+  record_job_exit(job->pid, status, &usage, &end_time);
+  drain_job_output(job->id);
+}
+
+// wait      - waits for all background jobs
+// wait [%]N - waits for job N and sets $? to its exit status
+int builtin_wait(int count, char** arglist) {
+  char* forget = calloc(job_table.num_jobs + 1, 1);
+  if (forget == NULL) {
+    perror("error in builtin_wait calloc");
+    return 1;
+  }
+
+  if (count == 1) {
+    for (int i = 0; i < job_table.num_jobs; i++) {
+      wait_for_job(&job_table.jobs[i]);
+      forget[i] = 1;
+    }
+    last_status = 0;
+  } else {
+    // $? is the status of the job's last process, the end of its pipeline
+    const char* id = arglist[1][0] == '%' ? arglist[1] + 1 : arglist[1];
+    int found = 0;
+    for (int i = 0; i < job_table.num_jobs; i++) {
+      if (job_table.jobs[i].id == atoi(id)) {
+        wait_for_job(&job_table.jobs[i]);
+        last_status = exit_code_of(job_table.jobs[i].status);
+        forget[i] = 1;
+        found = 1;
+      }
+    }
+    if (!found) {
+      fprintf(stderr, "wait: no such job: %s\n", arglist[1]);
+      last_status = 127;
+    }
+  }
+
+  forget_jobs(forget);
+  free(forget);
+  return 1;
+}
+
+// Command hash: maps command names to the absolute path execvp would have found,
+// so launching a command does not walk $PATH (and fail execve in every directory
+// before the right one) each time.
+// The whole table is forgotten when PATH changes, or when one of the PATH
+// directories that is searched before a cached command's directory (or that
+// directory itself) is modified, since a command may have been added or removed.
+// A directory is checked for that at most once per command line.
+struct hash_entry {
+  char* name;   // NULL marks an empty slot
+  char* path;
+  int dir_index; // index in command_hash.dirs of the directory path lives in
+  unsigned long hits;
+};
+
+struct path_dir {
+  char* path;
+  struct timespec mtime;
+  unsigned long checked; // command_hash.epoch the mtime was last compared in
+};
+
+struct command_hash {
+  struct hash_entry* entries;
+  int size; // power of two
+  int used;
+  char* path_env; // value of PATH the table was built for
+  struct path_dir* dirs;
+  int num_dirs;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long epoch; // counts command lines, see path_dir_changed
+};
+
+static struct command_hash command_hash;
+
+unsigned long hash_string(const char* str) {
+  unsigned long hash = 14695981039346656037UL; // FNV-1a
+  while (*str != '\0') {
+    hash = (hash ^ (unsigned char)*str++) * 1099511628211UL;
+  }
+  return hash;
+}
+
+void forget_hashed_commands(void) {
+  for (int i = 0; i < command_hash.size; i++) {
+    free(command_hash.entries[i].name);
+    free(command_hash.entries[i].path);
+  }
+  memset(command_hash.entries, 0, sizeof(struct hash_entry) * command_hash.size);
+  command_hash.used = 0;
+}
+
+// returns 1 if the modification time of the directory changed since it was recorded,
+// 0 without looking again if it was already compared during this command line
+int path_dir_changed(struct path_dir* dir) {
+  struct stat st;
+  if (dir->checked == command_hash.epoch) {
+    return 0;
+  }
+  dir->checked = command_hash.epoch;
+  if (stat(dir->path, &st) == -1) {
+    st.st_mtim.tv_sec = 0;
+    st.st_mtim.tv_nsec = 0;
+  }
+  if (st.st_mtim.tv_sec == dir->mtime.tv_sec && st.st_mtim.tv_nsec == dir->mtime.tv_nsec) {
+    return 0;
+  }
+  dir->mtime = st.st_mtim;
+  return 1;
+}
+
+// Splits PATH into command_hash.dirs if it changed since the last call
+// returns 0 on allocation failure, the next call then starts over
+int refresh_path_dirs(void) {
+  const char* path_env = getenv("PATH");
+  if (path_env == NULL) {
+    path_env = DEFAULT_PATH;
+  }
+  if (command_hash.path_env != NULL && strcmp(command_hash.path_env, path_env) == 0) {
+    return 1;
+  }
+
+  forget_hashed_commands();
+  for (int i = 0; i < command_hash.num_dirs; i++) {
+    free(command_hash.dirs[i].path);
+  }
+  free(command_hash.dirs);
+  free(command_hash.path_env);
+  command_hash.dirs = NULL;
+  command_hash.num_dirs = 0;
+
+  command_hash.path_env = strdup(path_env);
+  int num_dirs = 1;
+  for (const char* c = path_env; *c != '\0'; c++) {
+    num_dirs += (*c == ':');
+  }
+  command_hash.dirs = calloc(num_dirs, sizeof(struct path_dir));
+  if (command_hash.path_env == NULL || command_hash.dirs == NULL) {
+    free(command_hash.path_env);
+    command_hash.path_env = NULL;
+    return 0;
+  }
+
+  const char* start = path_env;
+  for (int i = 0; i < num_dirs; i++) {
+    const char* end = strchrnul(start, ':');
+    // An empty PATH entry means the current directory, like in execvp
+    command_hash.dirs[i].path = end == start ? strdup(".") : strndup(start, end - start);
+    if (command_hash.dirs[i].path == NULL) {
+      free(command_hash.path_env);
+      command_hash.path_env = NULL;
+      return 0;
+    }
+    command_hash.num_dirs++;
+    command_hash.dirs[i].checked = command_hash.epoch - 1;
+    path_dir_changed(&command_hash.dirs[i]);
+    start = end + 1;
+  }
+  return 1;
+}
+
+struct hash_entry* find_hash_slot(const char* name) {
+  int mask = command_hash.size - 1;
+  int slot = hash_string(name) & mask;
+  while (command_hash.entries[slot].name != NULL && strcmp(command_hash.entries[slot].name, name) != 0) {
+    slot = (slot + 1) & mask;
+  }
+  return &command_hash.entries[slot];
+}
+
+// Keeps the table at most half full
+// returns 0 on allocation failure
+int grow_command_hash(void) {
+  if (command_hash.entries != NULL && (command_hash.used + 1) * 2 <= command_hash.size) {
+    return 1;
+  }
+
+  struct hash_entry* old_entries = command_hash.entries;
+  int old_size = command_hash.size;
+  int new_size = old_size == 0 ? COMMAND_HASH_INITIAL_SIZE : old_size * 2;
+  struct hash_entry* new_entries = calloc(new_size, sizeof(struct hash_entry));
+  if (new_entries == NULL) {
+    return 0;
+  }
+
+  command_hash.entries = new_entries;
+  command_hash.size = new_size;
+  for (int i = 0; i < old_size; i++) {
+    if (old_entries[i].name != NULL) {
+      *find_hash_slot(old_entries[i].name) = old_entries[i];
+    }
+  }
+  free(old_entries);
+  return 1;
+}
+
+// Searches the PATH directories for an executable regular file called name
+// returns the index of the directory, or -1 if not found. full_path receives the path.
+int search_path(const char* name, char** full_path) {
+  for (int i = 0; i < command_hash.num_dirs; i++) {
+    struct stat st;
+    if (asprintf(full_path, "%s/%s", command_hash.dirs[i].path, name) == -1) {
+      return -1;
+    }
+    if (stat(*full_path, &st) == 0 && S_ISREG(st.st_mode) && access(*full_path, X_OK) == 0) {
+      return i;
+    }
+    free(*full_path);
+  }
+  *full_path = NULL;
+  return -1;
+}
+
+// returns the absolute path of the command called name, or NULL if it should be
+// left to execvp (names with a slash, commands that are not found, errors)
+const char* lookup_command(const char* name) {
+  if (strchr(name, '/') != NULL || !refresh_path_dirs() || !grow_command_hash()) {
+    return NULL;
+  }
+
+  struct hash_entry* entry = find_hash_slot(name);
+  if (entry->name != NULL) {
+    int changed = 0;
+    for (int i = 0; i <= entry->dir_index; i++) {
+      changed |= path_dir_changed(&command_hash.dirs[i]);
+    }
+    if (!changed) {
+      entry->hits++;
+      command_hash.hits++;
+      return entry->path;
+    }
+    forget_hashed_commands();
+    entry = find_hash_slot(name);
+  }
+
+  command_hash.misses++;
+  char* path;
+  int dir_index = search_path(name, &path);
+  if (dir_index == -1) {
+    return NULL;
+  }
+  entry->name = strdup(name);
+  if (entry->name == NULL) {
+    free(path);
+    return NULL;
+  }
+  entry->path = path;
+  entry->dir_index = dir_index;
+  entry->hits = 0;
+  command_hash.used++;
+  return path;
+}
+
+// hash        - lists the remembered commands and the hit/miss counters
+// hash -r     - forgets all remembered commands
+// hash name.. - looks up and remembers the given commands
+int builtin_hash(int count, char** arglist) {
+  if (count == 2 && strcmp(arglist[1], "-r") == 0) {
+    if (command_hash.entries != NULL) {
+      forget_hashed_commands();
+    }
+    return 1;
+  }
+
+  if (count > 1) {
+    for (int i = 1; i < count; i++) {
+      if (lookup_command(arglist[i]) == NULL) {
+        fprintf(stderr, "hash: %s: not found\n", arglist[i]);
+      }
+    }
+    return 1;
+  }
+
+  printf("hits\tcommand\n");
+  for (int i = 0; i < command_hash.size; i++) {
+    if (command_hash.entries[i].name != NULL) {
+      printf("%4lu\t%s\n", command_hash.entries[i].hits, command_hash.entries[i].path);
+    }
+  }
+  printf("%lu hits, %lu misses\n", command_hash.hits, command_hash.misses);
+  fflush(stdout);
+  return 1;
+}
+
+// CPU placement of new processes. The CPUs are the ones the shell may run on.
+// Round-robin hands them out in turn. Least-loaded takes the CPU that was the
+// least busy according to /proc/stat since the previous sample (taken at most
+// every PLACEMENT_SAMPLE_NS), counting one more for each process placed on it
+// since then, which /proc/stat does not show yet. NUMA packing gives a process
+// all the CPUs of a node: the first node with a CPU to spare, or else the least
+// loaded one, so jobs keep their memory on as few nodes as possible.
+struct cpu_load {
+  int cpu;
+  int node;
+  unsigned long long busy; // jiffies at the last sample
+  unsigned long long total;
+  double load; // busy fraction before the last sample, plus the processes placed since
+};
+
+struct cpu_placement {
+  struct cpu_load* cpus; // in increasing CPU number
+  int num_cpus;
+  int num_nodes;
+  unsigned int next; // round-robin position
+  uint64_t sampled_ns;
+};
+
+static struct cpu_placement cpu_placement;
+
+// Options of a sched prefix, for the command after it
+struct sched_prefix {
+  int active;
+  int has_policy;
+  enum placement_policy policy;
+  int has_cpus;
+  cpu_set_t cpus;
+  int has_nice;
+  int nice;
+  int ioprio;
+};
+
+static struct sched_prefix sched_prefix;
+
+// Reads a list like "0-3,8,10-11" (CPUs or NUMA nodes) into set
+// returns 1 on success, 0 if list is malformed or empty
+int parse_cpu_list(const char* list, cpu_set_t* set) {
+  const char* next = list;
+  CPU_ZERO(set);
+  while (*next != '\0' && *next != '\n') {
+    char* end;
+    long first = strtol(next, &end, 10);
+    long last = first;
+    if (end == next || first < 0) {
+      return 0;
+    }
+    if (*end == '-') {
+      next = end + 1;
+      last = strtol(next, &end, 10);
+      if (end == next || last < first) {
+        return 0;
+      }
+    }
+    if (last >= CPU_SETSIZE || (*end != ',' && *end != '\0' && *end != '\n')) {
+      return 0;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      CPU_SET(cpu, set);
+    }
+    next = *end == ',' ? end + 1 : end;
+  }
+  return CPU_COUNT(set) > 0;
+}
+
+// returns 1 if the first line of path is a CPU list, stored in set
+int read_cpu_list(const char* path, cpu_set_t* set) {
+  char line[4096];
+  FILE* file = fopen(path, "re");
+  if (file == NULL) {
+    return 0;
+  }
+  int ok = fgets(line, sizeof(line), file) != NULL && parse_cpu_list(line, set);
+  fclose(file);
+  return ok;
+}
+
+// Finds the CPUs the shell may run on and their NUMA nodes (all on node 0
+// without /sys/devices/system/node)
+// returns 0 if they cannot be found (reported)
+int init_cpu_placement(void) {
+  if (cpu_placement.cpus != NULL) {
+    return 1;
+  }
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+    perror("error in init_cpu_placement sched_getaffinity");
+    return 0;
+  }
+  cpu_placement.cpus = calloc(CPU_COUNT(&allowed), sizeof(struct cpu_load));
+  if (cpu_placement.cpus == NULL) {
+    perror("error in init_cpu_placement calloc");
+    return 0;
+  }
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed)) {
+      cpu_placement.cpus[cpu_placement.num_cpus++].cpu = cpu;
+    }
+  }
+
+  cpu_set_t nodes;
+  cpu_placement.num_nodes = 1;
+  if (read_cpu_list("/sys/devices/system/node/online", &nodes)) {
+    for (int node = 0; node < CPU_SETSIZE; node++) {
+      char path[64];
+      cpu_set_t node_cpus;
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+      if (!CPU_ISSET(node, &nodes) || !read_cpu_list(path, &node_cpus)) {
+        continue;
+      }
+      for (int i = 0; i < cpu_placement.num_cpus; i++) {
+        if (CPU_ISSET(cpu_placement.cpus[i].cpu, &node_cpus)) {
+          cpu_placement.cpus[i].node = node;
+          cpu_placement.num_nodes = node + 1 > cpu_placement.num_nodes ? node + 1 : cpu_placement.num_nodes;
+        }
+      }
+    }
+  }
+  return 1;
+}
+
+// Takes a new sample of how busy each CPU is, unless the last one is recent.
+// The first sample has nothing to compare with and counts every CPU as idle.
+void sample_cpu_load(void) {
+  uint64_t now = trace_clock();
+  if (cpu_placement.sampled_ns != 0 && now - cpu_placement.sampled_ns < PLACEMENT_SAMPLE_NS) {
+    return;
+  }
+  FILE* file = fopen("/proc/stat", "re");
+  if (file == NULL) {
+    return; // Keep placing with the loads known so far
+  }
+  char line[512];
+  int i = 0;
+  while (fgets(line, sizeof(line), file) != NULL && i < cpu_placement.num_cpus) {
+    int cpu;
+    unsigned long long user, nice, system, idle, iowait = 0, irq = 0, softirq = 0, steal = 0;
+    if (strncmp(line, "cpu", 3) != 0 || line[3] < '0' || line[3] > '9' ||
+        sscanf(line, "cpu%d %llu %llu %llu %llu %llu %llu %llu %llu", &cpu, &user, &nice, &system, &idle,
+               &iowait, &irq, &softirq, &steal) < 5) {
+      continue;
+    }
+    while (i < cpu_placement.num_cpus && cpu_placement.cpus[i].cpu < cpu) {
+      i++;
+    }
+    if (i == cpu_placement.num_cpus || cpu_placement.cpus[i].cpu != cpu) {
+      continue;
+    }
+    struct cpu_load* load = &cpu_placement.cpus[i];
+    unsigned long long busy = user + nice + system + irq + softirq + steal;
+    unsigned long long total = busy + idle + iowait;
+    load->load = load->total != 0 && total > load->total ? (double)(busy - load->busy) / (total - load->total) : 0;
+    load->busy = busy;
+    load->total = total;
+  }
+  fclose(file);
+  cpu_placement.sampled_ns = now;
+}
+
+// Picks the CPUs for the next process placed with policy
+// returns 1 with set filled in, 0 if the process is not pinned
+int place_next_process(enum placement_policy policy, cpu_set_t* set) {
+  if (policy == PLACEMENT_OFF || !init_cpu_placement()) {
+    return 0;
+  }
+  struct cpu_load* cpus = cpu_placement.cpus;
+  int num_cpus = cpu_placement.num_cpus;
+  unsigned int start = cpu_placement.next++; // Ties go round-robin too
+  CPU_ZERO(set);
+  if (policy == PLACEMENT_ROUND_ROBIN) {
+    CPU_SET(cpus[start % num_cpus].cpu, set);
+    return 1;
+  }
+
+  sample_cpu_load();
+  int node = -1;
+  if (policy == PLACEMENT_NUMA) {
+    int spread = -1;
+    double spread_load = 0;
+    for (int candidate = 0; candidate < cpu_placement.num_nodes && node == -1; candidate++) {
+      double load = 0;
+      int count = 0;
+      for (int i = 0; i < num_cpus; i++) {
+        if (cpus[i].node == candidate) {
+          load += cpus[i].load;
+          count++;
+        }
+      }
+      if (count > 0 && load + 1 <= count) {
+        node = candidate;
+      } else if (count > 0 && (spread == -1 || load / count < spread_load)) {
+        spread = candidate;
+        spread_load = load / count;
+      }
+    }
+    node = node != -1 ? node : spread;
+  }
+
+  // The least loaded CPU (of the node), which the process is counted on
+  struct cpu_load* least = NULL;
+  for (int k = 0; k < num_cpus; k++) {
+    struct cpu_load* cpu = &cpus[(start + k) % num_cpus];
+    if ((node == -1 || cpu->node == node) && (least == NULL || cpu->load < least->load)) {
+      least = cpu;
+    }
+    if (node != -1 && cpu->node == node) {
+      CPU_SET(cpu->cpu, set);
+    }
+  }
+  least->load += 1;
+  if (node == -1) {
+    CPU_SET(least->cpu, set);
+  }
+  return 1;
+}
+
+// returns the setup of the next child, for a process of a job (background
+// command, parallel, batch) or with is_job 0 of a foreground command, NULL if
+// it needs none. The sched and limit prefixes win over the set defaults, which
+// only apply to jobs.
+const struct child_setup* next_child_setup(int is_job) {
+  static struct child_setup setup;
+  enum placement_policy policy = is_job ? settings.placement : PLACEMENT_OFF;
+
+  memset(&setup, 0, sizeof(setup));
+  if (is_job) {
+    setup.has_nice = settings.has_job_nice;
+    setup.nice = settings.job_nice;
+    setup.ioprio = settings.job_ioprio;
+  }
+  if (sched_prefix.active) {
+    policy = sched_prefix.has_policy ? sched_prefix.policy : policy;
+    if (sched_prefix.has_nice) {
+      setup.has_nice = 1;
+      setup.nice = sched_prefix.nice;
+    }
+    setup.ioprio = sched_prefix.ioprio != 0 ? sched_prefix.ioprio : setup.ioprio;
+  }
+  if (sched_prefix.active && sched_prefix.has_cpus) {
+    setup.has_cpus = 1;
+    setup.cpus = sched_prefix.cpus;
+  } else {
+    setup.has_cpus = place_next_process(policy, &setup.cpus);
+  }
+  current_limits(is_job, &setup.limits);
+  return setup.has_cpus || setup.has_nice || setup.ioprio != 0 || setup.limits.set != 0 ? &setup : NULL;
+}
+
+// Applies setup in a new child, before exec. Failures are reported and the
+// command runs anyway, like under nice or ionice. A limit can only fail to be
+// set above a hard limit the shell already has, which then holds instead.
+void apply_child_setup(const struct child_setup* setup) {
+  if (setup->has_cpus && sched_setaffinity(0, sizeof(setup->cpus), &setup->cpus) == -1) {
+    perror("error in apply_child_setup sched_setaffinity");
+  }
+  if (setup->has_nice && setpriority(PRIO_PROCESS, 0, setup->nice) == -1) {
+    perror("error in apply_child_setup setpriority");
+  }
+  if (setup->ioprio != 0 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, setup->ioprio) == -1) {
+    perror("error in apply_child_setup ioprio_set");
+  }
+  for (int i = 0; i < NUM_LIMITS; i++) {
+    if (setup->limits.set & (1u << i)) {
+      struct rlimit limit = { setup->limits.values[i], setup->limits.values[i] + (i == LIMIT_CPU) };
+      if (setrlimit(limit_kinds[i].resource, &limit) == -1) {
+        perror("error in apply_child_setup setrlimit");
+      }
+    }
+  }
+}
+
+// Reads an I/O priority: idle, be[:level] or rt[:level], level 0 (highest) to 7
+// returns 1 with *ioprio set, 0 if str is not one
+int parse_ioprio(const char* str, int* ioprio) {
+  int class;
+  int level = 4;
+  if (strncmp(str, "idle", 4) == 0 && str[4] == '\0') {
+    *ioprio = 3 << IOPRIO_CLASS_SHIFT;
+    return 1;
+  }
+  if (strncmp(str, "be", 2) == 0) {
+    class = 2;
+  } else if (strncmp(str, "rt", 2) == 0) {
+    class = 1;
+  } else {
+    return 0;
+  }
+  if (str[2] == ':' && str[3] >= '0' && str[3] <= '7' && str[4] == '\0') {
+    level = str[3] - '0';
+  } else if (str[2] != '\0') {
+    return 0;
+  }
+  *ioprio = (class << IOPRIO_CLASS_SHIFT) | level;
+  return 1;
+}
+
+// returns the policy named str, -1 if there is none
+int parse_placement_policy(const char* str) {
+  static const char* names[] = { "off", "roundrobin", "leastloaded", "numa" };
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (strcmp(str, names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// path is the resolved executable, or NULL to let execvp search PATH
+void execute_command(const char* path, char** arglist, int is_background) {
+  if (is_background != 0) {
+    signal(SIGINT, SIG_IGN); 
+  } else {
+    signal(SIGINT, SIG_DFL);
+  }
+
+  if (trace_ring != NULL) {
+    trace_event(TRACE_EXEC, getpid(), 0);
+  }
+  if (path != NULL) {
+    execv(path, arglist);
+  } else {
+    execvp(arglist[0], arglist); 
+  }
+  perror("error in execute_command execvp"); // This row and the row below only run if execvp fails
+  exit(127);
+}
+
+// Errors that mean the child process itself could not be created. Anything
+// else reported by posix_spawn comes from the exec step inside the child.
+int is_process_creation_error(int error) {
+  return error == EAGAIN || error == ENOMEM || error == ENOSYS;
+}
+
+// Launches the child described by req from the shell process with fork + exec,
+// path is the resolved executable or NULL. returns like spawn_command
+pid_t fork_in_shell(const struct spawn_request* req, const char* path) {
+  pid_t pid = fork();
+
+  if (pid == 0) { // Child process
+    sigset_t no_signals;
+    sigemptyset(&no_signals);
+    sigprocmask(SIG_SETMASK, &no_signals, NULL); // The shell keeps SIGCHLD blocked
+
+    if (req->in_fd != -1) {
+      dup2(req->in_fd, STDIN_FILENO);
+    }
+    if (req->out_fd != -1) {
+      dup2(req->out_fd, STDOUT_FILENO);
+    }
+    if (req->err_fd != -1) {
+      dup2(req->err_fd, STDERR_FILENO);
+    }
+    if (req->setup != NULL) {
+      apply_child_setup(req->setup);
+    }
+    execute_command(path, req->argv, req->is_background);
+  }
+
+  return pid;
+}
+
+// Launches the child described by req from the shell process, path is the
+// resolved executable or NULL. returns like spawn_command
+#ifdef MYSHELL_SPAWN_FORK
+pid_t spawn_in_shell(const struct spawn_request* req, const char* path) {
+  return fork_in_shell(req, path);
+}
+#else
+// A launch by clone_in_shell, on the stack of the shell
+struct clone_launch {
+  const struct spawn_request* req;
+  const char* path;
+  int error; // errno of the failed exec, written by the child
+};
+
+// Child side of clone_in_shell. It runs in the shell's memory while the shell
+// waits, so it only makes system calls and writes launch->error before exec.
+// returns the exit status of the child if exec failed
+int exec_from_clone(void* arg) {
+  struct clone_launch* launch = arg;
+  const struct spawn_request* req = launch->req;
+  sigset_t no_signals;
+
+  // The shell has no signal handlers, only ignored signals, so nothing can run
+  // shell code on this stack
+  signal(SIGINT, req->is_background ? SIG_IGN : SIG_DFL);
+  sigemptyset(&no_signals);
+  sigprocmask(SIG_SETMASK, &no_signals, NULL);
+  if (req->in_fd != -1) {
+    dup2(req->in_fd, STDIN_FILENO);
+  }
+  if (req->out_fd != -1) {
+    dup2(req->out_fd, STDOUT_FILENO);
+  }
+  if (req->err_fd != -1) {
+    dup2(req->err_fd, STDERR_FILENO);
+  }
+  apply_child_setup(req->setup);
+
+  if (launch->path != NULL) {
+    execv(launch->path, req->argv);
+  } else {
+    execvp(req->argv[0], req->argv);
+  }
+  launch->error = errno;
+  return 127;
+}
+
+// Launches the child described by req with clone(CLONE_VM | CLONE_VFORK), the
+// way posix_spawn does, for a child setup no spawn attribute can express. The
+// child shares the shell's memory on a stack of its own until it calls exec,
+// so nothing of the shell is copied however big it grows, and the shell waits
+// for that exec, which lets every launch use the same stack.
+// path is the resolved executable or NULL. returns like spawn_command
+pid_t clone_in_shell(const struct spawn_request* req, const char* path) {
+  static char* stack = NULL;
+  struct clone_launch launch = { req, path, 0 };
+
+  if (stack == NULL) {
+    stack = mmap(NULL, CLONE_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED) {
+      stack = NULL;
+      return -1;
+    }
+  }
+  pid_t pid = clone(exec_from_clone, stack + CLONE_STACK_SIZE, CLONE_VM | CLONE_VFORK | SIGCHLD, &launch);
+  if (pid == -1 || launch.error == 0) {
+    return pid;
+  }
+
+  // The child exited right after its exec failed
+  int status;
+  waitpid(pid, &status, 0);
+  errno = launch.error;
+  perror("error in execute_command execvp");
+  return 0;
+}
+
+pid_t spawn_in_shell(const struct spawn_request* req, const char* path) {
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t default_signals;
+  sigset_t no_signals;
+  short flags = POSIX_SPAWN_SETSIGMASK;
+  pid_t pid;
+  int error;
+
+  if (req->setup != NULL) {
+    return clone_in_shell(req, path); // There is no spawn attribute for affinity, nice, I/O priority or limits
+  }
+  posix_spawn_file_actions_init(&actions);
+  if (req->in_fd != -1) {
+    posix_spawn_file_actions_adddup2(&actions, req->in_fd, STDIN_FILENO);
+  }
+  if (req->out_fd != -1) {
+    posix_spawn_file_actions_adddup2(&actions, req->out_fd, STDOUT_FILENO);
+  }
+  if (req->err_fd != -1) {
+    posix_spawn_file_actions_adddup2(&actions, req->err_fd, STDERR_FILENO);
+  }
+
+  // The shell ignores SIGINT and an ignored disposition survives exec, so
+  // background children keep ignoring it. Foreground children get it reset.
+  // The shell keeps SIGCHLD blocked, children start with nothing blocked.
+  posix_spawnattr_init(&attr);
+  if (!req->is_background) {
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGINT);
+    posix_spawnattr_setsigdefault(&attr, &default_signals);
+    flags |= POSIX_SPAWN_SETSIGDEF;
+  }
+  sigemptyset(&no_signals);
+  posix_spawnattr_setsigmask(&attr, &no_signals);
+  posix_spawnattr_setflags(&attr, flags);
+
+  if (path != NULL) {
+    error = posix_spawn(&pid, path, &actions, &attr, req->argv, environ);
+  } else {
+    error = posix_spawnp(&pid, req->argv[0], &actions, &attr, req->argv, environ);
+  }
+
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+
+  if (error == 0) {
+    return pid;
+  }
+  errno = error;
+  if (is_process_creation_error(error)) {
+    return -1;
+  }
+  perror("error in execute_command execvp");
+  return 0;
+}
+#endif
+
+// Zygote launcher: a helper process forked at the very start of prepare(), while
+// the shell is still a few pages, that creates children on the shell's behalf.
+// Its page tables stay tiny however much memory the shell grows to, so a
+// fork-style launch from it costs the same at 10 MB or at 10 GB of shell RSS.
+// The shell sends each spawn request as one SOCK_SEQPACKET message: a struct
+// zygote_request followed by the NUL terminated path (if resolved), argv and
+// environment, with the shell's cwd, stdin, stdout, stderr and the request's
+// in_fd/out_fd/err_fd passed as SCM_RIGHTS. The zygote clones with CLONE_PARENT, so
+// the new process is the shell's own child: wait4, pidfds and SIGCHLD work as
+// if the shell had forked it. A request with a child setup carries it right
+// after the struct zygote_request, applied by the child like after a fork.
+#define ZYGOTE_BACKGROUND 1
+#define ZYGOTE_HAS_PATH 2
+#define ZYGOTE_HAS_IN_FD 4
+#define ZYGOTE_HAS_OUT_FD 8
+#define ZYGOTE_HAS_ERR_FD 16
+#define ZYGOTE_HAS_SETUP 32 // a struct child_setup follows the request
+
+struct zygote_request {
+  uint32_t flags;
+  uint32_t argc;
+  uint32_t envc;
+};
+
+struct zygote_reply {
+  int32_t pid;   // 0 if the child could not be created
+  int32_t error; // errno of the failed clone
+};
+
+struct zygote {
+  pid_t pid;
+  int fd;       // the shell's end of the socket, -1 while the zygote is off
+  int cwd_fd;   // O_PATH descriptor of the shell's cwd sent along, -1 until needed
+  char* message;
+};
+
+static struct zygote zygote = { 0, -1, -1, NULL };
+
+// Child side of a zygote launch: fds are the cwd, stdin, stdout, stderr, then
+// the optional in, out and err descriptors. setup may be NULL. Never returns.
+void exec_from_zygote(const struct zygote_request* request, const struct child_setup* setup, const char* path,
+                      char** argv, char** envp, int* fds) {
+  sigset_t no_signals;
+  int next_fd = 4;
+
+  sigemptyset(&no_signals);
+  sigprocmask(SIG_SETMASK, &no_signals, NULL);
+  signal(SIGINT, (request->flags & ZYGOTE_BACKGROUND) ? SIG_IGN : SIG_DFL);
+  if (fchdir(fds[0]) == -1) {
+    perror("error in zygote fchdir");
+    _exit(1);
+  }
+  for (int fd = 0; fd < 3; fd++) {
+    dup2(fds[fd + 1], fd);
+  }
+  if (request->flags & ZYGOTE_HAS_IN_FD) {
+    dup2(fds[next_fd++], STDIN_FILENO);
+  }
+  if (request->flags & ZYGOTE_HAS_OUT_FD) {
+    dup2(fds[next_fd++], STDOUT_FILENO);
+  }
+  if (request->flags & ZYGOTE_HAS_ERR_FD) {
+    dup2(fds[next_fd], STDERR_FILENO);
+  }
+  if (setup != NULL) {
+    apply_child_setup(setup);
+  }
+
+  if (path != NULL) {
+    execve(path, argv, envp);
+  } else {
+    execvpe(argv[0], argv, envp);
+  }
+  perror("error in execute_command execvp");
+  _exit(127);
+}
+
+// Launches the request in message (size bytes) with the received fds
+// returns the reply for the shell
+struct zygote_reply launch_from_zygote(char* message, size_t size, int* fds, int num_fds) {
+  struct zygote_reply reply = { 0, EINVAL };
+  struct zygote_request request;
+  struct child_setup setup;
+
+  if (size < sizeof(request) || message[size - 1] != '\0') {
+    return reply;
+  }
+  memcpy(&request, message, sizeof(request));
+  int expected_fds = 4 + !!(request.flags & ZYGOTE_HAS_IN_FD) + !!(request.flags & ZYGOTE_HAS_OUT_FD) +
+                     !!(request.flags & ZYGOTE_HAS_ERR_FD);
+  size_t setup_size = (request.flags & ZYGOTE_HAS_SETUP) ? sizeof(setup) : 0;
+  if (num_fds != expected_fds || request.argc == 0 || request.argc + request.envc > size ||
+      sizeof(request) + setup_size >= size) {
+    return reply;
+  }
+  memcpy(&setup, message + sizeof(request), setup_size);
+
+  // The strings are NUL separated, point argv and envp into them
+  char** strings = malloc(sizeof(char*) * (request.argc + request.envc + 2));
+  char* next = message + sizeof(request) + setup_size;
+  char* end = message + size;
+  const char* path = NULL;
+  if (strings == NULL) {
+    reply.error = ENOMEM;
+    return reply;
+  }
+  if (request.flags & ZYGOTE_HAS_PATH) {
+    path = next;
+    next += strlen(next) + 1;
+  }
+  for (uint32_t i = 0; i < request.argc + request.envc; i++) {
+    if (next >= end) {
+      free(strings);
+      return reply;
+    }
+    strings[i + (i >= request.argc)] = next;
+    next += strlen(next) + 1;
+  }
+  char** argv = strings;
+  char** envp = strings + request.argc + 1;
+  argv[request.argc] = NULL;
+  envp[request.envc] = NULL;
+
+  pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0);
+  if (pid == 0) {
+    exec_from_zygote(&request, setup_size > 0 ? &setup : NULL, path, argv, envp, fds);
+  }
+  free(strings);
+  reply.pid = pid == -1 ? 0 : pid;
+  reply.error = pid == -1 ? errno : 0;
+  return reply;
+}
+
+// Body of the zygote process, serves spawn requests until the shell closes its end
+void run_zygote(int fd) {
+  char* message = malloc(ZYGOTE_MAX_MESSAGE);
+  union {
+    struct cmsghdr header;
+    char data[CMSG_SPACE(sizeof(int) * ZYGOTE_MAX_FDS)];
+  } control;
+
+  if (message == NULL) {
+    _exit(1);
+  }
+  signal(SIGINT, SIG_IGN);
+
+  // Children get the shell's descriptors from each request. /dev/null keeps 0-2
+  // taken so that received descriptors never land on them.
+  int null_fd = open("/dev/null", O_RDWR);
+  for (int i = 0; i < 3 && null_fd != -1; i++) {
+    dup2(null_fd, i);
+  }
+  if (null_fd > 2) {
+    close(null_fd);
+  }
+  while (1) {
+    struct iovec iov = { message, ZYGOTE_MAX_MESSAGE };
+    struct msghdr msg;
+    int fds[ZYGOTE_MAX_FDS];
+    int num_fds = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data;
+    msg.msg_controllen = sizeof(control.data);
+    ssize_t size = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (size == -1 && errno == EINTR) {
+      continue;
+    }
+    if (size <= 0) {
+      _exit(0);
+    }
+
+    for (struct cmsghdr* header = CMSG_FIRSTHDR(&msg); header != NULL; header = CMSG_NXTHDR(&msg, header)) {
+      if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+        int count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count && num_fds < ZYGOTE_MAX_FDS; i++) {
+          memcpy(&fds[num_fds++], CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+        }
+      }
+    }
+
+    struct zygote_reply reply = { 0, EINVAL };
+    if (!(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+      reply = launch_from_zygote(message, size, fds, num_fds);
+    }
+    for (int i = 0; i < num_fds; i++) {
+      close(fds[i]);
+    }
+    if (send(fd, &reply, sizeof(reply), MSG_NOSIGNAL) != sizeof(reply)) {
+      _exit(1);
+    }
+  }
+}
+
+// Forks the zygote from the shell as it is now, which should be as small as possible
+// returns 1 on success, 0 if the shell keeps launching its children itself
+int start_zygote(void) {
+  int sockets[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) == -1) {
+    perror("error in start_zygote socketpair");
+    return 0;
+  }
+  zygote.message = zygote.message != NULL ? zygote.message : malloc(ZYGOTE_MAX_MESSAGE);
+  zygote.pid = zygote.message != NULL ? fork() : -1;
+  if (zygote.pid == -1) {
+    perror("error in start_zygote fork");
+    close(sockets[0]);
+    close(sockets[1]);
+    return 0;
+  }
+  if (zygote.pid == 0) {
+    close(sockets[0]);
+    run_zygote(sockets[1]);
+  }
+  close(sockets[1]);
+  zygote.fd = sockets[0];
+  return 1;
+}
+
+void stop_zygote(void) {
+  if (zygote.fd == -1) {
+    return;
+  }
+  close(zygote.fd); // The zygote exits when it reads EOF
+  zygote.fd = -1;
+  waitpid(zygote.pid, NULL, 0);
+  if (zygote.cwd_fd != -1) {
+    close(zygote.cwd_fd);
+    zygote.cwd_fd = -1;
+  }
+}
+
+// The cwd sent to the zygote is reopened on the next launch
+void forget_zygote_cwd(void) {
+  if (zygote.cwd_fd != -1) {
+    close(zygote.cwd_fd);
+    zygote.cwd_fd = -1;
+  }
+}
+
+// Appends str and its NUL to the message being built
+// returns the new length, or 0 if it does not fit
+size_t append_string(char* message, size_t length, const char* str) {
+  size_t size = strlen(str) + 1;
+  if (length == 0 || length + size > ZYGOTE_MAX_MESSAGE) {
+    return 0;
+  }
+  memcpy(message + length, str, size);
+  return length + size;
+}
+
+// Asks the zygote to launch req, path is the resolved executable or NULL.
+// returns 1 with *pid set like spawn_command if the zygote handled it, 0 if the
+// shell should launch it itself (no zygote, request too big, zygote gone)
+int spawn_from_zygote(const struct spawn_request* req, const char* path, pid_t* pid) {
+  struct zygote_request request = { 0, 0, 0 };
+  size_t length = sizeof(request);
+  int fds[ZYGOTE_MAX_FDS] = { -1, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+  int num_fds = 4;
+
+  if (zygote.fd == -1) {
+    return 0;
+  }
+  if (zygote.cwd_fd == -1) {
+    zygote.cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (zygote.cwd_fd == -1) {
+      return 0;
+    }
+  }
+  fds[0] = zygote.cwd_fd;
+
+  request.flags = req->is_background ? ZYGOTE_BACKGROUND : 0;
+  if (req->setup != NULL) {
+    request.flags |= ZYGOTE_HAS_SETUP;
+    memcpy(zygote.message + length, req->setup, sizeof(struct child_setup));
+    length += sizeof(struct child_setup);
+  }
+  if (path != NULL) {
+    request.flags |= ZYGOTE_HAS_PATH;
+    length = append_string(zygote.message, length, path);
+  }
+  for (char** arg = req->argv; *arg != NULL; arg++, request.argc++) {
+    length = append_string(zygote.message, length, *arg);
+  }
+  for (char** var = environ; *var != NULL; var++, request.envc++) {
+    length = append_string(zygote.message, length, *var);
+  }
+  if (length == 0) {
+    return 0;
+  }
+  if (req->in_fd != -1) {
+    request.flags |= ZYGOTE_HAS_IN_FD;
+    fds[num_fds++] = req->in_fd;
+  }
+  if (req->out_fd != -1) {
+    request.flags |= ZYGOTE_HAS_OUT_FD;
+    fds[num_fds++] = req->out_fd;
+  }
+  if (req->err_fd != -1) {
+    request.flags |= ZYGOTE_HAS_ERR_FD;
+    fds[num_fds++] = req->err_fd;
+  }
+  memcpy(zygote.message, &request, sizeof(request));
+
+  union {
+    struct cmsghdr header;
+    char data[CMSG_SPACE(sizeof(int) * ZYGOTE_MAX_FDS)];
+  } control;
+  struct iovec iov = { zygote.message, length };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  memset(&control, 0, sizeof(control));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+  struct cmsghdr* header = CMSG_FIRSTHDR(&msg);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+  memcpy(CMSG_DATA(header), fds, sizeof(int) * num_fds);
+
+  struct zygote_reply reply;
+  ssize_t sent;
+  while ((sent = sendmsg(zygote.fd, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR) {
+  }
+  ssize_t received = -1;
+  if (sent == (ssize_t)length) {
+    while ((received = recv(zygote.fd, &reply, sizeof(reply), 0)) == -1 && errno == EINTR) {
+    }
+  }
+  if (received != sizeof(reply)) {
+    // The zygote is gone or broken, launch from the shell from now on
+    fprintf(stderr, "zygote launcher stopped, launching from the shell\n");
+    stop_zygote();
+    return 0;
+  }
+
+  if (reply.pid == 0) {
+    errno = reply.error;
+    *pid = -1;
+  } else {
+    *pid = reply.pid;
+  }
+  return 1;
+}
+
+// Launches the child described by req, through the zygote when it runs.
+// returns the pid of the child on success,
+// returns 0 if the child was created but the command could not be executed
+// (the error was already reported, exactly like a failing execvp in the child),
+// returns -1 with errno set if the child process could not be created at all
+pid_t spawn_command(const struct spawn_request* req) {
+  const char* path = lookup_command(req->argv[0]);
+  uint64_t spawn_start = trace_spawn_start();
+  pid_t pid;
+
+  if (!spawn_from_zygote(req, path, &pid)) {
+    pid = spawn_in_shell(req, path);
+  }
+  if (pid > 0) {
+    trace_spawned(pid, spawn_start);
+  }
+  return pid;
+}
+
+// Parses a byte count with an optional k/m/g suffix (powers of 1024)
+// returns 1 on success, 0 if str is not a valid size or does not fit in a size_t
+int parse_size(const char* str, size_t* size) {
+  char* end;
+  int shift = 0;
+  errno = 0;
+  unsigned long long value = strtoull(str, &end, 10);
+  if (errno != 0 || end == str || *str == '-') {
+    return 0;
+  }
+  switch (*end) {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+  }
+  if (*end != '\0' || value > (SIZE_MAX >> shift)) {
+    return 0;
+  }
+  *size = value << shift;
+  return 1;
+}
+
+// Reads the limit given with option (-v, -t, -n or -u, see limit_kinds): a
+// positive count, bytes with an optional k/m/g suffix for -v, or unlimited
+// returns the enum limit_resource of option with *value set (RLIM_INFINITY for
+// unlimited), -1 if option or value is wrong
+int parse_limit_option(const char* option, const char* value, rlim_t* limit) {
+  size_t count;
+  for (int i = 0; i < NUM_LIMITS; i++) {
+    if (option[0] != '-' || option[1] != limit_kinds[i].option || option[2] != '\0') {
+      continue;
+    }
+    if (strcmp(value, "unlimited") == 0) {
+      *limit = RLIM_INFINITY;
+      return i;
+    }
+    if (!parse_size(value, &count) || count == 0 || count >= RLIM_INFINITY - 1) {
+      return -1;
+    }
+    *limit = count;
+    return i;
+  }
+  return -1;
+}
+
+// Requests a buffer of size bytes for the pipe fd belongs to (0 does nothing)
+// returns the capacity the kernel actually granted, or -1 with errno set
+long set_pipe_size(int fd, size_t size) {
+  if (size == 0) {
+    return fcntl(fd, F_GETPIPE_SZ);
+  }
+  if (size > INT_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+  return fcntl(fd, F_SETPIPE_SZ, (int)size);
+}
+
+// Reports the capacity pipelines currently get, using a throwaway pipe
+void report_pipe_size(void) {
+  int pipe_fds[2];
+  if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+    perror("error in report_pipe_size pipe creation");
+    return;
+  }
+  long granted = set_pipe_size(pipe_fds[1], settings.pipe_size);
+  if (granted == -1) {
+    perror("error in report_pipe_size fcntl");
+  } else if (settings.pipe_size == 0) {
+    printf("pipesize: kernel default, granted %ld bytes\n", granted);
+  } else {
+    printf("pipesize: requested %zu bytes, granted %ld bytes\n", settings.pipe_size, granted);
+  }
+  fflush(stdout);
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+}
+
+// set pipesize [bytes] - shows or changes the buffer size of pipeline pipes (0 for the kernel default)
+// set timing [on|off] - shows or changes whether every foreground command is timed
+// set trace [file [records] | off] - shows, starts or stops spawn tracing, see trace.h
+// set zygote [on|off] - shows, starts or stops the zygote launcher
+int builtin_set(int count, char** arglist) {
+  if (count >= 2 && strcmp(arglist[1], "pipesize") == 0) {
+    if (count == 3 && !parse_size(arglist[2], &settings.pipe_size)) {
+      fprintf(stderr, "set: invalid pipe size: %s\n", arglist[2]);
+      return 1;
+    }
+    report_pipe_size();
+    return 1;
+  }
+  if (count >= 2 && strcmp(arglist[1], "timing") == 0) {
+    if (count == 3 && strcmp(arglist[2], "on") == 0) {
+      settings.timing = 1;
+    } else if (count == 3 && strcmp(arglist[2], "off") == 0) {
+      settings.timing = 0;
+    } else if (count != 2) {
+      fprintf(stderr, "set: timing is on or off\n");
+      return 1;
+    }
+    printf("timing: %s\n", settings.timing ? "on" : "off");
+    fflush(stdout);
+    return 1;
+  }
+
+  if (count >= 2 && strcmp(arglist[1], "trace") == 0) {
+    if (count == 3 && strcmp(arglist[2], "off") == 0) {
+      stop_trace();
+      free(settings.trace_path);
+      settings.trace_path = NULL;
+    } else if (count == 3 || count == 4) {
+      size_t records = TRACE_DEFAULT_RECORDS;
+      if (count == 4 && (!parse_size(arglist[3], &records) || records == 0 || records > UINT32_MAX ||
+                         (records & (records - 1)) != 0)) {
+        fprintf(stderr, "set: trace records must be a power of two: %s\n", arglist[3]);
+        return 1;
+      }
+      if (!start_trace(arglist[2], records)) {
+        perror("error in set trace");
+        return 1;
+      }
+      free(settings.trace_path);
+      settings.trace_path = strdup(arglist[2]);
+    }
+    if (trace_ring == NULL) {
+      printf("trace: off\n");
+    } else {
+      printf("trace: %s, %u records\n", settings.trace_path, trace_ring->capacity);
+    }
+    fflush(stdout);
+    return 1;
+  }
+
+  if (count >= 2 && strcmp(arglist[1], "zygote") == 0) {
+    if (count == 3 && strcmp(arglist[2], "on") == 0) {
+      // Forked from the shell as it is now, start the shell with MYSHELL_ZYGOTE=1 for the smallest zygote
+      if (zygote.fd == -1 && !start_zygote()) {
+        return 1;
+      }
+    } else if (count == 3 && strcmp(arglist[2], "off") == 0) {
+      stop_zygote();
+    } else if (count != 2) {
+      fprintf(stderr, "set: zygote is on or off\n");
+      return 1;
+    }
+    if (zygote.fd == -1) {
+      printf("zygote: off\n");
+    } else {
+      printf("zygote: on, pid %d\n", zygote.pid);
+    }
+    fflush(stdout);
+    return 1;
+  }
+
+  if (count >= 2 && strcmp(arglist[1], "joboutput") == 0) {
+    static const char* mode_names[] = { "direct", "lines", "jobs" };
+    int mode = -1;
+    for (int i = 0; count >= 3 && i < 3; i++) {
+      if (strcmp(arglist[2], mode_names[i]) == 0) {
+        mode = i;
+      }
+    }
+    if ((count >= 3 && mode == -1) || count > 4 ||
+        (count == 4 && (!parse_size(arglist[3], &settings.job_output_memory) || settings.job_output_memory == 0))) {
+      fprintf(stderr, "set: joboutput is direct, lines or jobs, with the bytes held in memory at most\n");
+      return 1;
+    }
+    if (mode != -1) {
+      settings.job_output = mode;
+    }
+    printf("joboutput: %s, %zu bytes in memory at most\n", mode_names[settings.job_output], settings.job_output_memory);
+    fflush(stdout);
+    return 1;
+  }
+
+  if (count >= 2 && strcmp(arglist[1], "spawnlimit") == 0) {
+    if (count == 3 && strcmp(arglist[2], "off") == 0) {
+      settings.spawn_limit = 0;
+    } else if (count == 3) {
+      char* end;
+      long limit = strtol(arglist[2], &end, 10);
+      if (*end != '\0' || limit < 1) {
+        fprintf(stderr, "set: spawnlimit is a number of processes or off: %s\n", arglist[2]);
+        return 1;
+      }
+      settings.spawn_limit = limit;
+    } else if (count != 2) {
+      fprintf(stderr, "set: spawnlimit is a number of processes or off\n");
+      return 1;
+    }
+    if (settings.spawn_limit == 0) {
+      printf("spawnlimit: off");
+    } else {
+      printf("spawnlimit: %ld processes", settings.spawn_limit);
+    }
+    printf(", %lu queued, %lu retried, %lu dropped\n", spawn_stats.queued, spawn_stats.retried, spawn_stats.dropped);
+    fflush(stdout);
+    return 1;
+  }
+
+  if (count >= 2 && strcmp(arglist[1], "streams") == 0) {
+    if (count == 3 && strcmp(arglist[2], "on") == 0) {
+      settings.stream_builtins = 1;
+    } else if (count == 3 && strcmp(arglist[2], "off") == 0) {
+      settings.stream_builtins = 0;
+    } else if (count != 2) {
+      fprintf(stderr, "set: streams is on or off\n");
+      return 1;
+    }
+    printf("streams: %s\n", settings.stream_builtins ? "on" : "off");
+    fflush(stdout);
+    return 1;
+  }
+
+  if (count >= 2 && strcmp(arglist[1], "placement") == 0) {
+    static const char* policy_names[] = { "off", "roundrobin", "leastloaded", "numa" };
+    int policy = count == 3 ? parse_placement_policy(arglist[2]) : (int)settings.placement;
+    if (count > 3 || policy == -1) {
+      fprintf(stderr, "set: placement is off, roundrobin, leastloaded or numa\n");
+      return 1;
+    }
+    settings.placement = policy;
+    if (policy != PLACEMENT_OFF && init_cpu_placement()) {
+      printf("placement: %s over %d CPUs on %d NUMA nodes\n", policy_names[policy], cpu_placement.num_cpus,
+             cpu_placement.num_nodes);
+    } else {
+      printf("placement: %s\n", policy_names[settings.placement]);
+    }
+    fflush(stdout);
+    return 1;
+  }
+
+  if (count >= 2 && strcmp(arglist[1], "jobnice") == 0) {
+    if (count == 3 && strcmp(arglist[2], "off") == 0) {
+      settings.has_job_nice = 0;
+    } else if (count == 3) {
+      char* end;
+      long nice = strtol(arglist[2], &end, 10);
+      if (*end != '\0' || end == arglist[2] || nice < -20 || nice > 19) {
+        fprintf(stderr, "set: jobnice is a nice value from -20 to 19 or off: %s\n", arglist[2]);
+        return 1;
+      }
+      settings.has_job_nice = 1;
+      settings.job_nice = nice;
+    } else if (count != 2) {
+      fprintf(stderr, "set: jobnice is a nice value from -20 to 19 or off\n");
+      return 1;
+    }
+    if (settings.has_job_nice) {
+      printf("jobnice: %d\n", settings.job_nice);
+    } else {
+      printf("jobnice: off\n");
+    }
+    fflush(stdout);
+    return 1;
+  }
+
+  if (count >= 2 && strcmp(arglist[1], "jobionice") == 0) {
+    if (count == 3 && strcmp(arglist[2], "off") == 0) {
+      settings.job_ioprio = 0;
+    } else if ((count == 3 && !parse_ioprio(arglist[2], &settings.job_ioprio)) || count > 3) {
+      fprintf(stderr, "set: jobionice is idle, be[:level], rt[:level] or off\n");
+      return 1;
+    }
+    int class = settings.job_ioprio >> IOPRIO_CLASS_SHIFT;
+    if (class == 0) {
+      printf("jobionice: off\n");
+    } else if (class == 3) {
+      printf("jobionice: idle\n");
+    } else {
+      printf("jobionice: %s:%d\n", class == 1 ? "rt" : "be", settings.job_ioprio & 7);
+    }
+    fflush(stdout);
+    return 1;
+  }
+
+  if (count >= 2 && strcmp(arglist[1], "joblimit") == 0) {
+    struct resource_limits limits = settings.job_limits;
+    for (int i = 2; i < count; i += 2) {
+      rlim_t value;
+      int resource = -1;
+      if (i + 1 < count) {
+        const char* given = strcmp(arglist[i + 1], "off") == 0 ? "unlimited" : arglist[i + 1];
+        resource = parse_limit_option(arglist[i], given, &value);
+      }
+      if (resource == -1) {
+        fprintf(stderr, "set: joblimit takes -v bytes, -t seconds, -n files or -u processes, each a count or off\n");
+        return 1;
+      }
+      if (value == RLIM_INFINITY) {
+        limits.set &= ~(1u << resource);
+      } else {
+        limits.set |= 1u << resource;
+        limits.values[resource] = value;
+      }
+    }
+    settings.job_limits = limits;
+    if (limits.set == 0) {
+      printf("joblimit: off\n");
+    } else {
+      char in_force[192];
+      format_limits(&limits, in_force, sizeof(in_force));
+      printf("joblimit: %s\n", in_force);
+    }
+    fflush(stdout);
+    return 1;
+  }
+
+  fprintf(stderr, "usage: set pipesize [bytes] | set timing [on|off] | set trace [file [records] | off] | set zygote [on|off]"
+                  " | set joboutput [direct|lines|jobs [bytes]] | set spawnlimit [N|off] | set streams [on|off]"
+                  " | set placement [off|roundrobin|leastloaded|numa] | set jobnice [N|off]"
+                  " | set jobionice [idle|be[:level]|rt[:level]|off]"
+                  " | set joblimit [-v bytes|off] [-t seconds|off] [-n files|off] [-u processes|off]\n");
+  return 1;
+}
+
+// Fan-out stages: a pipeline stage written as "@N[l][o] command args" runs N
+// copies of command. A relay process forked from the shell sits in the stage's
+// place: it reads the stage input, hands it to the copies round-robin in records
+// of whole lines (blocks of up to FANOUT_BLOCK_SIZE bytes, or single lines with l),
+// and merges their outputs one whole line at a time. With o the outputs are put
+// back in input order, which needs a command printing exactly one line per input
+// line (sed, awk '{...}', tr...).
+struct fanout_spec {
+  int copies;
+  int line_records;
+  int ordered;
+};
+
+struct byte_buffer {
+  char* data;
+  size_t start;
+  size_t end;
+  size_t capacity;
+};
+
+struct fanout_copy {
+  pid_t pid;
+  int in_fd; // write end of the copy's stdin, -1 once closed
+  int out_fd; // read end of the copy's stdout, -1 at EOF
+  struct byte_buffer pending_in;
+  struct byte_buffer pending_out;
+  int seen_output;
+};
+
+// A record handed to a copy, kept in input order to rebuild the ordered output
+struct fanout_record {
+  int copy;
+  size_t lines;
+};
+
+// Parses "@N[l][o]"
+// returns 1 if word is a valid fan-out prefix
+int parse_fanout_spec(const char* word, struct fanout_spec* spec) {
+  char* end;
+  if (word[0] != '@' || word[1] < '1' || word[1] > '9') {
+    return 0;
+  }
+  memset(spec, 0, sizeof(*spec));
+  spec->copies = strtol(word + 1, &end, 10);
+  for (; *end != '\0'; end++) {
+    if (*end == 'l') {
+      spec->line_records = 1;
+    } else if (*end == 'o') {
+      spec->ordered = 1;
+    } else {
+      return 0;
+    }
+  }
+  return spec->copies > 0;
+}
+
+// Makes room for size more bytes at the end of buffer, exits the relay when out of memory
+void reserve_bytes(struct byte_buffer* buffer, size_t size) {
+  if (buffer->start > 0 && buffer->start == buffer->end) {
+    buffer->start = buffer->end = 0;
+  }
+  if (buffer->end + size <= buffer->capacity) {
+    return;
+  }
+  if (buffer->start > 0) {
+    memmove(buffer->data, buffer->data + buffer->start, buffer->end - buffer->start);
+    buffer->end -= buffer->start;
+    buffer->start = 0;
+  }
+  if (buffer->end + size > buffer->capacity) {
+    size_t capacity = buffer->capacity == 0 ? FANOUT_READ_SIZE : buffer->capacity;
+    while (capacity < buffer->end + size) {
+      capacity *= 2;
+    }
+    buffer->data = realloc(buffer->data, capacity);
+    if (buffer->data == NULL) {
+      perror("error in fan-out relay realloc");
+      _exit(1);
+    }
+    buffer->capacity = capacity;
+  }
+}
+
+void append_bytes(struct byte_buffer* buffer, const char* data, size_t size) {
+  reserve_bytes(buffer, size);
+  memcpy(buffer->data + buffer->end, data, size);
+  buffer->end += size;
+}
+
+// Writes all of data to fd, exits the relay if the output is gone
+void write_all_or_exit(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      _exit(1);
+    }
+    data += written;
+    size -= written;
+  }
+}
+
+size_t count_lines(const char* data, size_t size) {
+  size_t lines = 0;
+  const char* end = data + size;
+  while ((data = memchr(data, '\n', end - data)) != NULL) {
+    lines++;
+    data++;
+  }
+  return lines;
+}
+
+// returns the length of the first lines complete lines of data, or 0 if there are fewer
+size_t length_of_lines(const char* data, size_t size, size_t lines) {
+  const char* position = data;
+  const char* end = data + size;
+  while (lines-- > 0) {
+    position = memchr(position, '\n', end - position);
+    if (position == NULL) {
+      return 0;
+    }
+    position++;
+  }
+  return position - data;
+}
+
+// Cuts the next record out of input. At EOF a last line without newline counts too.
+// returns the record length, 0 if no complete record is available
+size_t next_record_length(const struct byte_buffer* input, int line_records, int eof) {
+  const char* data = input->data + input->start;
+  size_t size = input->end - input->start;
+  size_t limit = line_records ? 1 : FANOUT_BLOCK_SIZE;
+
+  const char* last = line_records ? memchr(data, '\n', size) : memrchr(data, '\n', size < limit ? size : limit);
+  if (last == NULL && !line_records && size > limit) {
+    last = memchr(data + limit, '\n', size - limit); // A single line longer than a block
+  }
+  if (last != NULL) {
+    return last + 1 - data;
+  }
+  return eof ? size : 0;
+}
+
+// Body of the relay process of a fan-out stage, never returns
+void run_fanout_relay(const struct fanout_spec* spec, char** argv, int in_fd, int out_fd, int is_background) {
+  struct fanout_copy* copies = calloc(spec->copies, sizeof(struct fanout_copy));
+  struct pollfd* fds = calloc(2 * spec->copies + 1, sizeof(struct pollfd));
+  struct fanout_record* records = NULL;
+  size_t records_head = 0, records_tail = 0, records_capacity = 0;
+  struct byte_buffer input = { 0 };
+  int input_eof = 0;
+  int next_copy = 0;
+  int exit_status = 0;
+
+  if (copies == NULL || fds == NULL) {
+    perror("error in fan-out relay calloc");
+    _exit(1);
+  }
+
+  for (int i = 0; i < spec->copies; i++) {
+    int to_copy[2], from_copy[2];
+    if (pipe2(to_copy, O_CLOEXEC) == -1 || pipe2(from_copy, O_CLOEXEC) == -1) {
+      perror("error in fan-out relay pipe creation");
+      _exit(1);
+    }
+    struct spawn_request req = { argv, to_copy[0], from_copy[1], -1, is_background, next_child_setup(is_background) };
+    copies[i].pid = spawn_command(&req);
+    close(to_copy[0]);
+    close(from_copy[1]);
+    if (copies[i].pid < 0) {
+      perror("error in fan-out relay fork");
+      _exit(1);
+    }
+    copies[i].in_fd = to_copy[1];
+    copies[i].out_fd = from_copy[0];
+    fcntl(copies[i].in_fd, F_SETFL, O_NONBLOCK);
+    fcntl(copies[i].out_fd, F_SETFL, O_NONBLOCK);
+  }
+
+  while (1) {
+    int num_fds = 0;
+    int open_outputs = 0;
+    int input_blocked = 0;
+
+    for (int i = 0; i < spec->copies; i++) {
+      struct fanout_copy* copy = &copies[i];
+      size_t pending = copy->pending_in.end - copy->pending_in.start;
+      input_blocked |= pending > FANOUT_MAX_PENDING;
+      if (copy->in_fd != -1 && pending == 0 && input_eof) {
+        close(copy->in_fd); // EOF for this copy
+        copy->in_fd = -1;
+      }
+      if (copy->in_fd != -1 && pending > 0) {
+        fds[num_fds++] = (struct pollfd){ copy->in_fd, POLLOUT, 0 };
+      }
+      // Ordered output held back for an earlier record of another copy is capped,
+      // the copy then waits on its pipe. The copy that record waits for is always read.
+      int output_blocked = spec->ordered && records_head < records_tail && records[records_head].copy != i &&
+                           copy->pending_out.end - copy->pending_out.start >= FANOUT_MAX_PENDING;
+      if (copy->out_fd != -1 && !output_blocked) {
+        fds[num_fds++] = (struct pollfd){ copy->out_fd, POLLIN, 0 };
+      }
+      open_outputs += copy->out_fd != -1;
+    }
+    if (open_outputs == 0) {
+      break;
+    }
+    if (!input_eof && !input_blocked) {
+      fds[num_fds++] = (struct pollfd){ in_fd, POLLIN, 0 };
+    }
+
+    if (poll(fds, num_fds, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("error in fan-out relay poll");
+      _exit(1);
+    }
+
+    for (int f = 0; f < num_fds; f++) {
+      if (fds[f].revents == 0) {
+        continue;
+      }
+
+      if (fds[f].fd == in_fd) {
+        // New input: cut it into records and queue them round-robin
+        reserve_bytes(&input, FANOUT_READ_SIZE);
+        ssize_t bytes = read(in_fd, input.data + input.end, FANOUT_READ_SIZE);
+        if (bytes > 0) {
+          input.end += bytes;
+        } else if (bytes == 0 || errno != EINTR) {
+          input_eof = 1;
+        }
+        size_t length;
+        while (input.start < input.end && (length = next_record_length(&input, spec->line_records, input_eof)) > 0) {
+          const char* record = input.data + input.start;
+          append_bytes(&copies[next_copy].pending_in, record, length);
+          if (spec->ordered) {
+            if (records_tail == records_capacity) {
+              records_capacity = records_capacity == 0 ? 1024 : records_capacity * 2;
+              records = realloc(records, sizeof(struct fanout_record) * records_capacity);
+              if (records == NULL) {
+                perror("error in fan-out relay realloc");
+                _exit(1);
+              }
+            }
+            size_t lines = count_lines(record, length);
+            records[records_tail++] = (struct fanout_record){ next_copy, lines + (record[length - 1] != '\n') };
+          }
+          input.start += length;
+          next_copy = (next_copy + 1) % spec->copies;
+        }
+        continue;
+      }
+
+      for (int i = 0; i < spec->copies; i++) {
+        struct fanout_copy* copy = &copies[i];
+        if (fds[f].fd == copy->in_fd) {
+          ssize_t written = write(copy->in_fd, copy->pending_in.data + copy->pending_in.start,
+                                  copy->pending_in.end - copy->pending_in.start);
+          if (written > 0) {
+            copy->pending_in.start += written;
+          }
+        } else if (fds[f].fd == copy->out_fd) {
+          reserve_bytes(&copy->pending_out, FANOUT_READ_SIZE);
+          ssize_t bytes = read(copy->out_fd, copy->pending_out.data + copy->pending_out.end, FANOUT_READ_SIZE);
+          if (bytes > 0) {
+            if (!copy->seen_output) {
+              trace_event(TRACE_FIRST_OUTPUT, copy->pid, 0);
+              copy->seen_output = 1;
+            }
+            copy->pending_out.end += bytes;
+          } else if (bytes == 0 || (errno != EAGAIN && errno != EINTR)) {
+            close(copy->out_fd);
+            copy->out_fd = -1;
+          }
+          if (!spec->ordered) {
+            // Any complete lines can go, the rest too once the copy is done
+            char* data = copy->pending_out.data + copy->pending_out.start;
+            size_t size = copy->pending_out.end - copy->pending_out.start;
+            char* last = memrchr(data, '\n', size);
+            size_t length = copy->out_fd == -1 ? size : (last == NULL ? 0 : (size_t)(last + 1 - data));
+            write_all_or_exit(out_fd, data, length);
+            copy->pending_out.start += length;
+          }
+        }
+      }
+    }
+
+    // Ordered output: emit the records in input order as soon as their lines are back
+    while (spec->ordered && records_head < records_tail) {
+      struct fanout_copy* copy = &copies[records[records_head].copy];
+      char* data = copy->pending_out.data + copy->pending_out.start;
+      size_t size = copy->pending_out.end - copy->pending_out.start;
+      size_t length = length_of_lines(data, size, records[records_head].lines);
+      if (length == 0 && records[records_head].lines > 0) {
+        if (copy->out_fd != -1) {
+          break; // Not back yet
+        }
+        length = size; // The copy ended early, give what it wrote
+      }
+      write_all_or_exit(out_fd, data, length);
+      copy->pending_out.start += length;
+      records_head++;
+    }
+  }
+
+  // Whatever is left (ordered copies printing more lines than they got)
+  for (int i = 0; i < spec->copies; i++) {
+    write_all_or_exit(out_fd, copies[i].pending_out.data + copies[i].pending_out.start,
+                      copies[i].pending_out.end - copies[i].pending_out.start);
+  }
+
+  // The stage fails if any copy failed
+  for (int i = 0; i < spec->copies; i++) {
+    int status = 0;
+    if (copies[i].pid > 0 && waitpid(copies[i].pid, &status, 0) == copies[i].pid) {
+      trace_event(TRACE_REAP, copies[i].pid, status);
+      if (exit_status == 0 && exit_code_of(status) != 0) {
+        exit_status = exit_code_of(status);
+      }
+    }
+    if (copies[i].pid == 0 && exit_status == 0) {
+      exit_status = 127;
+    }
+  }
+  _exit(exit_status);
+}
+
+// Launches the relay process of a fan-out stage in place of the command.
+// req->argv starts with the "@N" word. unused_fd is a descriptor the shell holds
+// at this point that the relay must not keep (the read end of its output pipe).
+// returns like spawn_command
+pid_t spawn_fanout_stage(const struct spawn_request* req, const struct fanout_spec* spec, int unused_fd) {
+  uint64_t spawn_start = trace_spawn_start();
+  pid_t pid = fork();
+
+  if (pid == 0) { // Relay process
+    // Like any pipeline stage, the relay dies on Ctrl+C, or of SIGPIPE if a copy or the next stage stops reading
+    signal(SIGINT, req->is_background ? SIG_IGN : SIG_DFL);
+    // The copies must be children of the relay, not launched by the shell's zygote
+    if (zygote.fd != -1) {
+      close(zygote.fd);
+      zygote.fd = -1;
+    }
+    if (unused_fd != -1) {
+      close(unused_fd);
+    }
+    close_profile_links();
+    if (req->err_fd != -1) {
+      dup2(req->err_fd, STDERR_FILENO);
+    }
+    run_fanout_relay(spec, req->argv + 1, req->in_fd != -1 ? req->in_fd : STDIN_FILENO,
+                     req->out_fd != -1 ? req->out_fd : STDOUT_FILENO, req->is_background);
+  }
+  if (pid > 0) {
+    trace_spawned(pid, spawn_start);
+  }
+  return pid;
+}
+
+// Launches req like spawn_command, or its fan-out relay when spec is not NULL.
+// While the system is out of processes (EAGAIN, ENOMEM) it tries again after
+// waits growing from SPAWN_BACKOFF_MIN_NS to SPAWN_BACKOFF_MAX_NS, reaping the
+// background jobs that finish meanwhile. Never used inside a relay, which must
+// not touch the shell's event loop.
+// returns like spawn_command, -1 once SPAWN_MAX_RETRIES retries failed
+pid_t spawn_with_retry(const struct spawn_request* req, const struct fanout_spec* spec, int unused_fd) {
+  long delay = SPAWN_BACKOFF_MIN_NS;
+
+  for (int attempt = 0;; attempt++) {
+    pid_t pid = spec != NULL ? spawn_fanout_stage(req, spec, unused_fd) : spawn_command(req);
+    if (pid >= 0 || !is_process_creation_error(errno) || attempt == SPAWN_MAX_RETRIES) {
+      return pid;
+    }
+    int error = errno;
+    spawn_stats.retried++;
+    collect_finished_jobs();
+    struct timespec wait = { delay / 1000000000L, delay % 1000000000L };
+    while (nanosleep(&wait, &wait) == -1 && errno == EINTR) {
+    }
+    collect_finished_jobs();
+    delay = delay * 2 > SPAWN_BACKOFF_MAX_NS ? SPAWN_BACKOFF_MAX_NS : delay * 2;
+    errno = error;
+  }
+}
+
+// Argument batches, see builtin_batch
+struct batch_run {
+  char** base; // command and arguments every batch starts with
+  int num_base;
+  char** items;
+  int num_items;
+  char* data; // the whole input, items point into it
+  size_t max_bytes; // of argv and environment for one command
+  int max_items; // per command
+  int in_stage; // runs in the process of a pipeline stage, see spawn_batch_stage
+};
+
+// Set in the process of a pipeline stage running batch
+static int batch_stage;
+
+// Reads the items of run from fd: words separated by blanks and newlines, or
+// with nul strings separated by '\0'. Empty items are skipped.
+// returns 0 on failure (already reported)
+int read_batch_items(struct batch_run* run, int fd, int nul) {
+  size_t length = 0;
+  size_t capacity = 0;
+  while (1) {
+    if (capacity - length < BATCH_READ_SIZE) {
+      capacity = capacity == 0 ? BATCH_READ_SIZE * 2 : capacity * 2;
+      char* data = realloc(run->data, capacity);
+      if (data == NULL) {
+        perror("error in batch malloc");
+        return 0;
+      }
+      run->data = data;
+    }
+    ssize_t bytes = read(fd, run->data + length, capacity - length - 1);
+    if (bytes == 0) {
+      break;
+    }
+    if (bytes == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("error in batch read");
+      return 0;
+    }
+    length += bytes;
+  }
+  run->data[length] = '\0';
+
+  int capacity_items = 0;
+  size_t i = 0;
+  while (i < length) {
+    size_t end = i;
+    while (end < length && (nul ? run->data[end] != '\0' : strchr(" \t\n", run->data[end]) == NULL)) {
+      end++;
+    }
+    if (end > i) {
+      if (run->num_items == capacity_items) {
+        capacity_items = capacity_items == 0 ? 1024 : capacity_items * 2;
+        char** items = realloc(run->items, sizeof(char*) * capacity_items);
+        if (items == NULL) {
+          perror("error in batch malloc");
+          return 0;
+        }
+        run->items = items;
+      }
+      run->items[run->num_items++] = run->data + i;
+    }
+    run->data[end] = '\0';
+    i = end + 1;
+  }
+  return 1;
+}
+
+// returns the number of items, starting at first, that the next command takes:
+// as many as fit in run->max_bytes with base_bytes already used, at least one
+int next_batch_size(const struct batch_run* run, int first, size_t base_bytes) {
+  size_t bytes = base_bytes;
+  int count = 0;
+  while (first + count < run->num_items && count < run->max_items) {
+    size_t item_bytes = strlen(run->items[first + count]) + 1 + sizeof(char*);
+    if (count > 0 && bytes + item_bytes > run->max_bytes) {
+      break;
+    }
+    bytes += item_bytes;
+    count++;
+  }
+  return count;
+}
+
+// A command of run_batches that has not finished yet
+struct batch_slot {
+  pid_t pid;
+  int num_items;
+  struct timespec start_time;
+};
+
+// Runs the commands of run, at most max_running at a time, and records each one
+// in the job table once it is done, all under one job id (not in a pipeline
+// stage, whose process has no job table of its own). Sets $? like xargs: 127 if
+// the command could not be executed (nothing more is started then), 125 if a
+// command was killed by a signal, 123 if one exited with another status.
+void run_batches(struct batch_run* run, long max_running) {
+  int max_items = run->max_items < run->num_items ? run->max_items : run->num_items;
+  char** argv = malloc(sizeof(char*) * (run->num_base + max_items + 1));
+  struct batch_slot* running = malloc(sizeof(struct batch_slot) * max_running);
+  if (argv == NULL || running == NULL) {
+    perror("error in batch malloc");
+    free(argv);
+    free(running);
+    last_status = 1;
+    return;
+  }
+  memcpy(argv, run->base, sizeof(char*) * run->num_base);
+
+  size_t base_bytes = sizeof(char*);
+  for (int i = 0; i < run->num_base; i++) {
+    base_bytes += strlen(run->base[i]) + 1 + sizeof(char*);
+  }
+
+  // What the job table shows for each command: the base words and an item count
+  char count_label[32];
+  char** label = argv; // Reused once a command is launched
+  struct timespec start_time, end_time;
+  int num_running = 0, next_item = 0, num_commands = 0, num_failed = 0;
+  int job_id = 0, not_executable = 0, signaled = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+  while ((next_item < run->num_items && !not_executable) || num_running > 0) {
+    // Fill the free slots
+    while (num_running < max_running && next_item < run->num_items && !not_executable) {
+      int count = next_batch_size(run, next_item, base_bytes);
+      if (strlen(run->items[next_item]) + 1 > BATCH_MAX_ARG_LENGTH ||
+          (count == 1 && base_bytes + strlen(run->items[next_item]) + 1 + sizeof(char*) > run->max_bytes)) {
+        fprintf(stderr, "batch: argument too long: %.32s...\n", run->items[next_item]);
+        next_item++;
+        num_failed++;
+        continue;
+      }
+      memcpy(argv + run->num_base, run->items + next_item, sizeof(char*) * count);
+      argv[run->num_base + count] = NULL;
+
+      // With commands running, a slot freeing up is a better wait than a backoff
+      struct spawn_request req = { argv, -1, -1, -1, 0, next_child_setup(1) };
+      struct timespec launch_time;
+      clock_gettime(CLOCK_MONOTONIC, &launch_time);
+      pid_t pid = num_running > 0 || run->in_stage ? spawn_command(&req) : spawn_with_retry(&req, NULL, -1);
+      if (pid < 0 && num_running > 0) {
+        spawn_stats.queued++;
+        break; // Out of processes, retry once a slot frees up
+      }
+      next_item += count;
+      num_commands++;
+      if (pid <= 0) {
+        if (pid < 0) {
+          perror("error in batch fork exec");
+          spawn_stats.dropped++;
+        } else {
+          not_executable = 1; // Every other batch would fail the same way
+        }
+        num_failed++;
+      } else {
+        running[num_running].pid = pid;
+        running[num_running].num_items = count;
+        running[num_running].start_time = launch_time;
+        num_running++;
+      }
+    }
+    if (num_running == 0) {
+      continue;
+    }
+
+    // A stage's only children are its commands, the shell's may be jobs too
+    int status;
+    struct rusage usage;
+    pid_t pid = run->in_stage ? wait4(-1, &status, 0, &usage) : wait_for_any_child();
+    if (pid == -1) {
+      perror("error in batch waitid");
+      break;
+    }
+    if (!run->in_stage && wait4(pid, &status, 0, &usage) != pid) {
+      continue;
+    }
+    trace_event(TRACE_REAP, pid, status);
+    for (int slot = 0; slot < num_running; slot++) {
+      if (running[slot].pid != pid) {
+        continue;
+      }
+      if (!run->in_stage) {
+        snprintf(count_label, sizeof(count_label), "[%d items]", running[slot].num_items);
+        label[run->num_base] = count_label;
+        label[run->num_base + 1] = NULL;
+        struct job* job = add_finished_job(pid, label, job_id, status, &usage, &running[slot].start_time);
+        if (job == NULL) {
+          perror("error in batch add_job");
+        } else {
+          job_id = job->id;
+        }
+      }
+      // A child that could not exec the command exits with 127
+      not_executable |= WIFEXITED(status) && WEXITSTATUS(status) == 127;
+      num_failed += exit_code_of(status) != 0;
+      signaled |= WIFSIGNALED(status);
+      running[slot] = running[--num_running];
+      break;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end_time);
+  double seconds = timespec_seconds(&start_time, &end_time);
+  fprintf(stderr, "batch: %d items in %d commands in %.3f s with -j %ld, %d failed", run->num_items,
+          num_commands, seconds, max_running, num_failed);
+  if (job_id != 0) {
+    fprintf(stderr, ", job %d", job_id);
+  }
+  fprintf(stderr, "\n");
+  last_status = not_executable ? 127 : signaled ? 125 : num_failed > 0 ? 123 : 0;
+  free(argv);
+  free(running);
+}
+
+// batch [-j N] [-n items] [-s bytes] [-0] [-a file] [command args...]
+// Reads items from stdin (or file), words separated by blanks and newlines or
+// with -0 strings separated by NUL bytes, and runs command (echo without one)
+// with as many of them appended as fit under ARG_MAX with the environment,
+// -s bytes or -n items, so that thousands of items cost a handful of execs.
+// Up to N commands run at a time (default 1, 0 for the number of online CPUs);
+// with N above 1 and no -n, the items are spread so that every slot gets some.
+// Each command is recorded in the job table once done, all under one job id
+// (see jobs and wait %N), and $? sums them up like xargs does. Nothing runs
+// without items. Items come from a redirection, a here-document, -a or the
+// previous stage of a pipeline (see spawn_batch_stage). The shell's own stdin
+// is only read when it is a terminal, anything else holds the commands.
+int builtin_batch(int count, char** arglist) {
+  static char* default_command[] = { "echo" };
+  struct batch_run run = { 0 };
+  long max_running = 1;
+  long max_items = 0;
+  size_t max_bytes = 0;
+  const char* file = NULL;
+  int nul = 0;
+  int i = 1;
+  char* end;
+
+  for (; i < count && arglist[i][0] == '-'; i++) {
+    if (strcmp(arglist[i], "-0") == 0) {
+      nul = 1;
+    } else if (strcmp(arglist[i], "-j") == 0 && i + 1 < count &&
+               (max_running = strtol(arglist[i + 1], &end, 10)) >= 0 && *end == '\0' && end != arglist[i + 1]) {
+      i++;
+    } else if (strcmp(arglist[i], "-n") == 0 && i + 1 < count && (max_items = atol(arglist[i + 1])) > 0) {
+      i++;
+    } else if (strcmp(arglist[i], "-s") == 0 && i + 1 < count && parse_size(arglist[i + 1], &max_bytes)) {
+      i++;
+    } else if (strcmp(arglist[i], "-a") == 0 && i + 1 < count) {
+      file = arglist[++i];
+    } else {
+      fprintf(stderr, "usage: batch [-j N] [-n items] [-s bytes] [-0] [-a file] [command args...]\n");
+      last_status = 1;
+      return 1;
+    }
+  }
+  if (max_running == 0) {
+    max_running = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (settings.spawn_limit > 0 && max_running > settings.spawn_limit) {
+    max_running = settings.spawn_limit;
+  }
+  if (max_running < 1) {
+    max_running = 1;
+  }
+  run.base = i < count ? &arglist[i] : default_command;
+  run.num_base = i < count ? count - i : 1;
+
+  // The kernel counts the environment and the pointers to every string against ARG_MAX
+  size_t env_bytes = sizeof(char*);
+  for (char** var = environ; *var != NULL; var++) {
+    env_bytes += strlen(*var) + 1 + sizeof(char*);
+  }
+  long arg_max = sysconf(_SC_ARG_MAX);
+  run.max_bytes = arg_max > 0 && (size_t)arg_max > env_bytes + BATCH_ARG_HEADROOM
+                      ? (size_t)arg_max - env_bytes - BATCH_ARG_HEADROOM : BATCH_ARG_HEADROOM;
+  if (max_bytes > 0 && max_bytes < run.max_bytes) {
+    run.max_bytes = max_bytes;
+  }
+
+  if (file == NULL && !builtin_stdin_redirected && !isatty(STDIN_FILENO)) {
+    fprintf(stderr, "batch: no items: give them with <, a here-document, a pipe or -a\n");
+    last_status = 1;
+    return 1;
+  }
+  int fd = file != NULL ? open(file, O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+  if (fd == -1) {
+    fprintf(stderr, "batch: %s: %s\n", file, strerror(errno));
+    last_status = 1;
+    return 1;
+  }
+  int ok = read_batch_items(&run, fd, nul);
+  if (fd != STDIN_FILENO) {
+    close(fd);
+  }
+
+  if (ok) {
+    run.in_stage = batch_stage;
+    run.max_items = max_items > 0 && max_items < INT_MAX ? (int)max_items : INT_MAX;
+    if (max_items == 0 && max_running > 1) {
+      run.max_items = (run.num_items + max_running - 1) / max_running;
+    }
+    run_batches(&run, max_running);
+  } else {
+    last_status = 1;
+  }
+
+  free(run.items);
+  free(run.data);
+  return 1;
+}
+
+// Launches the process of a pipeline stage running batch, in place of the
+// system's batch command. It runs builtin_batch with the stage's ends as its
+// stdin and stdout, so that producer | batch command works like xargs, and
+// exits with the status batch sets. A background batch without input gets
+// /dev/null like any background command of a non-interactive shell would.
+// unused_fd is like for spawn_fanout_stage. returns like spawn_command
+pid_t spawn_batch_stage(const struct spawn_request* req, int unused_fd) {
+  uint64_t spawn_start = trace_spawn_start();
+  pid_t pid = fork();
+
+  if (pid == 0) { // Stage process
+    signal(SIGINT, req->is_background ? SIG_IGN : SIG_DFL);
+    // The commands must be children of the stage, not launched by the shell's zygote
+    if (zygote.fd != -1) {
+      close(zygote.fd);
+      zygote.fd = -1;
+    }
+    if (unused_fd != -1) {
+      close(unused_fd);
+    }
+    close_profile_links();
+    int in_fd = req->in_fd;
+    if (in_fd == -1 && req->is_background) {
+      in_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    if (in_fd != -1) {
+      dup2(in_fd, STDIN_FILENO);
+    }
+    if (req->out_fd != -1) {
+      dup2(req->out_fd, STDOUT_FILENO);
+    }
+    if (req->err_fd != -1) {
+      dup2(req->err_fd, STDERR_FILENO);
+    }
+    builtin_stdin_redirected = in_fd != -1;
+    batch_stage = 1;
+    int count = 0;
+    while (req->argv[count] != NULL) {
+      count++;
+    }
+    builtin_batch(count, req->argv);
+    fflush(stdout);
+    _exit(last_status);
+  }
+  if (pid > 0) {
+    trace_spawned(pid, spawn_start);
+  }
+  return pid;
+}
+
+// Number of processes the stages will run: one per stage, and for an "@N" stage
+// its relay and its N copies
+int count_pipeline_processes(const struct stage_plan* stages, int num_stages) {
+  int num_processes = 0;
+  for (int i = 0; i < num_stages; i++) {
+    struct fanout_spec fanout;
+    if (parse_fanout_spec(stages[i].argv[0], &fanout) && stages[i].argv[1] != NULL) {
+      num_processes += fanout.copies;
+    }
+    num_processes++;
+  }
+  return num_processes;
+}
+
+// Admission control for a command of num_processes processes: while that many
+// more would take the running background processes past set spawnlimit, waits
+// for jobs to finish. A command bigger than the limit runs once nothing else does.
+void admit_processes(int num_processes) {
+  if (settings.spawn_limit == 0 || job_table.num_running == 0 ||
+      job_table.num_running + num_processes <= settings.spawn_limit) {
+    return;
+  }
+  spawn_stats.queued++;
+  while (job_table.num_running > 0 && job_table.num_running + num_processes > settings.spawn_limit) {
+    int stdin_ready = 0;
+    run_event_loop_once(-1, &stdin_ready);
+  }
+}
+
+// Kills and reaps the processes already started for a pipeline that cannot be
+// completed, so that nothing is left running with half of its pipes
+void abort_partial_pipeline(const pid_t* pids, int num_started) {
+  for (int i = 0; i < num_started; i++) {
+    if (pids[i] > 0) {
+      kill(pids[i], SIGKILL);
+    }
+  }
+  for (int i = 0; i < num_started; i++) {
+    int status;
+    if (pids[i] > 0 && waitpid(pids[i], &status, 0) == pids[i]) {
+      trace_event(TRACE_REAP, pids[i], status);
+    }
+  }
+}
+
+// Puts the shell between the two ends of pipe_fds for profiling: stage i keeps
+// writing into pipe_fds[1], pipe_fds[0] becomes the read end of a new pipe of
+// size pipe_size for stage i + 1, and link gets the shell's two ends
+// returns 0 if the second pipe could not be created (reported)
+int start_profile_link(struct profile_link* link, int* pipe_fds, size_t pipe_size) {
+  int down[2];
+  if (pipe2(down, O_CLOEXEC) == -1) {
+    perror("error in start_profile_link pipe creation");
+    return 0;
+  }
+  set_pipe_size(down[1], pipe_size);
+  link->from = pipe_fds[0];
+  link->to = down[1];
+  link->state = LINK_EMPTY;
+  fcntl(link->from, F_SETFL, O_NONBLOCK);
+  fcntl(link->to, F_SETFL, O_NONBLOCK);
+  pipe_fds[0] = down[0];
+  return 1;
+}
+
+// Splices what it can through link, then records which side it waits for
+void pump_link(struct profile_link* link) {
+  for (int i = 0; i < PROFILE_MAX_SPLICES; i++) {
+    ssize_t moved = splice(link->from, NULL, link->to, NULL, PROFILE_SPLICE_SIZE,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (moved > 0) {
+      link->bytes += moved;
+      continue;
+    }
+    if (moved == -1 && errno == EINTR) {
+      continue;
+    }
+    if (moved == -1 && errno == EAGAIN) {
+      // Either side can be the one that is not ready
+      struct pollfd check[2] = { { link->from, POLLIN, 0 }, { link->to, POLLOUT, 0 } };
+      poll(check, 2, 0);
+      if (!(check[1].revents & POLLERR)) {
+        link->state = (check[0].revents & (POLLIN | POLLHUP)) && !(check[1].revents & POLLOUT) ? LINK_FULL : LINK_EMPTY;
+        return;
+      }
+    }
+    // EOF from stage i, or EPIPE / POLLERR: stage i + 1 stopped reading.
+    // Closing both ends passes that on to the other stage.
+    close(link->from);
+    close(link->to);
+    link->from = link->to = -1;
+    link->state = LINK_DONE;
+    link->end_ns = trace_clock();
+    return;
+  }
+  link->state = LINK_EMPTY; // More may be ready, the next poll says so right away
+}
+
+// Charges the dt nanoseconds since the last wakeup: each link to the side it
+// waited for, and each stage that was holding the pipeline back, i.e. whose
+// input was full or done (the first stage's always counts) while its output
+// was empty (the last stage's output is not watched).
+void charge_profile_interval(uint64_t dt) {
+  int num_links = profile.num_stages - 1;
+  for (int i = 0; i < num_links; i++) {
+    if (profile.links[i].state == LINK_EMPTY) {
+      profile.links[i].empty_ns += dt;
+    } else if (profile.links[i].state == LINK_FULL) {
+      profile.links[i].full_ns += dt;
+    }
+  }
+  for (int i = 0; i < profile.num_stages; i++) {
+    int input_waits = i == 0 || profile.links[i - 1].state != LINK_EMPTY;
+    int output_waits = i == num_links ? profile.links[i - 1].state != LINK_DONE : profile.links[i].state == LINK_EMPTY;
+    if (input_waits && output_waits) {
+      profile.limiting_ns[i] += dt;
+    }
+  }
+}
+
+// Relays the data of the profiled pipeline with splice, so it never gets
+// copied into the shell, until every link is done. Captured job output keeps
+// flowing meanwhile. SIGPIPE is ignored while relaying: a stage that stops
+// reading shows up as EPIPE.
+void relay_profiled_pipeline(void) {
+  int num_links = profile.num_stages - 1;
+  struct pollfd* fds = malloc(sizeof(struct pollfd) * (num_links + 1));
+  int* fd_links = malloc(sizeof(int) * num_links);
+  struct sigaction ignore, saved;
+  if (fds == NULL || fd_links == NULL) {
+    perror("error in relay_profiled_pipeline malloc");
+    free(fds);
+    free(fd_links);
+    close_profile_links();
+    return;
+  }
+  memset(&ignore, 0, sizeof(ignore));
+  ignore.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &ignore, &saved);
+
+  uint64_t last = trace_clock();
+  while (1) {
+    int num_fds = 0;
+    for (int i = 0; i < num_links; i++) {
+      struct profile_link* link = &profile.links[i];
+      if (link->state == LINK_EMPTY) {
+        fds[num_fds] = (struct pollfd){ link->from, POLLIN, 0 };
+        fd_links[num_fds++] = i;
+      } else if (link->state == LINK_FULL) {
+        fds[num_fds] = (struct pollfd){ link->to, POLLOUT, 0 };
+        fd_links[num_fds++] = i;
+      }
+    }
+    if (num_fds == 0) {
+      break;
+    }
+    int num_links_polled = num_fds;
+    if (output_mux.num_open > 0) {
+      fds[num_fds++] = (struct pollfd){ output_mux.epoll_fd, POLLIN, 0 };
+    }
+
+    if (poll(fds, num_fds, -1) == -1 && errno != EINTR) {
+      perror("error in relay_profiled_pipeline poll");
+      close_profile_links();
+      break;
+    }
+    uint64_t now = trace_clock();
+    charge_profile_interval(now - last);
+    last = now;
+    for (int i = 0; i < num_links_polled; i++) {
+      if (fds[i].revents != 0) {
+        pump_link(&profile.links[fd_links[i]]);
+      }
+    }
+    if (num_fds > num_links_polled && fds[num_links_polled].revents != 0) {
+      relay_job_output(0);
+    }
+  }
+
+  sigaction(SIGPIPE, &saved, NULL);
+  free(fds);
+  free(fd_links);
+}
+
+// Prints the report of the profiled pipeline to stderr: the stages with their
+// CPU time and how long each held the pipeline back, the pipes with their
+// traffic and waits, and the slowest stage
+void print_profile_report(void) {
+  uint64_t end_ns = trace_clock();
+  double total = (end_ns - profile.start_ns) / 1e9;
+  int slowest = 0;
+
+  // Once the pipes are all done, the rest of the run is up to the last stage
+  struct stage_stats* last = timing.num_stages == profile.num_stages ? &timing.stages[profile.num_stages - 1] : NULL;
+  uint64_t relay_end = 0;
+  for (int i = 0; i < profile.num_stages - 1; i++) {
+    relay_end = profile.links[i].end_ns > relay_end ? profile.links[i].end_ns : relay_end;
+  }
+  if (last != NULL) {
+    uint64_t last_end = (uint64_t)last->end_time.tv_sec * 1000000000 + last->end_time.tv_nsec;
+    if (last_end > relay_end) {
+      profile.limiting_ns[profile.num_stages - 1] += last_end - relay_end;
+    }
+  }
+
+  fprintf(stderr, "profile: %d stages in %.3fs\n", profile.num_stages, total);
+  for (int i = 0; i < profile.num_stages; i++) {
+    const char* name = i < timing.num_stages ? timing.stages[i].name : "?";
+    double cpu = 0;
+    if (i < timing.num_stages) {
+      cpu = timeval_seconds(&timing.stages[i].usage.ru_utime) + timeval_seconds(&timing.stages[i].usage.ru_stime);
+    }
+    fprintf(stderr, "  [%d] %-12.12s cpu %.3fs  limiting %.3fs\n", i, name, cpu, profile.limiting_ns[i] / 1e9);
+    if (profile.limiting_ns[i] > profile.limiting_ns[slowest]) {
+      slowest = i;
+    }
+  }
+  for (int i = 0; i < profile.num_stages - 1; i++) {
+    const struct profile_link* link = &profile.links[i];
+    double seconds = ((link->end_ns != 0 ? link->end_ns : end_ns) - profile.start_ns) / 1e9;
+    fprintf(stderr, "  pipe %d->%d %12llu bytes %9.1f MB/s  empty %.3fs  full %.3fs\n", i, i + 1,
+            (unsigned long long)link->bytes, seconds > 0 ? link->bytes / seconds / 1e6 : 0.0,
+            link->empty_ns / 1e9, link->full_ns / 1e9);
+  }
+  fprintf(stderr, "profile: slowest stage [%d] %s, holding the pipeline back %.3fs of %.3fs\n", slowest,
+          slowest < timing.num_stages ? timing.stages[slowest].name : "?", profile.limiting_ns[slowest] / 1e9, total);
+}
+
+void close_redirections(int in_fd, int out_fd, int err_fd) {
+  if (in_fd != -1) {
+    close(in_fd);
+  }
+  if (out_fd != -1) {
+    close(out_fd);
+  }
+  if (err_fd != -1) {
+    close(err_fd);
+  }
+}
+
+// Returns a descriptor to read the here-document or here-string of stage from.
+// Data that fits in a pipe is written to one up front and the write end closed,
+// so the reader sees it followed by end of file. Anything bigger would block
+// the shell, so it goes to a sealed memfd instead, read from offset 0.
+// returns -1 on failure (reported)
+int open_here_document(const struct stage_plan* stage) {
+  size_t size = strlen(stage->here_data);
+  size_t total = size + stage->here_string;
+
+  if (total <= HEREDOC_PIPE_MAX) {
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+      perror("error in open_here_document pipe");
+      return -1;
+    }
+    long capacity = set_pipe_size(pipe_fds[1], 0);
+    if (capacity != -1 && total <= (size_t)capacity) {
+      int written = write_all(pipe_fds[1], stage->here_data, size) &&
+                    (!stage->here_string || write_all(pipe_fds[1], "\n", 1));
+      if (!written) {
+        perror("error in open_here_document write");
+        close(pipe_fds[0]);
+        pipe_fds[0] = -1;
+      }
+      close(pipe_fds[1]);
+      return pipe_fds[0];
+    }
+    // A pipe shrunk by the per-user pipe limits, use the memfd
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+  }
+
+  int fd = memfd_create("here-document", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd == -1) {
+    perror("error in open_here_document memfd_create");
+    return -1;
+  }
+  if (!write_all(fd, stage->here_data, size) ||
+      (stage->here_string && !write_all(fd, "\n", 1))) {
+    perror("error in open_here_document write");
+    close(fd);
+    return -1;
+  }
+  // The reader cannot change the document; sealing is not worth failing over
+  fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+  if (lseek(fd, 0, SEEK_SET) == -1) {
+    perror("error in open_here_document lseek");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Opens the files of the redirections of stage, O_CLOEXEC like every descriptor
+// the shell opens for its children. Descriptors without a redirection are -1.
+// returns 1 on success, 0 if a file could not be opened (reported, nothing left open)
+int open_redirections(const struct stage_plan* stage, int* in_fd, int* out_fd, int* err_fd) {
+  const char* failed = NULL;
+
+  *in_fd = *out_fd = *err_fd = -1;
+  if (stage->here_data != NULL && (*in_fd = open_here_document(stage)) == -1) {
+    return 0;
+  }
+  if (stage->input != NULL && (*in_fd = open(stage->input, O_RDONLY | O_CLOEXEC)) == -1) {
+    failed = stage->input;
+  }
+  if (failed == NULL && stage->output != NULL) {
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (stage->append ? O_APPEND : O_TRUNC);
+    if ((*out_fd = open(stage->output, flags, 0600)) == -1) {
+      failed = stage->output;
+    }
+  }
+  if (failed == NULL && stage->error_output != NULL &&
+      (*err_fd = open(stage->error_output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) == -1) {
+    failed = stage->error_output;
+  }
+  if (failed == NULL) {
+    return 1;
+  }
+
+  fprintf(stderr, "error in open_redirections open %s: %s\n", failed, strerror(errno));
+  close_redirections(*in_fd, *out_fd, *err_fd);
+  *in_fd = *out_fd = *err_fd = -1;
+  return 0;
+}
+
+// Records the processes of a background command in the job table as one job
+// returns its id, 0 if no process was started
+int add_background_jobs(const struct stage_plan* stages, const pid_t* pids, int num_started) {
+  int id = 0;
+  for (int i = 0; i < num_started; i++) {
+    if (pids[i] <= 0) {
+      continue;
+    }
+    struct job* job = add_job(pids[i], stages[i].argv, id);
+    if (job == NULL) {
+      perror("error in background option add_job");
+      continue;
+    }
+    id = job->id;
+    watch_job(job);
+  }
+  return id;
+}
+
+// A stream builtin stage of a foreground pipeline (set streams on). Its ends are
+// collected while the processes of the pipeline are launched, and its thread is
+// started only once all of them are, so the shell never forks with a thread running.
+struct stream_slot {
+  int is_stream;
+  int pending; // in, out and err_fd wait for start_stream_stage
+  struct stream_end in;
+  struct stream_end out;
+  int err_fd;
+  struct stream_stage* stage;
+};
+
+// Gives end a copy of fd, or the ring when fd is -1 and there is one, or a copy
+// of std_fd. A ring that is not used is given up, *ring is cleared either way.
+// returns 0 if the descriptor could not be copied
+int set_stream_end(struct stream_end* end, int fd, struct stream_ring** ring, int std_fd, int reading) {
+  if (fd == -1 && *ring != NULL) {
+    end->ring = *ring;
+    *ring = NULL;
+    return 1;
+  }
+  if (*ring != NULL && reading) {
+    stream_ring_close_read(*ring);
+  } else if (*ring != NULL) {
+    stream_ring_close_write(*ring);
+  }
+  *ring = NULL;
+  end->fd = fcntl(fd != -1 ? fd : std_fd, F_DUPFD_CLOEXEC, 0);
+  return end->fd != -1;
+}
+
+// Closes the ends collected for a stream stage that will not be started
+void release_stream_slot(struct stream_slot* slot) {
+  if (!slot->pending) {
+    return;
+  }
+  if (slot->in.ring != NULL) {
+    stream_ring_close_read(slot->in.ring);
+  } else if (slot->in.fd != -1) {
+    close(slot->in.fd);
+  }
+  if (slot->out.ring != NULL) {
+    stream_ring_close_write(slot->out.ring);
+  } else if (slot->out.fd != -1) {
+    close(slot->out.fd);
+  }
+  if (slot->err_fd != -1) {
+    close(slot->err_fd);
+  }
+  slot->pending = 0;
+}
+
+// Ctrl+C while stream stages run: the shell ignores SIGINT, and its threads
+// would then never stop. Blocked, SIGINT is no longer dropped and can be read
+// from event_loop.interrupt_fd. Called once every process of the pipeline is
+// launched, so that none of them starts with SIGINT blocked.
+// returns 0 if it cannot be caught (the stages then run uninterruptible)
+int catch_interrupts(void) {
+  sigset_t sigint;
+  sigemptyset(&sigint);
+  sigaddset(&sigint, SIGINT);
+  return sigprocmask(SIG_BLOCK, &sigint, NULL) == 0;
+}
+
+// Ignores Ctrl+C again, dropping one that came after the stages were done
+void release_interrupts(void) {
+  struct signalfd_siginfo info;
+  sigset_t sigint;
+  while (read(event_loop.interrupt_fd, &info, sizeof(info)) == sizeof(info)) {
+  }
+  sigemptyset(&sigint);
+  sigaddset(&sigint, SIGINT);
+  sigprocmask(SIG_UNBLOCK, &sigint, NULL);
+}
+
+// Waits until the started stream stages of a foreground pipeline have finished,
+// cancelling all of them on Ctrl+C (see catch_interrupts)
+void wait_for_stream_stages(struct stream_slot* streams, int num_stages) {
+  struct pollfd* fds = malloc(sizeof(struct pollfd) * (num_stages + 1));
+  int num_fds = 0;
+  if (fds == NULL) {
+    return; // Joined without a way to interrupt them
+  }
+  fds[num_fds++] = (struct pollfd){ event_loop.interrupt_fd, POLLIN, 0 };
+  for (int i = 0; i < num_stages; i++) {
+    if (streams[i].stage != NULL) {
+      fds[num_fds++] = (struct pollfd){ stream_stage_done_fd(streams[i].stage), POLLIN, 0 };
+    }
+  }
+
+  int remaining = num_fds - 1;
+  int cancelled = 0;
+  while (remaining > 0) {
+    if (poll(fds, num_fds, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("error in wait_for_stream_stages poll");
+      break;
+    }
+    for (int f = 1; f < num_fds; f++) {
+      if (fds[f].revents != 0) {
+        fds[f].fd = -1; // poll skips it from now on
+        remaining--;
+      }
+    }
+    if (fds[0].revents != 0 && !cancelled) {
+      for (int i = 0; i < num_stages; i++) {
+        if (streams[i].stage != NULL) {
+          cancel_stream_stage(streams[i].stage);
+        }
+      }
+      cancelled = 1;
+      fds[0].fd = -1;
+    }
+  }
+  free(fds);
+}
+
+// Runs the stages connected by pipes and waits for all of them, or with
+// is_background records them as a job and returns right away.
+// Each pipe is created right before the command writing into it is launched, and
+// the shell closes its copies of both ends as soon as the two commands using them
+// have been launched, so the shell never holds more than three pipe descriptors
+// whatever the length of the pipeline. Stages open their own redirections (see
+// struct stage_plan), so the ends of a pipeline read and write files directly.
+// A stage whose file cannot be opened does not run and counts as failed.
+// pipe_size is the capacity requested for every pipe, 0 keeps the kernel default.
+// A stage starting with an "@N" word runs N copies of its command, see struct fanout_spec.
+// A batch stage runs the batch builtin in a process of its own, see spawn_batch_stage.
+// A background command's output goes through the shell unless set joboutput is direct.
+// A background command is admitted as a whole, its "@N" copies included (see
+// admit_processes). If a process cannot be created in the end, those already
+// started are killed.
+// Under the profile prefix, a foreground pipeline is relayed through the shell.
+// With set streams on, the stream builtins of a foreground pipeline run as
+// threads of the shell, two of them next to each other sharing a ring instead
+// of a pipe (see streams.h), and Ctrl+C cancels them.
+int setup_and_execute_pipeline(const struct stage_plan* stages, int num_stages, size_t pipe_size, int is_background) {
+  pid_t* pids = malloc(sizeof(pid_t) * num_stages);
+  struct timespec* start_times = malloc(sizeof(struct timespec) * num_stages);
+  int prev_read = -1; // read end of the pipe feeding the current command
+  int num_started = 0;
+  int result = 1;
+  int dropped = 0;
+  int last_unopened = 0; // the redirections of the last stage could not be opened
+  int capture = -1;
+  int capture_out = -1; // write ends of the captured stdout and stderr
+  int capture_err = -1;
+  int profiling = profile.active && !is_background && num_stages > 1;
+  struct stream_slot* streams = NULL;
+  struct stream_ring* prev_ring = NULL; // read side of the ring feeding the current command
+  struct resource_limits limits;
+
+  current_limits(is_background, &limits);
+  if (profiling) {
+    profile.links = malloc(sizeof(struct profile_link) * (num_stages - 1));
+    profile.limiting_ns = calloc(num_stages, sizeof(uint64_t));
+    if (profile.links != NULL) {
+      memset(profile.links, 0, sizeof(struct profile_link) * (num_stages - 1));
+      for (int i = 0; i < num_stages - 1; i++) {
+        profile.links[i].from = profile.links[i].to = -1;
+        profile.links[i].state = LINK_DONE;
+      }
+    }
+    profile.num_stages = num_stages;
+    profile.start_ns = trace_clock();
+  }
+  // Threads of the shell cannot be limited, a limited pipeline runs real processes
+  if (settings.stream_builtins && !profiling && !is_background && num_stages > 1 && limits.set == 0 &&
+      (streams = calloc(num_stages, sizeof(struct stream_slot))) != NULL) {
+    for (int i = 0; i < num_stages; i++) {
+      streams[i].is_stream = is_stream_builtin(stages[i].argv);
+      streams[i].in.fd = streams[i].out.fd = streams[i].err_fd = -1;
+    }
+  }
+  if (pids == NULL || start_times == NULL || (profiling && (profile.links == NULL || profile.limiting_ns == NULL))) {
+    perror("error in setup_and_execute_pipeline malloc");
+    free(pids);
+    free(start_times);
+    free(streams);
+    return 0;
+  }
+  if (is_background) {
+    admit_processes(count_pipeline_processes(stages, num_stages));
+  }
+  if (is_background && settings.job_output != JOB_OUTPUT_DIRECT) {
+    capture = start_output_capture(&capture_out, &capture_err);
+  }
+  
+  for (int i = 0; i < num_stages; i++) {
+    int pipe_fds[2] = { -1, -1 };
+    int in_fd, out_fd, err_fd;
+    int is_stream = streams != NULL && streams[i].is_stream;
+    struct stream_ring* next_ring = NULL;
+
+    // Set up stdout to a new pipe if not the last command, or a ring between two stream stages
+    // It is close-on-exec, the children only keep the ends they dup2'd
+    if (i < num_stages - 1 && is_stream && streams[i + 1].is_stream) {
+      if ((next_ring = stream_ring_new()) == NULL) {
+        perror("error in setup_and_execute_pipeline stream_ring_new");
+        dropped = 1;
+        break;
+      }
+    } else if (i < num_stages - 1) {
+      if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+        perror("error in setup_and_execute_pipeline pipe creation");
+        dropped = 1;
+        break;
+      }
+      if (set_pipe_size(pipe_fds[1], pipe_size) == -1 && i == 0) {
+        perror("error in setup_and_execute_pipeline fcntl F_SETPIPE_SZ");
+      }
+      if (profiling && !start_profile_link(&profile.links[i], pipe_fds, pipe_size)) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        dropped = 1;
+        break;
+      }
+    } else {
+      pipe_fds[1] = capture_out; // -1 without a capture, the terminal
+    }
+
+    struct stream_ring* ring_out = next_ring; // write side, until stage i takes it
+    clock_gettime(CLOCK_MONOTONIC, &start_times[i]);
+    if (!open_redirections(&stages[i], &in_fd, &out_fd, &err_fd)) {
+      pids[i] = 0;
+      last_unopened = i == num_stages - 1;
+    } else if (is_stream) {
+      // Started below with copies of what a process would have been given
+      struct stream_slot* slot = &streams[i];
+      slot->pending = 1;
+      int ready = set_stream_end(&slot->in, in_fd != -1 ? in_fd : prev_read, &prev_ring, STDIN_FILENO, 1) &&
+                  set_stream_end(&slot->out, out_fd != -1 ? out_fd : pipe_fds[1], &ring_out, STDOUT_FILENO, 0) &&
+                  (slot->err_fd = fcntl(err_fd != -1 ? err_fd : STDERR_FILENO, F_DUPFD_CLOEXEC, 0)) != -1;
+      pids[i] = ready ? 0 : -1;
+      close_redirections(in_fd, out_fd, err_fd);
+    } else {
+      struct spawn_request req = { stages[i].argv, in_fd != -1 ? in_fd : prev_read,
+                                   out_fd != -1 ? out_fd : pipe_fds[1],
+                                   err_fd != -1 ? err_fd : capture_err, is_background, NULL };
+      struct fanout_spec fanout;
+      int is_fanout = parse_fanout_spec(stages[i].argv[0], &fanout) && stages[i].argv[1] != NULL;
+      int is_batch = strcmp(stages[i].argv[0], "batch") == 0;
+      if (!is_fanout && !is_batch) {
+        req.setup = next_child_setup(is_background);
+      }
+      if (is_batch) {
+        pids[i] = spawn_batch_stage(&req, pipe_fds[0]);
+      } else {
+        pids[i] = spawn_with_retry(&req, is_fanout ? &fanout : NULL, pipe_fds[0]);
+      }
+      close_redirections(in_fd, out_fd, err_fd);
+    }
+
+    // The ends given to this command are not needed by the shell anymore
+    if (prev_read != -1) {
+      close(prev_read);
+    }
+    if (pipe_fds[1] != -1) {
+      close(pipe_fds[1]);
+      if (pipe_fds[1] == capture_out) {
+        capture_out = -1;
+      }
+    }
+    if (prev_ring != NULL) {
+      stream_ring_close_read(prev_ring);
+    }
+    if (ring_out != NULL) {
+      stream_ring_close_write(ring_out);
+    }
+    prev_read = pipe_fds[0];
+    prev_ring = next_ring;
+
+    if (pids[i] < 0) {
+      perror("error in setup_and_execute_pipeline fork");
+      dropped = 1;
+      break;
+    }
+    num_started++;
+  }
+
+  if (prev_read != -1) {
+    close(prev_read);
+  }
+  if (prev_ring != NULL) {
+    stream_ring_close_read(prev_ring);
+  }
+  if (capture_out != -1) {
+    close(capture_out);
+  }
+  if (capture_err != -1) {
+    close(capture_err);
+  }
+  int interruptible = 0;
+  for (int i = 0; streams != NULL && !dropped && i < num_stages; i++) {
+    interruptible |= streams[i].pending;
+  }
+  interruptible = interruptible && catch_interrupts();
+  for (int i = 0; streams != NULL && i < num_stages; i++) {
+    if (dropped) {
+      release_stream_slot(&streams[i]);
+    } else if (streams[i].pending) {
+      streams[i].pending = 0;
+      streams[i].stage = start_stream_stage(stages[i].argv, streams[i].in, streams[i].out, streams[i].err_fd);
+      if (streams[i].stage == NULL) {
+        perror("error in setup_and_execute_pipeline start_stream_stage");
+      }
+    }
+  }
+  
+  if (dropped) {
+    abort_partial_pipeline(pids, num_started);
+    close_profile_links();
+    spawn_stats.dropped++;
+    last_status = 1;
+  } else if (is_background) {
+    // Do not wait for the children to finish, their exits are recorded in the job table
+    int id = add_background_jobs(stages, pids, num_started);
+    if (capture != -1) {
+      output_mux.captures[capture].job_id = id;
+    }
+    last_status = 0;
+  } else {
+    if (profiling) {
+      relay_profiled_pipeline();
+    }
+    int first_stage = timing.num_stages;
+    if (num_started > 0 && wait_for_pipeline(pids, stages, start_times, num_started) == 0) {
+      // Wait for all the child processes that were started
+      // If the pipeline was cut short they get EOF or SIGPIPE from the missing neighbour
+      result = 0;
+    }
+    if (last_unopened) {
+      last_status = 1;
+    }
+    if (interruptible) {
+      wait_for_stream_stages(streams, num_started);
+    }
+    for (int i = 0; streams != NULL && i < num_started; i++) {
+      if (streams[i].stage == NULL) {
+        continue;
+      }
+      struct rusage usage;
+      int status = join_stream_stage(streams[i].stage, &usage) << 8;
+      if (timing.active && first_stage + i < timing.num_stages) {
+        finish_stage(&timing.stages[first_stage + i], 0, status, &usage);
+      }
+      if (i == num_stages - 1) {
+        last_status = exit_code_of(status);
+      }
+    }
+  }
+
+  if (interruptible) {
+    release_interrupts();
+  }
+  free(pids);
+  free(start_times);
+  free(streams);
+  return result;
+}
+
+// Runs a single command in the foreground with its redirections and waits for it
+int execute_standard_command(const struct stage_plan* stage) {
+  int in_fd, out_fd, err_fd;
+  if (!open_redirections(stage, &in_fd, &out_fd, &err_fd)) {
+    last_status = 1;
+    return 1;
+  }
+
+  struct spawn_request req = { stage->argv, in_fd, out_fd, err_fd, 0, next_child_setup(0) };
+  struct timespec start_time;
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+  pid_t pid = spawn_with_retry(&req, NULL, -1);
+  close_redirections(in_fd, out_fd, err_fd);
+  
+  if (pid < 0) {
+    perror("error in default option fork exec");
+    spawn_stats.dropped++;
+    last_status = 1;
+    return 1;
+  }
+  
+  return wait_for_foreground(pid, stage->argv, &start_time); 
+}
+
+// One command per argument set, see builtin_parallel
+struct parallel_run {
+  char** base; // words given before :::, may be empty
+  int num_base;
+  char** words; // the words of all argument sets, one after the other
+  int* set_start; // index in words of the first word of each set (one extra entry at the end)
+  int num_sets;
+  char* file_data; // contents of the -a file, words points into it
+};
+
+// Appends the words of line as a new argument set
+// returns 0 on allocation failure
+int add_parallel_set(struct parallel_run* run, char** line_words, int num_words, int* words_capacity) {
+  if (run->set_start[run->num_sets] + num_words > *words_capacity) {
+    *words_capacity = (*words_capacity + num_words) * 2;
+    char** words = realloc(run->words, sizeof(char*) * *words_capacity);
+    if (words == NULL) {
+      return 0;
+    }
+    run->words = words;
+  }
+  int* set_start = realloc(run->set_start, sizeof(int) * (run->num_sets + 2));
+  if (set_start == NULL) {
+    return 0;
+  }
+  run->set_start = set_start;
+  memcpy(run->words + run->set_start[run->num_sets], line_words, sizeof(char*) * num_words);
+  run->set_start[run->num_sets + 1] = run->set_start[run->num_sets] + num_words;
+  run->num_sets++;
+  return 1;
+}
+
+// Reads the argument sets of run from path, one set per line
+// returns 0 on failure (already reported)
+int read_parallel_file(struct parallel_run* run, const char* path, int* words_capacity) {
+  FILE* file = fopen(path, "r");
+  size_t size = 0;
+  if (file == NULL || getdelim(&run->file_data, &size, '\0', file) == -1) {
+    perror("error in parallel reading the argument file");
+    if (file != NULL) {
+      fclose(file);
+    }
+    return 0;
+  }
+  fclose(file);
+
+  char* save_line;
+  for (char* line = strtok_r(run->file_data, "\n", &save_line); line != NULL; line = strtok_r(NULL, "\n", &save_line)) {
+    char* line_words[MAX_PARALLEL_LINE_WORDS];
+    int num_words = 0;
+    char* save_word;
+    for (char* word = strtok_r(line, " \t", &save_word); word != NULL && num_words < MAX_PARALLEL_LINE_WORDS; word = strtok_r(NULL, " \t", &save_word)) {
+      line_words[num_words++] = word;
+    }
+    if (num_words > 0 && !add_parallel_set(run, line_words, num_words, words_capacity)) {
+      perror("error in parallel malloc");
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Runs one command per argument set of run, at most max_running at a time,
+// and reports the totals. Sets $? to the number of failed commands (at most 101).
+void run_parallel(struct parallel_run* run, long max_running) {
+  // The longest argv any command will need
+  int max_words = 0;
+  for (int set = 0; set < run->num_sets; set++) {
+    int num_words = run->set_start[set + 1] - run->set_start[set];
+    max_words = num_words > max_words ? num_words : max_words;
+  }
+  char** argv = malloc(sizeof(char*) * (run->num_base + max_words + 1));
+  pid_t* running = malloc(sizeof(pid_t) * max_running);
+  if (argv == NULL || running == NULL) {
+    perror("error in parallel malloc");
+    free(argv);
+    free(running);
+    return;
+  }
+  memcpy(argv, run->base, sizeof(char*) * run->num_base);
+
+  struct timespec start_time, end_time;
+  int num_running = 0;
+  int next_set = 0;
+  int num_failed = 0;
+  struct resource_limits limits;
+  current_limits(1, &limits);
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+  while (next_set < run->num_sets || num_running > 0) {
+    // Fill the free slots
+    while (num_running < max_running && next_set < run->num_sets) {
+      int num_words = run->set_start[next_set + 1] - run->set_start[next_set];
+      memcpy(argv + run->num_base, run->words + run->set_start[next_set], sizeof(char*) * num_words);
+      argv[run->num_base + num_words] = NULL;
+
+      // With commands running, a slot freeing up is a better wait than a backoff
+      struct spawn_request req = { argv, -1, -1, -1, 0, next_child_setup(1) };
+      pid_t pid = num_running > 0 ? spawn_command(&req) : spawn_with_retry(&req, NULL, -1);
+      if (pid < 0 && num_running > 0) {
+        spawn_stats.queued++;
+        break; // Out of processes, retry once a slot frees up
+      }
+      next_set++;
+      if (pid <= 0) {
+        if (pid < 0) {
+          perror("error in parallel fork exec");
+          spawn_stats.dropped++;
+        }
+        num_failed++;
+      } else {
+        running[num_running++] = pid;
+      }
+    }
+    if (num_running == 0) {
+      continue;
+    }
+
+    pid_t pid = wait_for_any_child();
+    if (pid == -1) {
+      perror("error in parallel waitid");
+      break;
+    }
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == pid) {
+      trace_event(TRACE_REAP, pid, status);
+      report_limit_exit(0, pid, argv[0], status, &usage, &limits);
+      for (int slot = 0; slot < num_running; slot++) {
+        if (running[slot] == pid) {
+          running[slot] = running[--num_running];
+          num_failed += (exit_code_of(status) != 0);
+          break;
+        }
+      }
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end_time);
+  double seconds = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+  fprintf(stderr, "parallel: %d commands in %.3f s (%.1f commands/s) with -j %ld, %d failed\n",
+          run->num_sets, seconds, seconds > 0 ? run->num_sets / seconds : 0.0, max_running, num_failed);
+  last_status = num_failed > 101 ? 101 : num_failed;
+  free(argv);
+  free(running);
+}
+
+// parallel [-j N] [command args...] ::: set1 set2 ...
+// parallel [-j N] -a file [command args...]
+// Runs command once per argument set with the set appended to its arguments,
+// at most N at a time (default: the number of online CPUs). A new command starts
+// as soon as one finishes. Without a command each set is a command on its own.
+// With -a every line of file is a set. $? is the number of failed commands (at most 101).
+int builtin_parallel(int count, char** arglist) {
+  struct parallel_run run = { 0 };
+  long max_running = sysconf(_SC_NPROCESSORS_ONLN);
+  const char* file = NULL;
+  int words_capacity = 0;
+  int ok = 1;
+  int i = 1;
+
+  for (; i + 1 < count && arglist[i][0] == '-'; i += 2) {
+    if (strcmp(arglist[i], "-j") == 0) {
+      char* end;
+      max_running = strtol(arglist[i + 1], &end, 10);
+      if (*end != '\0' || end == arglist[i + 1] || max_running < 1) {
+        fprintf(stderr, "usage: parallel [-j N] [command args...] ::: set1 set2 ... "
+                        "| parallel [-j N] -a file [command args...] (N from 1)\n");
+        last_status = 1;
+        return 1;
+      }
+    } else if (strcmp(arglist[i], "-a") == 0) {
+      file = arglist[i + 1];
+    } else {
+      break;
+    }
+  }
+  if (settings.spawn_limit > 0 && max_running > settings.spawn_limit) {
+    max_running = settings.spawn_limit;
+  }
+  if (max_running < 1) {
+    max_running = 1;
+  }
+
+  run.base = &arglist[i];
+  while (i < count && strcmp(arglist[i], ":::") != 0) {
+    run.num_base++;
+    i++;
+  }
+  run.set_start = calloc(1, sizeof(int));
+  if (run.set_start == NULL) {
+    perror("error in parallel malloc");
+    return 1;
+  }
+  for (i++; i < count && ok; i++) {
+    ok = add_parallel_set(&run, &arglist[i], 1, &words_capacity);
+    if (!ok) {
+      perror("error in parallel malloc");
+    }
+  }
+  if (ok && file != NULL) {
+    ok = read_parallel_file(&run, file, &words_capacity);
+  }
+
+  if (ok) {
+    run_parallel(&run, max_running);
+  } else {
+    last_status = 1;
+  }
+
+  free(run.words);
+  free(run.set_start);
+  free(run.file_data);
+  return 1;
+}
+
+int prepare(void) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa)); 
+  sigemptyset(&sa.sa_mask); 
+
+  // The zygote is forked first, while the shell is as small as it will ever be
+  const char* use_zygote = getenv(ZYGOTE_ENV);
+  if (use_zygote != NULL && strcmp(use_zygote, "1") == 0) {
+    start_zygote();
+  }
+
+  // Change the signal handler to ignore SIGINT so the shell doesn't terminate on Ctrl+C
+  sa.sa_handler = SIG_IGN; 
+  if (sigaction(SIGINT, &sa, NULL) == -1) {
+      perror("error in prepare SIGINT sigaction");
+      return 1;
+  }
+
+  // SIGCHLD is blocked and only read through a signalfd, see struct event_loop
+  sigset_t sigchld;
+  sigemptyset(&sigchld);
+  sigaddset(&sigchld, SIGCHLD);
+  if (sigprocmask(SIG_BLOCK, &sigchld, NULL) == -1) {
+      perror("error in prepare sigprocmask");
+      return 1;
+  }
+  event_loop.signal_fd = signalfd(-1, &sigchld, SFD_NONBLOCK | SFD_CLOEXEC);
+  event_loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  // SIGINT stays ignored, it is only blocked and read while stream stages run
+  sigset_t sigint;
+  sigemptyset(&sigint);
+  sigaddset(&sigint, SIGINT);
+  event_loop.interrupt_fd = signalfd(-1, &sigint, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (event_loop.signal_fd == -1 || event_loop.epoll_fd == -1 || event_loop.interrupt_fd == -1) {
+      perror("error in prepare event loop creation");
+      return 1;
+  }
+
+  struct epoll_event event = { EPOLLIN, { .u64 = (uint64_t)EVENT_SIGNAL << 32 } };
+  if (epoll_ctl(event_loop.epoll_fd, EPOLL_CTL_ADD, event_loop.signal_fd, &event) == -1) {
+      perror("error in prepare epoll_ctl signalfd");
+      return 1;
+  }
+  event.data.u64 = (uint64_t)EVENT_STDIN << 32;
+  if (epoll_ctl(event_loop.epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) == 0) {
+    event_loop.stdin_pollable = 1;
+  } else if (errno != EPERM) { // EPERM: stdin is a regular file
+      perror("error in prepare epoll_ctl stdin");
+      return 1;
+  }
+
+  settings.job_output_memory = JOB_OUTPUT_DEFAULT_MEMORY;
+
+  // Default pipe size for pipelines, can be changed later with set pipesize
+  const char* pipe_size = getenv(PIPESIZE_ENV);
+  if (pipe_size != NULL && !parse_size(pipe_size, &settings.pipe_size)) {
+    fprintf(stderr, "ignoring invalid %s: %s\n", PIPESIZE_ENV, pipe_size);
+  }
+
+  // Spawn tracing from the start, can be stopped later with set trace off
+  const char* trace_path = getenv(TRACE_ENV);
+  if (trace_path != NULL && trace_path[0] != '\0') {
+    if (start_trace(trace_path, TRACE_DEFAULT_RECORDS)) {
+      settings.trace_path = strdup(trace_path);
+    } else {
+      perror("error in prepare trace file");
+    }
+  }
+
+  return 0;
+}
+
+// Simple builtins, run inside the shell without fork or exec
+
+// cd [dir] - changes to dir, $HOME without it, the previous directory with -
+int builtin_cd(int count, char** arglist) {
+  const char* dir = count > 1 ? arglist[1] : getenv("HOME");
+  char old_dir[PATH_MAX];
+  char new_dir[PATH_MAX];
+
+  if (dir != NULL && strcmp(dir, "-") == 0) {
+    dir = getenv("OLDPWD");
+  }
+  if (dir == NULL) {
+    fprintf(stderr, "cd: no directory\n");
+    last_status = 1;
+    return 1;
+  }
+  if (getcwd(old_dir, sizeof(old_dir)) == NULL) {
+    old_dir[0] = '\0';
+  }
+  if (chdir(dir) == -1) {
+    perror("cd");
+    last_status = 1;
+    return 1;
+  }
+  forget_zygote_cwd();
+  setenv("OLDPWD", old_dir, 1);
+  if (getcwd(new_dir, sizeof(new_dir)) != NULL) {
+    setenv("PWD", new_dir, 1);
+  }
+  return 1;
+}
+
+int builtin_pwd(int count, char** arglist) {
+  char dir[PATH_MAX];
+  (void)count;
+  (void)arglist;
+
+  if (getcwd(dir, sizeof(dir)) == NULL) {
+    perror("pwd");
+    last_status = 1;
+    return 1;
+  }
+  puts(dir);
+  return 1;
+}
+
+// echo [-n] words...
+int builtin_echo(int count, char** arglist) {
+  int newline = 1;
+  int i = 1;
+
+  if (count > 1 && strcmp(arglist[1], "-n") == 0) {
+    newline = 0;
+    i++;
+  }
+  for (int first = i; i < count; i++) {
+    if (i > first) {
+      putchar(' ');
+    }
+    fputs(arglist[i], stdout);
+  }
+  if (newline) {
+    putchar('\n');
+  }
+  return 1;
+}
+
+int builtin_true(int count, char** arglist) {
+  (void)count;
+  (void)arglist;
+  return 1;
+}
+
+int builtin_false(int count, char** arglist) {
+  (void)count;
+  (void)arglist;
+  last_status = 1;
+  return 1;
+}
+
+// exit [n] - leaves the shell, with exit status n
+int builtin_exit(int count, char** arglist) {
+  if (count > 1) {
+    exit_code = atoi(arglist[1]);
+  }
+  return 0;
+}
+
+typedef int (*builtin_function)(int count, char** arglist);
+
+struct builtin {
+  const char* name;
+  builtin_function function;
+};
+
+// Commands run inside the shell. They take the place of external commands of the
+// same name when they are not part of a pipeline or a background command.
+static const struct builtin builtins[] = {
+  { "batch", builtin_batch },
+  { "cd", builtin_cd },
+  { "echo", builtin_echo },
+  { "exit", builtin_exit },
+  { "false", builtin_false },
+  { "hash", builtin_hash },
+  { "jobs", builtin_jobs },
+  { "parallel", builtin_parallel },
+  { "pwd", builtin_pwd },
+  { "set", builtin_set },
+  { "true", builtin_true },
+  { "wait", builtin_wait },
+};
+
+const struct builtin* find_builtin(const char* name) {
+  for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+    if (strcmp(builtins[i].name, name) == 0) {
+      return &builtins[i];
+    }
+  }
+  return NULL;
+}
+
+// Points target_fd at file (or at the here-document of stage when file is NULL)
+// for the duration of a builtin
+// returns a copy of the original target_fd to restore afterwards, -1 on failure
+int redirect_for_builtin(const char* file, const struct stage_plan* stage, int flags, int target_fd) {
+  int fd = file != NULL ? open(file, flags | O_CLOEXEC, 0600) : open_here_document(stage);
+  if (fd == -1) {
+    if (file != NULL) {
+      fprintf(stderr, "error in open_redirections open %s: %s\n", file, strerror(errno));
+    }
+    return -1;
+  }
+  int saved_fd = fcntl(target_fd, F_DUPFD_CLOEXEC, 10);
+  if (saved_fd == -1 || dup2(fd, target_fd) == -1) {
+    perror("error in redirect_for_builtin dup");
+    close(fd);
+    if (saved_fd != -1) {
+      close(saved_fd);
+    }
+    return -1;
+  }
+  close(fd);
+  return saved_fd;
+}
+
+// Puts saved_fd (from redirect_for_builtin) back in place of target_fd
+void restore_after_builtin(int saved_fd, int target_fd) {
+  if (saved_fd != -1) {
+    dup2(saved_fd, target_fd);
+    close(saved_fd);
+  }
+}
+
+// Runs builtin with stdin / stdout / stderr swapped in-process for the files of
+// the stage's redirections, then puts the shell's own streams back.
+int run_builtin(const struct builtin* builtin, const struct stage_plan* stage) {
+  int output_flags = O_WRONLY | O_CREAT | (stage->append ? O_APPEND : O_TRUNC);
+  int has_input = stage->input != NULL || stage->here_data != NULL;
+  int saved_in = -1;
+  int saved_out = -1;
+  int saved_err = -1;
+  int result = 1;
+
+  last_status = 0;
+  if (has_input) {
+    saved_in = redirect_for_builtin(stage->input, stage, O_RDONLY, STDIN_FILENO);
+  }
+  if (stage->output != NULL && (!has_input || saved_in != -1)) {
+    saved_out = redirect_for_builtin(stage->output, stage, output_flags, STDOUT_FILENO);
+  }
+  if (stage->error_output != NULL && (!has_input || saved_in != -1) &&
+      (stage->output == NULL || saved_out != -1)) {
+    saved_err = redirect_for_builtin(stage->error_output, stage, O_WRONLY | O_CREAT | O_TRUNC, STDERR_FILENO);
+  }
+
+  if ((!has_input || saved_in != -1) && (stage->output == NULL || saved_out != -1) &&
+      (stage->error_output == NULL || saved_err != -1)) {
+    builtin_stdin_redirected = has_input;
+    result = builtin->function(stage->argc, stage->argv);
+    builtin_stdin_redirected = 0;
+  } else {
+    last_status = 1;
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+  restore_after_builtin(saved_in, STDIN_FILENO);
+  restore_after_builtin(saved_out, STDOUT_FILENO);
+  restore_after_builtin(saved_err, STDERR_FILENO);
+  return result;
+}
+
+// returns a new empty stage of plan starting at argv, NULL on allocation failure
+struct stage_plan* add_stage_plan(struct command_plan* plan, char** argv) {
+  if (plan->num_stages == plan->capacity) {
+    int capacity = plan->capacity == 0 ? 8 : plan->capacity * 2;
+    struct stage_plan* stages = realloc(plan->stages, sizeof(struct stage_plan) * capacity);
+    if (stages == NULL) {
+      return NULL;
+    }
+    plan->stages = stages;
+    plan->capacity = capacity;
+  }
+  struct stage_plan* stage = &plan->stages[plan->num_stages++];
+  memset(stage, 0, sizeof(*stage));
+  stage->argv = argv;
+  return stage;
+}
+
+// Splits the tokens of a command line into the stages of plan. The words of each
+// stage are moved together in place inside arglist, without the operators and
+// redirection file names, and NULL terminated.
+// returns 1 on success, 0 on a syntax error or allocation failure (reported)
+int plan_command(int count, char** arglist, const unsigned char* types, struct command_plan* plan) {
+  struct stage_plan* stage = NULL;
+  int write = 0;
+
+  plan->num_stages = 0;
+  plan->background = 0;
+  for (int i = 0; i <= count; i++) {
+    if (stage == NULL && (stage = add_stage_plan(plan, &arglist[write])) == NULL) {
+      perror("error in plan_command realloc");
+      return 0;
+    }
+
+    // The end of the line ends the last stage like a pipe
+    enum token_type type = i < count ? types[i] : TOKEN_PIPE;
+    switch (type) {
+      case TOKEN_WORD:
+      case TOKEN_STATUS: // only before process_tokens expands it
+        arglist[write++] = arglist[i];
+        stage->argc++;
+        break;
+
+      case TOKEN_INPUT:
+      case TOKEN_OUTPUT:
+      case TOKEN_APPEND:
+      case TOKEN_ERROR_OUTPUT:
+        if (i + 1 >= count || types[i + 1] != TOKEN_WORD) {
+          fprintf(stderr, "syntax error: missing file name after %s\n", arglist[i]);
+          return 0;
+        }
+        if (type == TOKEN_INPUT) {
+          stage->input = arglist[i + 1];
+          stage->here_data = NULL;
+        } else if (type == TOKEN_ERROR_OUTPUT) {
+          stage->error_output = arglist[i + 1];
+        } else {
+          stage->output = arglist[i + 1];
+          stage->append = type == TOKEN_APPEND;
+        }
+        i++;
+        break;
+
+      case TOKEN_HEREDOC:
+      case TOKEN_HERESTRING:
+        // The reader already put the body of a here-document in place of its delimiter
+        if (i + 1 >= count || types[i + 1] != TOKEN_WORD) {
+          fprintf(stderr, "syntax error: missing %s after %s\n",
+                  type == TOKEN_HEREDOC ? "here-document delimiter" : "word", arglist[i]);
+          return 0;
+        }
+        stage->here_data = arglist[i + 1];
+        stage->here_string = type == TOKEN_HERESTRING;
+        stage->input = NULL;
+        i++;
+        break;
+
+      case TOKEN_BACKGROUND:
+        if (i != count - 1) {
+          fprintf(stderr, "syntax error: & must end the command\n");
+          return 0;
+        }
+        plan->background = 1;
+        break;
+
+      case TOKEN_PIPE:
+        if (stage->argc == 0) {
+          fprintf(stderr, "syntax error: missing command%s\n",
+                  i < count ? " before |" : plan->num_stages > 1 ? " after |" : "");
+          return 0;
+        }
+        arglist[write++] = NULL;
+        stage = NULL;
+        break;
+    }
+  }
+  return 1;
+}
+
+int dispatch_arglist(int count, char** arglist, const unsigned char* types) {
+  static struct command_plan plan; // reused by every command
+  size_t pipe_size = settings.pipe_size;
+
+  // A leading pipesize=<bytes> word overrides the pipe size for this pipeline only
+  if (strncmp(arglist[0], PIPESIZE_PREFIX, strlen(PIPESIZE_PREFIX)) == 0 && count > 1) {
+    if (!parse_size(arglist[0] + strlen(PIPESIZE_PREFIX), &pipe_size)) {
+      fprintf(stderr, "invalid pipe size: %s\n", arglist[0]);
+      return 1;
+    }
+    arglist++;
+    types++;
+    count--;
+  }
+
+  // Split the line into stages, each with its own redirections
+  if (!plan_command(count, arglist, types, &plan)) {
+    last_status = 2;
+    return 1;
+  }
+  trace_event(TRACE_PARSED, 0, plan.num_stages);
+
+  // Builtins skip fork and exec entirely
+  const struct builtin* builtin = find_builtin(plan.stages[0].argv[0]);
+  if (builtin != NULL && !plan.background && plan.num_stages == 1) {
+    return run_builtin(builtin, &plan.stages[0]);
+  }
+
+  if (plan.background || plan.num_stages > 1) {
+    return setup_and_execute_pipeline(plan.stages, plan.num_stages, pipe_size, plan.background);
+  }
+  return execute_standard_command(&plan.stages[0]);
+}
+
+// Runs a foreground command while collecting what its processes use, then prints
+// the totals, and with full_report one line per pipeline stage
+int execute_timed(int count, char** arglist, const unsigned char* types, int full_report) {
+  struct timespec start_time;
+  struct rusage self_before;
+
+  timing.active = 1;
+  timing.num_stages = 0;
+  getrusage(RUSAGE_SELF, &self_before);
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+  int result = dispatch_arglist(count, arglist, types);
+  timing.active = 0;
+
+  print_timing_report(&start_time, &self_before, full_report);
+  return result;
+}
+
+// Runs a command under the profile prefix. A foreground pipeline is relayed
+// through the shell (see relay_profiled_pipeline) and gets a profile report,
+// anything else the report of the time prefix.
+int execute_profiled(int count, char** arglist, const unsigned char* types) {
+  struct timespec start_time;
+  struct rusage self_before;
+
+  timing.active = 1;
+  timing.num_stages = 0;
+  profile.active = 1;
+  profile.num_stages = 0;
+  getrusage(RUSAGE_SELF, &self_before);
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+  int result = dispatch_arglist(count, arglist, types);
+  timing.active = 0;
+  profile.active = 0;
+
+  if (profile.num_stages > 0 && profile.links != NULL && profile.limiting_ns != NULL) {
+    print_profile_report();
+  } else {
+    print_timing_report(&start_time, &self_before, 1);
+  }
+  free(profile.links);
+  free(profile.limiting_ns);
+  profile.links = NULL;
+  profile.limiting_ns = NULL;
+  profile.num_stages = 0;
+  return result;
+}
+
+// sched [-p policy] [-c cpus] [-n nice] [-i class[:level]] command...
+// Runs command with its processes placed with policy (see set placement) or
+// pinned to cpus, with the given nice value and I/O priority (see set jobionice),
+// whether it runs in the foreground or the background. Sets sched_prefix.
+// returns the number of words before command, 0 if the options are wrong (reported)
+int parse_sched_prefix(int count, char** arglist, const unsigned char* types) {
+  int i = 1;
+  int ok = 1;
+
+  sched_prefix.active = 1;
+  for (; ok && i + 2 < count && types[i] == TOKEN_WORD && arglist[i][0] == '-'; i += 2) {
+    const char* value = arglist[i + 1];
+    ok = types[i + 1] == TOKEN_WORD && arglist[i][1] != '\0' && arglist[i][2] == '\0';
+    if (ok && arglist[i][1] == 'p') {
+      int policy = parse_placement_policy(value);
+      ok = policy != -1;
+      sched_prefix.has_policy = 1;
+      sched_prefix.policy = policy;
+    } else if (ok && arglist[i][1] == 'c') {
+      ok = parse_cpu_list(value, &sched_prefix.cpus);
+      sched_prefix.has_cpus = 1;
+    } else if (ok && arglist[i][1] == 'n') {
+      char* end;
+      sched_prefix.nice = strtol(value, &end, 10);
+      sched_prefix.has_nice = 1;
+      ok = *end == '\0' && end != value && sched_prefix.nice >= -20 && sched_prefix.nice <= 19;
+    } else if (ok && arglist[i][1] == 'i') {
+      ok = parse_ioprio(value, &sched_prefix.ioprio);
+    } else {
+      ok = 0;
+    }
+  }
+  // Options are not a command, nor is what is left of one without its value
+  if (!ok || i >= count || types[i] != TOKEN_WORD || arglist[i][0] == '-') {
+    fprintf(stderr, "usage: sched [-p off|roundrobin|leastloaded|numa] [-c cpus] [-n nice] "
+                    "[-i idle|be[:level]|rt[:level]] command...\n");
+    last_status = 2;
+    return 0;
+  }
+  return i;
+}
+
+// limit [-v bytes] [-t seconds] [-n files] [-u processes] command...
+// Runs command with its processes limited in address space, CPU time, open
+// files and processes of the user (the ulimit options), on top of the set
+// joblimit defaults when it runs in the background. unlimited lifts a default.
+// Sets limit_prefix.
+// returns the number of words before command, 0 if the options are wrong (reported)
+int parse_limit_prefix(int count, char** arglist, const unsigned char* types) {
+  int i = 1;
+  int resource = 0;
+
+  for (; resource != -1 && i + 2 < count && types[i] == TOKEN_WORD && arglist[i][0] == '-'; i += 2) {
+    rlim_t value;
+    resource = types[i + 1] == TOKEN_WORD ? parse_limit_option(arglist[i], arglist[i + 1], &value) : -1;
+    if (resource != -1) {
+      limit_prefix.set |= 1u << resource;
+      limit_prefix.values[resource] = value;
+    }
+  }
+  // Options are not a command, nor is what is left of one without its value
+  if (resource == -1 || i >= count || types[i] != TOKEN_WORD || arglist[i][0] == '-') {
+    fprintf(stderr, "usage: limit [-v bytes] [-t seconds] [-n files] [-u processes] command... "
+                    "(or unlimited)\n");
+    last_status = 2;
+    return 0;
+  }
+  return i;
+}
+
+int execute_arglist(int count, char** arglist, const unsigned char* types) {
+  // A leading sched word places the processes of the command and sets their priorities
+  if (strcmp(arglist[0], SCHED_PREFIX) == 0 && count > 1) {
+    struct sched_prefix saved = sched_prefix;
+    int used = parse_sched_prefix(count, arglist, types);
+    int result = used > 0 ? execute_arglist(count - used, arglist + used, types + used) : 1;
+    sched_prefix = saved;
+    return result;
+  }
+  // A leading limit word sets resource limits in the processes of the command
+  if (strcmp(arglist[0], LIMIT_PREFIX) == 0 && count > 1) {
+    struct resource_limits saved = limit_prefix;
+    int used = parse_limit_prefix(count, arglist, types);
+    int result = used > 0 ? execute_arglist(count - used, arglist + used, types + used) : 1;
+    limit_prefix = saved;
+    return result;
+  }
+  // A leading time word reports what the command used, down to each pipeline stage
+  if (strcmp(arglist[0], TIME_PREFIX) == 0 && count > 1) {
+    return execute_timed(count - 1, arglist + 1, types + 1, 1);
+  }
+  // A leading profile word relays a pipeline through the shell and reports where it is slow
+  if (strcmp(arglist[0], PROFILE_PREFIX) == 0 && count > 1) {
+    return execute_profiled(count - 1, arglist + 1, types + 1);
+  }
+
+  if (settings.timing) {
+    for (int i = 0; i < count; i++) {
+      if (types[i] == TOKEN_BACKGROUND) {
+        return dispatch_arglist(count, arglist, types);
+      }
+    }
+    return execute_timed(count, arglist, types, 0);
+  }
+  return dispatch_arglist(count, arglist, types);
+}
+
+int process_tokens(int count, char** arglist, unsigned char* types) {
+  static char last_status_word[16];
+
+  trace_command++;
+  trace_event(TRACE_COMMAND, 0, count);
+  command_hash.epoch++; // PATH directories may have changed since the last line
+
+  // Jobs that finished since the last command, in case input came without a wait
+  // (e.g. it was already buffered)
+  if (job_table.num_running > 0) {
+    collect_finished_jobs();
+  }
+
+  // $? expands to the exit status of the last foreground command, '$?' stays as is
+  snprintf(last_status_word, sizeof(last_status_word), "%d", last_status);
+  for (int i = 0; i < count; i++) {
+    if (types[i] == TOKEN_STATUS) {
+      arglist[i] = last_status_word;
+      types[i] = TOKEN_WORD;
+    }
+  }
+
+  int result = execute_arglist(count, arglist, types);
+  trace_event(TRACE_DONE, 0, last_status);
+  return result;
+}
+
+int process_arglist(int count, char** arglist) {
+  unsigned char* types = malloc(count + 1);
+  if (types == NULL) {
+    perror("error in process_arglist malloc");
+    return 0;
+  }
+  for (int i = 0; i < count; i++) {
+    types[i] = classify_word(arglist[i]);
+  }
+  int result = process_tokens(count, arglist, types);
+  free(types);
+  return result;
+}
+
+int finalize(void) {
+  stop_job_output();
+  stop_zygote();
+  if (exit_code != 0) {
+    exit(exit_code);
+  }
   return 0;
 }
 
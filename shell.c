@@ -3,62 +3,376 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lexer.h"
+
+#define ARENA_INITIAL_LINE_SIZE 4096
 
 // arglist - a list of char* arguments (words) provided by the user
 // it contains count+1 items, where the last item (arglist[count]) and *only* the last is NULL
 // RETURNS - 1 if should continue, 0 otherwise
 int process_arglist(int count, char** arglist);
 
+// same as process_arglist, for an arglist already tagged by the lexer (types[i] is
+// the enum token_type of arglist[i]) so that nothing has to look at the words again.
+// The word after a TOKEN_HEREDOC is the body of the here-document, not its delimiter.
+// TOKEN_STATUS tokens are replaced by words in both arrays.
+int process_tokens(int count, char** arglist, unsigned char* types);
+
 // prepare and finalize calls for initialization and destruction of anything required
 int prepare(void);
 int finalize(void);
 
-int main(void)
+// called before blocking on fd for more input, lets the shell handle other events meanwhile
+void wait_for_input(int fd);
+
+// Buffers reused by every command of the session: the bytes read from stdin and
+// the tokens of the current line. They only ever grow, so once they are big
+// enough for the longest line seen, reading and splitting a command does not
+// allocate. Lines are split in place, the tokens point into buf.
+struct session_arena {
+	char* buf;
+	size_t buf_size;
+	size_t start; // first byte of buf not returned as a line yet
+	size_t end; // one past the last byte read into buf
+	size_t scanned; // bytes after start already known to contain no newline
+	int eof;
+	struct token_list tokens;
+	// Words of a line with here-documents and the bodies read for them
+	char* heredoc;
+	size_t heredoc_size;
+	size_t* offsets;
+	size_t offsets_size;
+};
+
+// Where the lines of the session come from: stdin through the arena, or a
+// script mapped in memory. Here-document bodies are read from the same place
+// as the command that uses them.
+struct line_source {
+	struct session_arena* arena;
+	const char* next; // next line of the script, NULL when reading stdin
+	const char* end;
+};
+
+void* arena_alloc(void* ptr, size_t size)
 {
-	if (prepare() != 0)
+	ptr = realloc(ptr, size);
+	if (ptr == NULL) {
+		printf("realloc failed: %s\n", strerror(errno));
 		exit(1);
-	
-	while (1)
-	{
-		char** arglist = NULL;
-		char* line = NULL;
-		size_t size;
-		int count = 0;
+	}
+	return ptr;
+}
 
-		if (getline(&line, &size, stdin) == -1) {
-			free(line);
-			break;
+void arena_init(struct session_arena* arena)
+{
+	memset(arena, 0, sizeof(*arena));
+	arena->buf_size = ARENA_INITIAL_LINE_SIZE;
+	arena->buf = arena_alloc(NULL, arena->buf_size);
+}
+
+void arena_destroy(struct session_arena* arena)
+{
+	free(arena->buf);
+	free(arena->tokens.argv);
+	free(arena->tokens.types);
+	free(arena->heredoc);
+	free(arena->offsets);
+}
+
+// Returns the next line of stdin with its newline replaced by '\0', or NULL at end of input.
+// The line stays valid until the next call. length receives its length.
+char* arena_read_line(struct session_arena* arena, size_t* length)
+{
+	while (1) {
+		char* newline = memchr(arena->buf + arena->start + arena->scanned, '\n',
+				       arena->end - arena->start - arena->scanned);
+		if (newline != NULL) {
+			char* line = arena->buf + arena->start;
+			*newline = '\0';
+			*length = newline - line;
+			arena->start = newline + 1 - arena->buf;
+			arena->scanned = 0;
+			return line;
 		}
-    
-		arglist = (char**) malloc(sizeof(char*));
-		if (arglist == NULL) {
-			printf("malloc failed: %s\n", strerror(errno));
-			exit(1);
+		arena->scanned = arena->end - arena->start;
+
+		if (arena->eof) {
+			// A last line without a newline, there is always room for its '\0'
+			if (arena->start == arena->end)
+				return NULL;
+			char* line = arena->buf + arena->start;
+			arena->buf[arena->end] = '\0';
+			*length = arena->end - arena->start;
+			arena->start = arena->end;
+			arena->scanned = 0;
+			return line;
 		}
-		arglist[0] = strtok(line, " \t\n");
-    
-		while (arglist[count] != NULL) {
-			++count;
-			arglist = (char**) realloc(arglist, sizeof(char*) * (count + 1));
-			if (arglist == NULL) {
-				printf("realloc failed: %s\n", strerror(errno));
-				exit(1);
-			}
-      
-			arglist[count] = strtok(NULL, " \t\n");
+
+		// Move the partial line to the front and make room for more input
+		memmove(arena->buf, arena->buf + arena->start, arena->end - arena->start);
+		arena->end -= arena->start;
+		arena->start = 0;
+		if (arena->end + 1 >= arena->buf_size) {
+			arena->buf_size *= 2;
+			arena->buf = arena_alloc(arena->buf, arena->buf_size);
+		}
+
+		wait_for_input(STDIN_FILENO);
+		ssize_t bytes = read(STDIN_FILENO, arena->buf + arena->end, arena->buf_size - arena->end - 1);
+		if (bytes > 0) {
+			arena->end += bytes;
+		} else if (bytes == 0) {
+			arena->eof = 1;
+		} else if (errno != EINTR) {
+			printf("read failed: %s\n", strerror(errno));
+			arena->eof = 1;
 		}
-    
-		if (count != 0) {
-			if (!process_arglist(count, arglist)) {
-				free(line);
-				free(arglist);
-				break;
-			}
+	}
+}
+
+// Returns the next line of source with its newline replaced by '\0', or NULL at the end.
+// A script line is copied out of the read-only mapping into the arena's line
+// buffer, which stdin does not use in that mode. Either way the line stays valid
+// until the next call.
+char* next_line(struct line_source* source, size_t* length)
+{
+	if (source->next == NULL)
+		return arena_read_line(source->arena, length);
+	if (source->next >= source->end)
+		return NULL;
+
+	struct session_arena* arena = source->arena;
+	const char* line = source->next;
+	const char* newline = memchr(line, '\n', source->end - line);
+	*length = (newline != NULL ? newline : source->end) - line;
+	source->next = newline != NULL ? newline + 1 : source->end;
+	if (*length + 1 > arena->buf_size) {
+		arena->buf_size = *length + 1;
+		arena->buf = arena_alloc(arena->buf, arena->buf_size);
+	}
+	memcpy(arena->buf, line, *length);
+	arena->buf[*length] = '\0';
+	return arena->buf;
+}
+
+// Appends length bytes and a '\0' to arena->heredoc, returns their offset
+size_t heredoc_append(struct session_arena* arena, size_t* used, const char* data, size_t length)
+{
+	size_t offset = *used;
+	if (offset + length + 1 > arena->heredoc_size) {
+		arena->heredoc_size = (offset + length + 1) * 2;
+		arena->heredoc = arena_alloc(arena->heredoc, arena->heredoc_size);
+	}
+	memcpy(arena->heredoc + offset, data, length);
+	arena->heredoc[offset + length] = '\0';
+	*used = offset + length + 1;
+	return offset;
+}
+
+// Reads the body of every here-document of the line just split into
+// arena->tokens: the lines after it up to one equal to the delimiter, which
+// the body then replaces. Reading more lines may move the line the tokens
+// point into, so its words are copied next to the bodies first.
+// returns NULL, or a syntax error
+const char* read_heredocs(struct line_source* source, int count)
+{
+	struct session_arena* arena = source->arena;
+	char** argv = arena->tokens.argv;
+	const unsigned char* types = arena->tokens.types;
+	size_t used = 0;
+
+	for (int i = 0; i < count; i++)
+		if (types[i] == TOKEN_HEREDOC && (i + 1 == count || types[i + 1] != TOKEN_WORD))
+			return "missing here-document delimiter";
+
+	if (arena->offsets_size < (size_t) count) {
+		arena->offsets_size = count;
+		arena->offsets = arena_alloc(arena->offsets, sizeof(size_t) * count);
+	}
+	for (int i = 0; i < count; i++)
+		if (types[i] == TOKEN_WORD)
+			arena->offsets[i] = heredoc_append(arena, &used, argv[i], strlen(argv[i]));
+
+	for (int i = 0; i < count; i++) {
+		if (types[i] != TOKEN_HEREDOC)
+			continue;
+		size_t delimiter = arena->offsets[i + 1];
+		size_t body = used;
+		size_t length;
+		char* line;
+		while ((line = next_line(source, &length)) != NULL &&
+		       strcmp(line, arena->heredoc + delimiter) != 0) {
+			heredoc_append(arena, &used, line, length);
+			arena->heredoc[used - 1] = '\n';
 		}
-    
-		free(line);
-		free(arglist);
+		if (line == NULL)
+			fprintf(stderr, "warning: here-document delimited by end of input (wanted `%s')\n",
+				arena->heredoc + delimiter);
+		heredoc_append(arena, &used, "", 0);
+		arena->offsets[i + 1] = body;
+	}
+
+	for (int i = 0; i < count; i++)
+		if (types[i] == TOKEN_WORD)
+			argv[i] = arena->heredoc + arena->offsets[i];
+	return NULL;
+}
+
+// Splits line into arena->tokens and runs it, count receives the number of tokens
+// returns 0 if the shell should stop
+int run_line(struct line_source* source, char* line, size_t length, int* count)
+{
+	struct session_arena* arena = source->arena;
+	const char* error;
+	*count = lex_line(line, length, &arena->tokens, &error);
+
+	if (*count == -1) {
+		printf("syntax error: %s\n", error);
+		return 1;
+	}
+	if (*count == 0)
+		return 1;
+	if (memchr(arena->tokens.types, TOKEN_HEREDOC, *count) != NULL &&
+	    (error = read_heredocs(source, *count)) != NULL) {
+		printf("syntax error: %s\n", error);
+		return 1;
 	}
+	return process_tokens(*count, arena->tokens.argv, arena->tokens.types);
+}
+
+// Reads commands interactively (or from a pipe) on stdin until EOF or exit
+void run_interactive(struct session_arena* arena)
+{
+	struct line_source source = { arena, NULL, NULL };
+
+	while (1)
+	{
+		size_t length;
+		int count;
+		char* line = next_line(&source, &length);
+		if (line == NULL)
+			break;
+
+		if (!run_line(&source, line, length, &count))
+			break;
+	}
+}
+
+int compare_latencies(const void* a, const void* b)
+{
+	double x = *(const double*) a;
+	double y = *(const double*) b;
+	return (x > y) - (x < y);
+}
+
+// Prints commands/sec and latency percentiles of a batch run to stderr
+void report_batch_stats(double* latencies, size_t count, double seconds)
+{
+	if (count == 0) {
+		fprintf(stderr, "batch: no commands\n");
+		return;
+	}
+	qsort(latencies, count, sizeof(double), compare_latencies);
+	fprintf(stderr, "batch: %zu commands in %.3f s (%.0f commands/s)\n", count, seconds, count / seconds);
+	fprintf(stderr, "batch: latency us p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+		latencies[count / 2] * 1e6, latencies[count * 90 / 100] * 1e6, latencies[count * 99 / 100] * 1e6,
+		latencies[count * 999 / 1000] * 1e6, latencies[count - 1] * 1e6);
+}
+
+double seconds_since(const struct timespec* start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Runs the commands of a script file. The file is mapped read-only, so that it
+// is read without a system call per block, and each line is copied into the
+// reused line buffer to be split there. Nothing is allocated per command.
+// returns 0 if the script could not be read
+int run_batch(struct session_arena* arena, const char* path)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		printf("cannot open %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		report_batch_stats(NULL, 0, 0);
+		return 1;
+	}
+
+	size_t size = st.st_size;
+	char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		printf("mmap failed: %s\n", strerror(errno));
+		return 0;
+	}
+	madvise(data, size, MADV_SEQUENTIAL);
+
+	// One latency slot per line
+	size_t max_commands = 1;
+	for (const char* c = data; (c = memchr(c, '\n', data + size - c)) != NULL; c++)
+		max_commands++;
+	double* latencies = arena_alloc(NULL, sizeof(double) * max_commands);
+	size_t num_commands = 0;
+
+	struct timespec batch_start;
+	clock_gettime(CLOCK_MONOTONIC, &batch_start);
+
+	struct line_source source = { arena, data, data + size };
+	char* line;
+	size_t length;
+	while ((line = next_line(&source, &length)) != NULL) {
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		int count;
+		int keep_going = run_line(&source, line, length, &count);
+		if (count > 0)
+			latencies[num_commands++] = seconds_since(&start);
+		if (!keep_going)
+			break;
+	}
+
+	report_batch_stats(latencies, num_commands, seconds_since(&batch_start));
+	free(latencies);
+	munmap(data, size);
+	return 1;
+}
+
+int main(int argc, char** argv)
+{
+	struct session_arena arena;
+	const char* script = NULL;
+
+	if (argc == 3 && strcmp(argv[1], "-f") == 0) {
+		script = argv[2];
+	} else if (argc != 1) {
+		printf("usage: %s [-f script]\n", argv[0]);
+		exit(1);
+	}
+
+	if (prepare() != 0)
+		exit(1);
+
+	arena_init(&arena);
+
+	if (script != NULL) {
+		if (!run_batch(&arena, script))
+			exit(1);
+	} else {
+		run_interactive(&arena);
+	}
+
+	arena_destroy(&arena);
 	
 	if (finalize() != 0)
 		exit(1);
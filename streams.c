@@ -0,0 +1,1177 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "streams.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// A ring is written by one thread and read by another. head and tail count the
+// bytes ever written and read; the producer fills the bytes after head and then
+// publishes them by storing head, the consumer hands space back by storing
+// tail. Neither side makes a system call while the other keeps up: a side that
+// has to wait says so in a sleeping flag and then waits on a futex word, which
+// the other side bumps and wakes only when it sees the flag.
+
+#define STREAM_RING_SIZE (1024 * 1024) // must be a power of two
+#define STREAM_PUBLISH_SIZE (32 * 1024) // bytes written into a ring before they are made visible
+#define STREAM_BUFFER_SIZE (128 * 1024) // reads from and writes to descriptors
+#define TAIL_TRIM_SIZE (4 * 1024 * 1024) // bytes tail keeps beyond what it needs before trimming
+#define WC_DEFAULT_WIDTH 7
+
+struct stream_ring {
+  char* data;
+  size_t mask;
+  uint64_t head;
+  uint64_t tail;
+  uint32_t head_moves; // futex words
+  uint32_t tail_moves;
+  int consumer_sleeping;
+  int producer_sleeping;
+  int producer_done;
+  int consumer_done;
+  int refs; // ends not given up yet, the last one frees the ring
+};
+
+enum stream_command {
+  STREAM_CAT,
+  STREAM_HEAD,
+  STREAM_TAIL,
+  STREAM_GREP,
+  STREAM_WC,
+  STREAM_TEE,
+};
+
+struct stream_options {
+  enum stream_command command;
+  unsigned long long count; // head, tail
+  int bytes;                // head -c, tail -c
+  const char* pattern;      // grep
+  int invert;               // grep -v
+  int count_only;           // grep -c
+  int lines, words, chars;  // wc
+  int append;               // tee -a
+  char** files;
+  int num_files;
+};
+
+// Ctrl+C for a stage, see cancel_stream_stage. The stage checks requested before
+// every block of input, and waits for a descriptor that can block together with
+// fd, so that it is not stuck in a read.
+struct stream_cancel {
+  int requested;
+  int fd; // eventfd, readable once requested
+};
+
+struct stream_input {
+  int fd;
+  struct stream_ring* ring;
+  const struct stream_cancel* cancel;
+  int pollable;  // descriptor: a pipe, socket or device, read only once poll says so
+  char* buf;     // read buffer of a descriptor, or a line that wraps around the ring
+  size_t start;  // descriptor: first byte of buf not returned yet
+  size_t end;    // bytes in buf
+  size_t size;
+  size_t pending; // bytes returned by the last input_next, given back at the next call
+  uint64_t tail;  // ring: bytes read so far
+  int carried;    // ring: the last block returned was buf
+  int eof;
+};
+
+struct stream_output {
+  int fd;
+  struct stream_ring* ring;
+  char* buf;     // descriptor: bytes not written yet
+  size_t length;
+  uint64_t head; // ring: bytes written so far
+  uint64_t published;
+  int error;     // errno of the write that failed, EPIPE once the reader went away
+  const struct stream_cancel* cancel; // NULL for the files of tee
+};
+
+struct stream_stage {
+  pthread_t thread;
+  struct stream_options options;
+  struct stream_input in;
+  struct stream_output out;
+  int err_fd;
+  int status;
+  struct rusage usage;
+  struct stream_cancel cancel;
+  int done_fd; // eventfd, readable once the stage has finished
+};
+
+static void futex_wait(uint32_t* word, uint32_t value) {
+  syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t* word) {
+  syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void wake(uint32_t* word) {
+  __atomic_fetch_add(word, 1, __ATOMIC_SEQ_CST);
+  futex_wake(word);
+}
+
+struct stream_ring* stream_ring_new(void) {
+  struct stream_ring* ring = calloc(1, sizeof(struct stream_ring));
+  if (ring == NULL) {
+    return NULL;
+  }
+  ring->data = malloc(STREAM_RING_SIZE);
+  if (ring->data == NULL) {
+    free(ring);
+    return NULL;
+  }
+  ring->mask = STREAM_RING_SIZE - 1;
+  ring->refs = 2;
+  return ring;
+}
+
+static void ring_release(struct stream_ring* ring) {
+  if (__atomic_sub_fetch(&ring->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(ring->data);
+    free(ring);
+  }
+}
+
+void stream_ring_close_write(struct stream_ring* ring) {
+  __atomic_store_n(&ring->producer_done, 1, __ATOMIC_SEQ_CST);
+  wake(&ring->head_moves);
+  ring_release(ring);
+}
+
+void stream_ring_close_read(struct stream_ring* ring) {
+  __atomic_store_n(&ring->consumer_done, 1, __ATOMIC_SEQ_CST);
+  wake(&ring->tail_moves);
+  ring_release(ring);
+}
+
+static void ring_publish(struct stream_ring* ring, uint64_t head) {
+  __atomic_store_n(&ring->head, head, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->consumer_sleeping, __ATOMIC_SEQ_CST)) {
+    wake(&ring->head_moves);
+  }
+}
+
+static void ring_consume(struct stream_ring* ring, uint64_t tail) {
+  __atomic_store_n(&ring->tail, tail, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->producer_sleeping, __ATOMIC_SEQ_CST)) {
+    wake(&ring->tail_moves);
+  }
+}
+
+// returns the bytes after tail that can be read, 0 once the producer is done
+// and all of them were read
+static size_t ring_wait_data(struct stream_ring* ring, uint64_t tail) {
+  while (1) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head != tail) {
+      return head - tail;
+    }
+    if (__atomic_load_n(&ring->producer_done, __ATOMIC_ACQUIRE)) {
+      return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+    }
+    uint32_t moves = __atomic_load_n(&ring->head_moves, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&ring->consumer_sleeping, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == tail &&
+        !__atomic_load_n(&ring->producer_done, __ATOMIC_SEQ_CST)) {
+      futex_wait(&ring->head_moves, moves);
+    }
+    __atomic_store_n(&ring->consumer_sleeping, 0, __ATOMIC_RELAXED);
+  }
+}
+
+// returns the free bytes after head, 0 once the consumer is gone
+static size_t ring_wait_space(struct stream_ring* ring, uint64_t head) {
+  size_t size = ring->mask + 1;
+  while (1) {
+    if (__atomic_load_n(&ring->consumer_done, __ATOMIC_ACQUIRE)) {
+      return 0;
+    }
+    size_t used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (used < size) {
+      return size - used;
+    }
+    uint32_t moves = __atomic_load_n(&ring->tail_moves, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&ring->producer_sleeping, 1, __ATOMIC_SEQ_CST);
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == size &&
+        !__atomic_load_n(&ring->consumer_done, __ATOMIC_SEQ_CST)) {
+      futex_wait(&ring->tail_moves, moves);
+    }
+    __atomic_store_n(&ring->producer_sleeping, 0, __ATOMIC_RELAXED);
+  }
+}
+
+static void input_init(struct stream_input* in, struct stream_end end, const struct stream_cancel* cancel) {
+  struct stat info;
+  memset(in, 0, sizeof(*in));
+  in->fd = end.fd;
+  in->ring = end.ring;
+  in->cancel = cancel;
+  in->pollable = end.fd != -1 && fstat(end.fd, &info) == 0 && !S_ISREG(info.st_mode) && !S_ISBLK(info.st_mode);
+}
+
+// returns 1 once the stage reading in was cancelled, with errno set to ECANCELED
+static int input_cancelled(const struct stream_input* in) {
+  if (__atomic_load_n(&in->cancel->requested, __ATOMIC_ACQUIRE)) {
+    errno = ECANCELED;
+    return 1;
+  }
+  return 0;
+}
+
+// Waits until the descriptor of in can be read without blocking
+// returns 0 if the stage was cancelled meanwhile (errno ECANCELED)
+static int input_wait_readable(const struct stream_input* in) {
+  struct pollfd fds[2] = { { in->fd, POLLIN, 0 }, { in->cancel->fd, POLLIN, 0 } };
+  while (poll(fds, 2, -1) == -1) {
+    if (errno != EINTR) {
+      return 1; // Let the read report it
+    }
+  }
+  return !input_cancelled(in);
+}
+
+static void input_close(struct stream_input* in) {
+  if (in->ring != NULL) {
+    stream_ring_close_read(in->ring);
+    in->ring = NULL;
+  } else if (in->fd != -1) {
+    close(in->fd);
+    in->fd = -1;
+  }
+  free(in->buf);
+  in->buf = NULL;
+}
+
+// returns 0 if buf cannot hold extra more bytes
+static int input_reserve(struct stream_input* in, size_t extra) {
+  if (in->end + extra <= in->size) {
+    return 1;
+  }
+  size_t size = in->size == 0 ? STREAM_BUFFER_SIZE : in->size;
+  while (size < in->end + extra) {
+    size *= 2;
+  }
+  char* buf = realloc(in->buf, size);
+  if (buf == NULL) {
+    return 0;
+  }
+  in->buf = buf;
+  in->size = size;
+  return 1;
+}
+
+static ssize_t fd_input_next(struct stream_input* in, const char** data, int lines) {
+  in->start += in->pending;
+  in->pending = 0;
+  while (1) {
+    size_t available = in->end - in->start;
+    if (available > 0) {
+      size_t length = available;
+      if (lines && !in->eof) {
+        const char* newline = memrchr(in->buf + in->start, '\n', available);
+        length = newline != NULL ? (size_t)(newline + 1 - (in->buf + in->start)) : 0;
+      }
+      if (length > 0) {
+        *data = in->buf + in->start;
+        in->pending = length;
+        return length;
+      }
+    } else if (in->eof) {
+      return 0;
+    }
+
+    // Keep the partial line at the start of buf and read after it
+    if (in->start > 0) {
+      memmove(in->buf, in->buf + in->start, available);
+      in->start = 0;
+      in->end = available;
+    }
+    if (in->end == in->size && !input_reserve(in, in->size == 0 ? STREAM_BUFFER_SIZE : in->size)) {
+      return -1;
+    }
+    if (input_cancelled(in) || (in->pollable && !input_wait_readable(in))) {
+      return -1;
+    }
+    ssize_t bytes = read(in->fd, in->buf + in->end, in->size - in->end);
+    if (bytes > 0) {
+      in->end += bytes;
+    } else if (bytes == 0) {
+      in->eof = 1;
+    } else if (errno != EINTR) {
+      return -1;
+    }
+  }
+}
+
+static ssize_t ring_input_next(struct stream_input* in, const char** data, int lines) {
+  struct stream_ring* ring = in->ring;
+  size_t size = ring->mask + 1;
+  if (in->pending > 0) {
+    in->tail += in->pending;
+    in->pending = 0;
+    ring_consume(ring, in->tail);
+  }
+  if (in->carried) {
+    in->end = 0;
+    in->carried = 0;
+  }
+
+  // A stage waiting on the ring is woken when its cancelled neighbour closes it
+  while (1) {
+    if (input_cancelled(in)) {
+      return -1;
+    }
+    size_t available = ring_wait_data(ring, in->tail);
+    if (available == 0) {
+      if (in->end > 0) {
+        *data = in->buf;
+        in->carried = 1;
+        return in->end;
+      }
+      return 0;
+    }
+    size_t offset = in->tail & ring->mask;
+    size_t length = available < size - offset ? available : size - offset;
+    const char* chunk = ring->data + offset;
+
+    // Hand out the bytes in place when they are whole lines, gather the
+    // pieces of a line that wraps around the ring or is still being written
+    if (in->end == 0) {
+      const char* newline = lines ? memrchr(chunk, '\n', length) : chunk + length - 1;
+      if (newline != NULL) {
+        *data = chunk;
+        in->pending = newline + 1 - chunk;
+        return in->pending;
+      }
+    } else {
+      const char* newline = memchr(chunk, '\n', length);
+      if (newline != NULL) {
+        length = newline + 1 - chunk;
+      }
+      if (newline != NULL || !lines) {
+        if (!input_reserve(in, length)) {
+          return -1;
+        }
+        memcpy(in->buf + in->end, chunk, length);
+        in->end += length;
+        in->tail += length;
+        ring_consume(ring, in->tail);
+        *data = in->buf;
+        in->carried = 1;
+        return in->end;
+      }
+    }
+    if (!input_reserve(in, length)) {
+      return -1;
+    }
+    memcpy(in->buf + in->end, chunk, length);
+    in->end += length;
+    in->tail += length;
+    ring_consume(ring, in->tail);
+  }
+}
+
+// Gives the next block of input. With lines set, the block ends with a newline
+// unless it is the last one. The block stays valid until the next call.
+// returns its length, 0 at end of input, -1 with errno set on error
+static ssize_t input_next(struct stream_input* in, const char** data, int lines) {
+  if (in->ring != NULL) {
+    return ring_input_next(in, data, lines);
+  }
+  return fd_input_next(in, data, lines);
+}
+
+static void output_init(struct stream_output* out, struct stream_end end, const struct stream_cancel* cancel) {
+  memset(out, 0, sizeof(*out));
+  out->fd = end.fd;
+  out->ring = end.ring;
+  out->cancel = cancel;
+}
+
+// returns 0 if out cannot be written anymore: it failed, or its stage was
+// cancelled and nothing more may come out of it
+static int output_usable(struct stream_output* out) {
+  if (out->error == 0 && out->cancel != NULL && __atomic_load_n(&out->cancel->requested, __ATOMIC_ACQUIRE)) {
+    out->error = ECANCELED;
+  }
+  return out->error == 0;
+}
+
+static int write_fully(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 0;
+    }
+    data += written;
+    size -= written;
+  }
+  return 1;
+}
+
+// Makes everything written so far visible to the reader
+// returns 0 if the reader went away or the write failed
+static int output_flush(struct stream_output* out) {
+  if (!output_usable(out)) {
+    return 0;
+  }
+  if (out->ring != NULL) {
+    if (out->published != out->head) {
+      ring_publish(out->ring, out->head);
+      out->published = out->head;
+    }
+    if (__atomic_load_n(&out->ring->consumer_done, __ATOMIC_ACQUIRE)) {
+      out->error = EPIPE;
+      return 0;
+    }
+    return 1;
+  }
+  if (out->length > 0 && !write_fully(out->fd, out->buf, out->length)) {
+    out->error = errno;
+    return 0;
+  }
+  out->length = 0;
+  return 1;
+}
+
+// returns 0 if the reader went away or the write failed
+static int output_write(struct stream_output* out, const char* data, size_t length) {
+  if (!output_usable(out)) {
+    return 0;
+  }
+  if (out->ring != NULL) {
+    struct stream_ring* ring = out->ring;
+    size_t size = ring->mask + 1;
+    if (__atomic_load_n(&ring->consumer_done, __ATOMIC_ACQUIRE)) {
+      out->error = EPIPE;
+      return 0;
+    }
+    while (length > 0) {
+      size_t space = size - (out->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+      if (space == 0) {
+        ring_publish(ring, out->head);
+        out->published = out->head;
+        space = ring_wait_space(ring, out->head);
+        if (space == 0) {
+          out->error = EPIPE;
+          return 0;
+        }
+      }
+      size_t offset = out->head & ring->mask;
+      size_t n = length < space ? length : space;
+      if (n > size - offset) {
+        n = size - offset;
+      }
+      memcpy(ring->data + offset, data, n);
+      out->head += n;
+      data += n;
+      length -= n;
+    }
+    if (out->head - out->published >= STREAM_PUBLISH_SIZE) {
+      ring_publish(ring, out->head);
+      out->published = out->head;
+    }
+    return 1;
+  }
+
+  if (out->length + length > STREAM_BUFFER_SIZE && !output_flush(out)) {
+    return 0;
+  }
+  if (length >= STREAM_BUFFER_SIZE) {
+    if (!write_fully(out->fd, data, length)) {
+      out->error = errno;
+      return 0;
+    }
+    return 1;
+  }
+  memcpy(out->buf + out->length, data, length);
+  out->length += length;
+  return 1;
+}
+
+static void output_close(struct stream_output* out) {
+  output_flush(out);
+  if (out->ring != NULL) {
+    stream_ring_close_write(out->ring);
+    out->ring = NULL;
+  } else if (out->fd != -1) {
+    close(out->fd);
+    out->fd = -1;
+  }
+  free(out->buf);
+  out->buf = NULL;
+}
+
+// returns 1 if text is a non-negative decimal number, stored in value
+static int parse_count(const char* text, unsigned long long* value) {
+  if (*text == '\0') {
+    return 0;
+  }
+  char* end;
+  errno = 0;
+  *value = strtoull(text, &end, 10);
+  return *end == '\0' && errno == 0 && text[0] >= '0' && text[0] <= '9';
+}
+
+// returns 1 if argv is a command and options this file implements
+static int parse_options(char** argv, struct stream_options* options) {
+  static const struct {
+    const char* name;
+    enum stream_command command;
+  } commands[] = {
+    { "cat", STREAM_CAT }, { "head", STREAM_HEAD }, { "tail", STREAM_TAIL },
+    { "grep", STREAM_GREP }, { "wc", STREAM_WC }, { "tee", STREAM_TEE },
+  };
+  memset(options, 0, sizeof(*options));
+  if (argv == NULL || argv[0] == NULL) {
+    return 0;
+  }
+  size_t which = 0;
+  while (which < sizeof(commands) / sizeof(commands[0]) && strcmp(argv[0], commands[which].name) != 0) {
+    which++;
+  }
+  if (which == sizeof(commands) / sizeof(commands[0])) {
+    return 0;
+  }
+  options->command = commands[which].command;
+  options->count = 10;
+  int fixed = 0;
+
+  int i = 1;
+  for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+    const char* option = argv[i];
+    if (strcmp(option, "--") == 0) {
+      i++;
+      break;
+    }
+    switch (options->command) {
+      case STREAM_HEAD:
+      case STREAM_TAIL:
+        if (option[1] >= '0' && option[1] <= '9') {
+          if (!parse_count(option + 1, &options->count)) {
+            return 0;
+          }
+          options->bytes = 0;
+        } else if ((option[1] == 'n' || option[1] == 'c')) {
+          const char* value = option[2] != '\0' ? option + 2 : argv[++i];
+          if (value == NULL || !parse_count(value, &options->count)) {
+            return 0;
+          }
+          options->bytes = option[1] == 'c';
+        } else {
+          return 0;
+        }
+        break;
+      case STREAM_GREP:
+      case STREAM_WC:
+      case STREAM_TEE:
+        for (const char* letter = option + 1; *letter != '\0'; letter++) {
+          if (options->command == STREAM_GREP && *letter == 'v') {
+            options->invert = 1;
+          } else if (options->command == STREAM_GREP && *letter == 'c') {
+            options->count_only = 1;
+          } else if (options->command == STREAM_GREP && *letter == 'F') {
+            fixed = 1;
+          } else if (options->command == STREAM_WC && *letter == 'l') {
+            options->lines = 1;
+          } else if (options->command == STREAM_WC && *letter == 'w') {
+            options->words = 1;
+          } else if (options->command == STREAM_WC && *letter == 'c') {
+            options->chars = 1;
+          } else if (options->command == STREAM_TEE && *letter == 'a') {
+            options->append = 1;
+          } else {
+            return 0;
+          }
+        }
+        break;
+      case STREAM_CAT:
+        return 0;
+    }
+  }
+
+  if (options->command == STREAM_GREP) {
+    options->pattern = argv[i];
+    if (options->pattern == NULL) {
+      return 0;
+    }
+    if (!fixed && strpbrk(options->pattern, ".[]*^$\\") != NULL) {
+      return 0;
+    }
+    i++;
+  }
+  if (options->command == STREAM_WC && !options->lines && !options->words && !options->chars) {
+    options->lines = options->words = options->chars = 1;
+  }
+  options->files = &argv[i];
+  while (argv[i] != NULL) {
+    options->num_files++;
+    i++;
+  }
+  int multiple_files = options->command == STREAM_CAT || options->command == STREAM_TEE;
+  return options->num_files <= 1 || multiple_files;
+}
+
+int is_stream_builtin(char** argv) {
+  struct stream_options options;
+  return parse_options(argv, &options);
+}
+
+static void report(struct stream_stage* stage, const char* what, int error) {
+  if (__atomic_load_n(&stage->cancel.requested, __ATOMIC_ACQUIRE)) {
+    return; // Interrupted, not an error of the command
+  }
+  dprintf(stage->err_fd, "%s: %s: %s\n", stage->options.command == STREAM_GREP ? "grep" :
+          stage->options.command == STREAM_CAT ? "cat" : stage->options.command == STREAM_HEAD ? "head" :
+          stage->options.command == STREAM_TAIL ? "tail" : stage->options.command == STREAM_WC ? "wc" : "tee",
+          what, strerror(error));
+}
+
+// Points in at file, or leaves it on the stage input for "-" or no file
+// returns 0 (reported) if file cannot be opened
+static int open_input(struct stream_stage* stage, const char* file, struct stream_input* in,
+                      struct stream_input** current) {
+  if (file == NULL || strcmp(file, "-") == 0) {
+    *current = &stage->in;
+    return 1;
+  }
+  int fd = open(file, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    report(stage, file, errno);
+    return 0;
+  }
+  input_init(in, (struct stream_end){ fd, NULL }, &stage->cancel);
+  *current = in;
+  return 1;
+}
+
+static void close_input(struct stream_stage* stage, struct stream_input* in) {
+  if (in != &stage->in) {
+    input_close(in);
+  }
+}
+
+static int run_cat(struct stream_stage* stage) {
+  int status = 0;
+  int num_files = stage->options.num_files > 0 ? stage->options.num_files : 1;
+  for (int i = 0; i < num_files && stage->out.error == 0; i++) {
+    struct stream_input file, *in;
+    if (!open_input(stage, stage->options.num_files > 0 ? stage->options.files[i] : NULL, &file, &in)) {
+      status = 1;
+      continue;
+    }
+    const char* data;
+    ssize_t length;
+    while ((length = input_next(in, &data, 0)) > 0 && output_write(&stage->out, data, length)) {
+      output_flush(&stage->out);
+    }
+    if (length == -1) {
+      report(stage, stage->options.num_files > 0 ? stage->options.files[i] : "-", errno);
+      status = 1;
+    }
+    close_input(stage, in);
+  }
+  return status;
+}
+
+static int run_head(struct stream_stage* stage) {
+  struct stream_input file, *in;
+  if (!open_input(stage, stage->options.files[0], &file, &in)) {
+    return 1;
+  }
+  unsigned long long remaining = stage->options.count;
+  const char* data;
+  ssize_t length = 0;
+  while (remaining > 0 && (length = input_next(in, &data, 0)) > 0) {
+    size_t take = length;
+    if (stage->options.bytes) {
+      if (take > remaining) {
+        take = remaining;
+      }
+      remaining -= take;
+    } else {
+      const char* end = data + length;
+      const char* next = data;
+      while (remaining > 0 && next < end) {
+        const char* newline = memchr(next, '\n', end - next);
+        if (newline == NULL) {
+          next = end;
+          break;
+        }
+        next = newline + 1;
+        remaining--;
+      }
+      take = next - data;
+    }
+    if (!output_write(&stage->out, data, take) || !output_flush(&stage->out)) {
+      break;
+    }
+  }
+  close_input(stage, in);
+  if (length == -1) {
+    report(stage, stage->options.files[0] != NULL ? stage->options.files[0] : "-", errno);
+    return 1;
+  }
+  return 0;
+}
+
+// returns the offset in data where its last count lines start
+static size_t last_lines(const char* data, size_t length, unsigned long long count) {
+  if (count == 0) {
+    return length;
+  }
+  size_t end = length > 0 && data[length - 1] == '\n' ? length - 1 : length;
+  while (end > 0) {
+    const char* newline = memrchr(data, '\n', end);
+    if (newline == NULL) {
+      return 0;
+    }
+    if (--count == 0) {
+      return newline + 1 - data;
+    }
+    end = newline - data;
+  }
+  return 0;
+}
+
+static int run_tail(struct stream_stage* stage) {
+  struct stream_input file, *in;
+  if (!open_input(stage, stage->options.files[0], &file, &in)) {
+    return 1;
+  }
+  unsigned long long count = stage->options.count;
+  char* kept = NULL;
+  size_t kept_length = 0, kept_size = 0, trimmed_length = 0;
+  const char* data;
+  ssize_t length;
+  int status = 0;
+  while ((length = input_next(in, &data, 0)) > 0) {
+    if (kept_length + length > kept_size) {
+      size_t size = kept_size == 0 ? STREAM_BUFFER_SIZE : kept_size;
+      while (size < kept_length + length) {
+        size *= 2;
+      }
+      char* grown = realloc(kept, size);
+      if (grown == NULL) {
+        length = -1;
+        break;
+      }
+      kept = grown;
+      kept_size = size;
+    }
+    memcpy(kept + kept_length, data, length);
+    kept_length += length;
+
+    // Drop what can no longer be part of the last count lines or bytes
+    if (kept_length >= trimmed_length + TAIL_TRIM_SIZE) {
+      size_t start = stage->options.bytes ? (kept_length > count ? kept_length - count : 0)
+                                           : last_lines(kept, kept_length, count);
+      memmove(kept, kept + start, kept_length - start);
+      kept_length -= start;
+      trimmed_length = kept_length;
+    }
+  }
+  if (length == -1) {
+    report(stage, stage->options.files[0] != NULL ? stage->options.files[0] : "-", errno);
+    status = 1;
+  } else {
+    size_t start = stage->options.bytes ? (kept_length > count ? kept_length - count : 0)
+                                         : last_lines(kept, kept_length, count);
+    output_write(&stage->out, kept + start, kept_length - start);
+  }
+  free(kept);
+  close_input(stage, in);
+  return status;
+}
+
+// returns the first occurrence of needle in data, NULL if there is none. The
+// first and last bytes of the needle are compared at 32 (AVX2) or 16 (SSE2)
+// positions at once and only the candidates where both match are checked.
+static const char* find_fixed(const char* data, size_t size, const char* needle, size_t length) {
+  if (length == 0) {
+    return data;
+  }
+  if (length > size) {
+    return NULL;
+  }
+  if (length == 1) {
+    return memchr(data, needle[0], size);
+  }
+  size_t i = 0;
+  size_t candidates = size - length + 1;
+
+#if defined(__AVX2__)
+  const __m256i first = _mm256_set1_epi8(needle[0]), last = _mm256_set1_epi8(needle[length - 1]);
+  for (; i + 32 <= candidates; i += 32) {
+    __m256i starts = _mm256_loadu_si256((const __m256i*)(data + i));
+    __m256i ends = _mm256_loadu_si256((const __m256i*)(data + i + length - 1));
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(starts, first), _mm256_cmpeq_epi8(ends, last)));
+    while (mask != 0) {
+      size_t candidate = i + __builtin_ctz(mask);
+      if (memcmp(data + candidate + 1, needle + 1, length - 2) == 0) {
+        return data + candidate;
+      }
+      mask &= mask - 1;
+    }
+  }
+#elif defined(__SSE2__)
+  const __m128i first = _mm_set1_epi8(needle[0]), last = _mm_set1_epi8(needle[length - 1]);
+  for (; i + 16 <= candidates; i += 16) {
+    __m128i starts = _mm_loadu_si128((const __m128i*)(data + i));
+    __m128i ends = _mm_loadu_si128((const __m128i*)(data + i + length - 1));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(starts, first), _mm_cmpeq_epi8(ends, last)));
+    while (mask != 0) {
+      size_t candidate = i + __builtin_ctz(mask);
+      if (memcmp(data + candidate + 1, needle + 1, length - 2) == 0) {
+        return data + candidate;
+      }
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  return memmem(data + i, size - i, needle, length);
+}
+
+static size_t count_newlines(const char* data, size_t length) {
+  size_t count = 0;
+  for (size_t i = 0; i < length; i++) {
+    count += data[i] == '\n';
+  }
+  return count;
+}
+
+// Writes the lines in [from, to), ending the last one with a newline
+static int write_lines(struct stream_output* out, const char* from, const char* to) {
+  if (from == to) {
+    return 1;
+  }
+  if (!output_write(out, from, to - from)) {
+    return 0;
+  }
+  return to[-1] == '\n' || output_write(out, "\n", 1);
+}
+
+static int run_grep(struct stream_stage* stage) {
+  struct stream_input file, *in;
+  if (!open_input(stage, stage->options.files[0], &file, &in)) {
+    return 2;
+  }
+  const char* pattern = stage->options.pattern;
+  size_t pattern_length = strlen(pattern);
+  int invert = stage->options.invert, count_only = stage->options.count_only;
+  unsigned long long matches = 0;
+  const char* data;
+  ssize_t length;
+  while ((length = input_next(in, &data, 1)) > 0) {
+    const char* next = data;
+    const char* end = data + length;
+    while (next < end) {
+      const char* hit = find_fixed(next, end - next, pattern, pattern_length);
+      if (hit == NULL) {
+        // With -v, every line left in the block is printed at once
+        if (invert) {
+          matches += count_newlines(next, end - next) + (end[-1] != '\n');
+          if (!count_only && !write_lines(&stage->out, next, end)) {
+            goto done;
+          }
+        }
+        break;
+      }
+      const char* line_start = memrchr(next, '\n', hit - next);
+      line_start = line_start != NULL ? line_start + 1 : next;
+      const char* line_end = memchr(hit, '\n', end - hit);
+      line_end = line_end != NULL ? line_end + 1 : end;
+      if (invert) {
+        matches += count_newlines(next, line_start - next);
+        if (!count_only && !write_lines(&stage->out, next, line_start)) {
+          goto done;
+        }
+      } else {
+        matches++;
+        if (!count_only && !write_lines(&stage->out, line_start, line_end)) {
+          goto done;
+        }
+      }
+      next = line_end;
+    }
+    if (!output_flush(&stage->out)) {
+      break;
+    }
+  }
+done:
+  close_input(stage, in);
+  if (length == -1) {
+    report(stage, stage->options.files[0] != NULL ? stage->options.files[0] : "-", errno);
+    return 2;
+  }
+  if (count_only) {
+    char line[32];
+    int line_length = snprintf(line, sizeof(line), "%llu\n", matches);
+    output_write(&stage->out, line, line_length);
+  }
+  return matches > 0 ? 0 : 1;
+}
+
+static int run_wc(struct stream_stage* stage) {
+  static const unsigned char space_table[256] = {
+    [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\v'] = 1, ['\f'] = 1, ['\r'] = 1,
+  };
+
+  struct stream_input file, *in;
+  const char* name = stage->options.files[0];
+  if (!open_input(stage, name, &file, &in)) {
+    return 1;
+  }
+  // Like wc, numbers are as wide as the size of a regular file, or 7 wide
+  int width = WC_DEFAULT_WIDTH;
+  struct stat st;
+  if (in->fd != -1 && fstat(in->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    width = snprintf(NULL, 0, "%llu", (unsigned long long)st.st_size);
+  }
+
+  unsigned long long lines = 0, words = 0, chars = 0;
+  int in_word = 0;
+  const char* data;
+  ssize_t length;
+  while ((length = input_next(in, &data, 0)) > 0) {
+    chars += length;
+    if (stage->options.lines) {
+      lines += count_newlines(data, length);
+    }
+    if (stage->options.words) {
+      for (ssize_t i = 0; i < length; i++) {
+        int space = space_table[(unsigned char)data[i]];
+        words += !space && !in_word;
+        in_word = !space;
+      }
+    }
+  }
+  close_input(stage, in);
+  if (length == -1) {
+    report(stage, name != NULL ? name : "-", errno);
+    return 1;
+  }
+
+  unsigned long long counts[3];
+  int num_counts = 0;
+  if (stage->options.lines) {
+    counts[num_counts++] = lines;
+  }
+  if (stage->options.words) {
+    counts[num_counts++] = words;
+  }
+  if (stage->options.chars) {
+    counts[num_counts++] = chars;
+  }
+  if (num_counts == 1) {
+    width = 1;
+  }
+  char line[128];
+  int line_length = 0;
+  for (int i = 0; i < num_counts; i++) {
+    line_length += snprintf(line + line_length, sizeof(line) - line_length, "%s%*llu", i > 0 ? " " : "",
+                            width, counts[i]);
+  }
+  output_write(&stage->out, line, line_length);
+  if (name != NULL && strcmp(name, "-") != 0) {
+    output_write(&stage->out, " ", 1);
+    output_write(&stage->out, name, strlen(name));
+  }
+  output_write(&stage->out, "\n", 1);
+  return 0;
+}
+
+static int run_tee(struct stream_stage* stage) {
+  int num_files = stage->options.num_files;
+  int status = 0;
+  struct stream_output* files = calloc(num_files > 0 ? num_files : 1, sizeof(struct stream_output));
+  if (files == NULL) {
+    report(stage, "malloc", errno);
+    return 1;
+  }
+  for (int i = 0; i < num_files; i++) {
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (stage->options.append ? O_APPEND : O_TRUNC);
+    int fd = open(stage->options.files[i], flags, 0666);
+    output_init(&files[i], (struct stream_end){ fd, NULL }, NULL);
+    if (fd == -1) {
+      report(stage, stage->options.files[i], errno);
+      files[i].error = errno;
+      status = 1;
+    } else if ((files[i].buf = malloc(STREAM_BUFFER_SIZE)) == NULL) {
+      files[i].error = errno;
+    }
+  }
+
+  const char* data;
+  ssize_t length;
+  while ((length = input_next(&stage->in, &data, 0)) > 0) {
+    for (int i = 0; i < num_files; i++) {
+      if (files[i].error == 0 && !(output_write(&files[i], data, length) && output_flush(&files[i]))) {
+        report(stage, stage->options.files[i], files[i].error);
+        status = 1;
+      }
+    }
+    if (!output_write(&stage->out, data, length) || !output_flush(&stage->out)) {
+      break;
+    }
+  }
+  if (length == -1) {
+    report(stage, "-", errno);
+    status = 1;
+  }
+  for (int i = 0; i < num_files; i++) {
+    output_close(&files[i]);
+  }
+  free(files);
+  return status;
+}
+
+static void* run_stage(void* arg) {
+  struct stream_stage* stage = arg;
+  switch (stage->options.command) {
+    case STREAM_CAT:
+      stage->status = run_cat(stage);
+      break;
+    case STREAM_HEAD:
+      stage->status = run_head(stage);
+      break;
+    case STREAM_TAIL:
+      stage->status = run_tail(stage);
+      break;
+    case STREAM_GREP:
+      stage->status = run_grep(stage);
+      break;
+    case STREAM_WC:
+      stage->status = run_wc(stage);
+      break;
+    case STREAM_TEE:
+      stage->status = run_tee(stage);
+      break;
+  }
+  output_flush(&stage->out);
+
+  // Ctrl+C and a reader that went away end the stage like SIGINT and SIGPIPE end the command
+  if (__atomic_load_n(&stage->cancel.requested, __ATOMIC_ACQUIRE)) {
+    stage->status = 128 + SIGINT;
+  } else if (stage->out.error == EPIPE) {
+    stage->status = 128 + SIGPIPE;
+  } else if (stage->out.error != 0) {
+    report(stage, "write error", stage->out.error);
+    stage->status = 1;
+  }
+  output_close(&stage->out);
+  input_close(&stage->in);
+  close(stage->err_fd);
+  getrusage(RUSAGE_THREAD, &stage->usage);
+  eventfd_write(stage->done_fd, 1);
+  return NULL;
+}
+
+static void close_end(struct stream_end end, int reading) {
+  if (end.ring != NULL) {
+    if (reading) {
+      stream_ring_close_read(end.ring);
+    } else {
+      stream_ring_close_write(end.ring);
+    }
+  } else if (end.fd != -1) {
+    close(end.fd);
+  }
+}
+
+struct stream_stage* start_stream_stage(char** argv, struct stream_end in, struct stream_end out, int err_fd) {
+  struct stream_stage* stage = calloc(1, sizeof(struct stream_stage));
+  int error = ENOMEM;
+  if (stage == NULL) {
+    goto fail;
+  }
+  stage->cancel.fd = stage->done_fd = -1;
+  if (!parse_options(argv, &stage->options)) {
+    error = EINVAL;
+    goto fail;
+  }
+  if ((stage->cancel.fd = eventfd(0, EFD_CLOEXEC)) == -1 || (stage->done_fd = eventfd(0, EFD_CLOEXEC)) == -1) {
+    error = errno;
+    goto fail;
+  }
+  input_init(&stage->in, in, &stage->cancel);
+  output_init(&stage->out, out, &stage->cancel);
+  stage->err_fd = err_fd;
+  if (out.ring == NULL && (stage->out.buf = malloc(STREAM_BUFFER_SIZE)) == NULL) {
+    goto fail;
+  }
+
+  // The thread takes no signals: they stay with the shell's event loop, and a
+  // write to a closed pipe fails with EPIPE instead of raising SIGPIPE
+  sigset_t all, saved;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &saved);
+  error = pthread_create(&stage->thread, NULL, run_stage, stage);
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+  if (error != 0) {
+    goto fail;
+  }
+  return stage;
+
+fail:
+  if (stage != NULL) {
+    if (stage->cancel.fd != -1) {
+      close(stage->cancel.fd);
+    }
+    if (stage->done_fd != -1) {
+      close(stage->done_fd);
+    }
+    free(stage->out.buf);
+    free(stage);
+  }
+  close_end(in, 1);
+  close_end(out, 0);
+  close(err_fd);
+  errno = error;
+  return NULL;
+}
+
+int join_stream_stage(struct stream_stage* stage, struct rusage* usage) {
+  pthread_join(stage->thread, NULL);
+  int status = stage->status;
+  if (usage != NULL) {
+    *usage = stage->usage;
+  }
+  close(stage->cancel.fd);
+  close(stage->done_fd);
+  free(stage);
+  return status;
+}
+
+int stream_stage_done_fd(const struct stream_stage* stage) {
+  return stage->done_fd;
+}
+
+void cancel_stream_stage(struct stream_stage* stage) {
+  __atomic_store_n(&stage->cancel.requested, 1, __ATOMIC_RELEASE);
+  eventfd_write(stage->cancel.fd, 1);
+}
@@ -0,0 +1,63 @@
+#ifndef STREAMS_H
+#define STREAMS_H
+
+// Stream builtins: cat, head, tail, grep, wc and tee run as threads inside the
+// shell when they are pipeline stages (set streams on), so a pipeline made of
+// them costs no fork or exec. Two neighbouring stream stages are connected by a
+// single-producer single-consumer ring in memory instead of a kernel pipe; a
+// stream stage next to an external command uses an ordinary pipe.
+//
+// Only the options listed at is_stream_builtin are understood. Anything else
+// (another option, a regular expression for grep) is left to the real command.
+
+struct stream_ring;
+struct rusage;
+
+// One side of a stream stage: a descriptor, or a ring shared with the
+// neighbouring stream stage (fd is then -1). The stage owns what it is given:
+// it closes the descriptor, or its end of the ring, when it is done.
+struct stream_end {
+  int fd;
+  struct stream_ring* ring;
+};
+
+struct stream_stage;
+
+// returns 1 if argv can run as a stream builtin:
+//   cat [file...]
+//   head [-n N | -N | -c N] [file]      tail [-n N | -N | -c N] [file]
+//   grep [-v] [-c] [-F] pattern [file]  (without -F, pattern has no regex characters)
+//   wc [-l] [-w] [-c] [file]            tee [-a] [file...]
+int is_stream_builtin(char** argv);
+
+// returns a new ring for two stream stages, NULL on allocation failure
+struct stream_ring* stream_ring_new(void);
+
+// Gives up the producer or the consumer end of ring, for a stage that will not
+// run or that was given a redirection instead. The other side sees end of
+// input, or a reader that went away.
+void stream_ring_close_write(struct stream_ring* ring);
+void stream_ring_close_read(struct stream_ring* ring);
+
+// Starts argv as a thread reading in and writing out, with its messages going
+// to err_fd. The stage owns all three and closes them when it is done. argv
+// must stay valid until the stage is joined.
+// returns the stage, NULL with errno set if the thread could not be created
+// (in, out and err_fd are then closed)
+struct stream_stage* start_stream_stage(char** argv, struct stream_end in, struct stream_end out, int err_fd);
+
+// Waits for stage to finish and frees it. usage, unless NULL, gets what the
+// thread used (RUSAGE_THREAD).
+// returns its exit status, like the one of a process (0 success, 1 grep found nothing...)
+int join_stream_stage(struct stream_stage* stage, struct rusage* usage);
+
+// returns a descriptor that becomes readable once stage has finished, to wait
+// for it next to other descriptors. It stays open until the stage is joined.
+int stream_stage_done_fd(const struct stream_stage* stage);
+
+// Ctrl+C for a stage: it stops before its next block of input, also when it is
+// blocked reading a pipe or a terminal, and ends with status 130 like a command
+// killed by SIGINT. A stage waiting on a ring wakes up once its neighbour stops.
+void cancel_stream_stage(struct stream_stage* stage);
+
+#endif
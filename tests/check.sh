@@ -0,0 +1,153 @@
+#!/bin/sh
+# End-to-end checks: runs command lines through the shell and compares what
+# they print with what they should print.
+# usage: tests/check.sh [shell binary]
+SHELL_BIN=${1:-./myshell}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+FAILED=0
+
+# check name expected: feeds stdin to the shell and compares its stdout
+check() {
+  NAME=$1
+  EXPECTED=$2
+  ACTUAL=$("$SHELL_BIN" 2> "$WORK/stderr")
+  if [ "$ACTUAL" = "$EXPECTED" ]; then
+    echo "ok $NAME"
+  else
+    echo "FAIL $NAME"
+    printf 'expected:\n%s\ngot:\n%s\nstderr:\n' "$EXPECTED" "$ACTUAL"
+    cat "$WORK/stderr"
+    FAILED=1
+  fi
+}
+
+# A line with stages cat | cat | ... | cat, $1 of them
+cat_chain() {
+  printf 'cat'
+  for i in $(seq 2 "$1"); do
+    printf ' | cat'
+  done
+  printf '\n'
+}
+
+# count-fds FILE writes the number of descriptors the shell holds to FILE,
+# counted by a child of the shell
+cat > "$WORK/count-fds" <<'EOF'
+#!/bin/sh
+ls /proc/$PPID/fd | wc -l > "$1"
+EOF
+chmod +x "$WORK/count-fds"
+
+# The shell holds as many descriptors after the chains as before them
+for STREAMS in off on; do
+  {
+    echo "set streams $STREAMS"
+    echo "$WORK/count-fds $WORK/fds-before"
+    printf 'echo through 1000 stages | '
+    cat_chain 1000
+    printf 'seq 1 5000 | '
+    cat_chain 1000 | sed 's/$/ | wc -l/'
+    echo "$WORK/count-fds $WORK/fds-after"
+    echo "cat $WORK/fds-before $WORK/fds-after | uniq | wc -l"
+  } | check "cat-chain-1000-streams-$STREAMS" "streams: $STREAMS
+through 1000 stages
+5000
+1"
+done
+
+mkdir "$WORK/parallel"
+check parallel "a
+b
+c
+0
+1" <<EOF
+parallel -j 2 touch ::: $WORK/parallel/c $WORK/parallel/a $WORK/parallel/b
+ls $WORK/parallel
+echo \$?
+parallel -j abc echo ::: a
+echo \$?
+EOF
+
+check status "1 \$? \$? \$?" <<'EOF'
+false
+echo $? '$?' "$?" \$?
+EOF
+
+check redirections "first
+second
+1
+3" <<EOF
+echo first > $WORK/out
+echo second >> $WORK/out
+cat < $WORK/out
+ls $WORK/missing 2> $WORK/err
+wc -l < $WORK/err
+cat < $WORK/out | cat > $WORK/copy
+wc -l < $WORK/out > $WORK/count
+cat $WORK/copy $WORK/count | wc -l
+EOF
+
+check heredoc "line one
+  line two
+here string" <<'EOF'
+cat <<END
+line one
+  line two
+END
+cat <<< "here string"
+EOF
+
+# Ctrl+C, sent here by a background job, stops a pipeline of stream stages
+check stream-interrupt "streams: on
+130
+after" <<'EOF'
+set streams on
+sh -c 'sleep 0.5; kill -INT $PPID' &
+cat /dev/zero | wc -c
+echo $?
+echo after
+EOF
+
+check batch "x 1 2 3 4
+x 5 6 7 8
+x 9 10
+3
+1
+1" <<EOF
+seq 1 10 | batch -n 4 echo x
+seq 1 10 | batch -n 4 echo x | wc -l
+batch echo x
+echo \$?
+seq 1 10 | batch -j abc echo x
+echo \$?
+EOF
+
+check not-found "127
+127
+1" <<EOF
+nosuchcommand
+echo \$?
+echo a | nosuchcommand
+echo \$?
+echo a | cat < $WORK/missing
+echo \$?
+EOF
+
+check sched-usage "2
+0" <<'EOF'
+sched -n 3
+echo $?
+sched -n 3 true
+echo $?
+EOF
+
+check limit-usage "2
+0" <<'EOF'
+limit -n 20
+echo $?
+limit -n 20 true
+echo $?
+EOF
+
+exit $FAILED
@@ -0,0 +1,46 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Layout of the spawn trace file written by the shell (set trace <file>, or the
+// MYSHELL_TRACE environment variable) and read by tracedump. The file is a
+// header followed by a ring of capacity fixed-size records, mapped MAP_SHARED by
+// the shell so that its children (relays, forked children before exec) append
+// to the same ring. Writers claim a slot by incrementing head atomically and
+// publish it by storing seq last, so a reader can skip torn or overwritten slots.
+
+#define TRACE_MAGIC 0x454341525448534dULL // "MSHTRACE" read as a little-endian uint64
+#define TRACE_DEFAULT_RECORDS 65536 // must be a power of two
+
+// Where a command is in its life. pid is 0 for events of the shell itself.
+enum trace_phase {
+  TRACE_COMMAND = 1, // process_tokens got a command line, value is the word count
+  TRACE_PARSED,      // the command was classified, value is the number of stages
+  TRACE_SPAWN,       // about to create a process
+  TRACE_SPAWNED,     // the process exists (with posix_spawn, it has also exec'd)
+  TRACE_EXEC,        // the child is about to exec (fork builds and relays only)
+  TRACE_FIRST_OUTPUT, // the shell saw the first bytes the process wrote
+  TRACE_EXIT,        // the shell learned that the process exited, value is the wait status
+  TRACE_REAP,        // the process was reaped, value is the wait status
+  TRACE_DONE,        // the command finished, value is $?
+};
+
+struct trace_header {
+  uint64_t magic;
+  uint32_t record_size;
+  uint32_t capacity; // number of records in the ring
+  uint64_t head;     // records ever written, the next one goes to slot head % capacity
+  uint64_t reserved[5];
+};
+
+struct trace_record {
+  uint64_t seq;       // index of the record + 1, written last
+  uint64_t time_ns;   // CLOCK_MONOTONIC
+  uint32_t command;   // number of the command line, counted from 1
+  int32_t pid;        // process the event is about
+  uint32_t phase;     // enum trace_phase
+  int32_t value;
+};
+
+#endif
@@ -0,0 +1,183 @@
+// Decodes a spawn trace written by myshell (see trace.h).
+//
+//   tracedump trace.bin           one JSON object per record, oldest first
+//   tracedump -c trace.bin        Chrome trace format (chrome://tracing, Perfetto)
+//
+// Build: gcc -O2 -o tracedump tracedump.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trace.h"
+
+static const char* phase_names[] = {
+  [TRACE_COMMAND] = "command",
+  [TRACE_PARSED] = "parsed",
+  [TRACE_SPAWN] = "spawn",
+  [TRACE_SPAWNED] = "spawned",
+  [TRACE_EXEC] = "exec",
+  [TRACE_FIRST_OUTPUT] = "first_output",
+  [TRACE_EXIT] = "exit",
+  [TRACE_REAP] = "reap",
+  [TRACE_DONE] = "done",
+};
+
+const char* phase_name(uint32_t phase) {
+  if (phase >= sizeof(phase_names) / sizeof(phase_names[0]) || phase_names[phase] == NULL) {
+    return "unknown";
+  }
+  return phase_names[phase];
+}
+
+// Shell events first, then each process, each in time order
+int compare_records(const void* a, const void* b) {
+  const struct trace_record* x = a;
+  const struct trace_record* y = b;
+  if (x->pid != y->pid) {
+    return x->pid < y->pid ? -1 : 1;
+  }
+  if (x->time_ns != y->time_ns) {
+    return x->time_ns < y->time_ns ? -1 : 1;
+  }
+  return x->phase < y->phase ? -1 : x->phase > y->phase;
+}
+
+void print_span(const char* name, const struct trace_record* from, const struct trace_record* to, int* first) {
+  printf("%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"command\":%u}}",
+         *first ? "" : ",", name, from->pid, from->time_ns / 1e3, (to->time_ns - from->time_ns) / 1e3, from->command);
+  *first = 0;
+}
+
+void print_instant(const struct trace_record* record, int* first) {
+  printf("%s\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{\"command\":%u}}",
+         *first ? "" : ",", phase_name(record->phase), record->pid, record->time_ns / 1e3, record->command);
+  *first = 0;
+}
+
+// Turns the phases into spans: parse and the whole command on the shell's track,
+// spawn, run and reap on one track per process. Exec and first output are marks.
+void print_chrome_trace(struct trace_record* records, size_t count) {
+  const struct trace_record* last[TRACE_DONE + 1];
+  int first = 1;
+
+  qsort(records, count, sizeof(struct trace_record), compare_records);
+  printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  for (size_t i = 0; i < count; i++) {
+    const struct trace_record* record = &records[i];
+    if (i == 0 || record->pid != records[i - 1].pid) {
+      memset(last, 0, sizeof(last));
+    }
+    if (record->phase > TRACE_DONE) {
+      continue;
+    }
+    last[record->phase] = record;
+
+    switch (record->phase) {
+      case TRACE_PARSED:
+        if (last[TRACE_COMMAND] != NULL && last[TRACE_COMMAND]->command == record->command) {
+          print_span("parse", last[TRACE_COMMAND], record, &first);
+        }
+        break;
+      case TRACE_DONE:
+        if (last[TRACE_COMMAND] != NULL && last[TRACE_COMMAND]->command == record->command) {
+          print_span("command", last[TRACE_COMMAND], record, &first);
+        }
+        break;
+      case TRACE_SPAWNED:
+        if (last[TRACE_SPAWN] != NULL) {
+          print_span("spawn", last[TRACE_SPAWN], record, &first);
+        }
+        break;
+      case TRACE_EXIT:
+        if (last[TRACE_SPAWNED] != NULL) {
+          print_span("run", last[TRACE_SPAWNED], record, &first);
+        }
+        break;
+      case TRACE_REAP:
+        if (last[TRACE_EXIT] != NULL) {
+          print_span("reap", last[TRACE_EXIT], record, &first);
+        } else if (last[TRACE_SPAWNED] != NULL) {
+          print_span("run", last[TRACE_SPAWNED], record, &first);
+        }
+        break;
+      case TRACE_EXEC:
+      case TRACE_FIRST_OUTPUT:
+        print_instant(record, &first);
+        break;
+    }
+  }
+  printf("\n]}\n");
+}
+
+void print_jsonl(const struct trace_record* records, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    const struct trace_record* record = &records[i];
+    printf("{\"seq\":%llu,\"time_ns\":%llu,\"command\":%u,\"pid\":%d,\"phase\":\"%s\",\"value\":%d}\n",
+           (unsigned long long)record->seq, (unsigned long long)record->time_ns, record->command,
+           record->pid, phase_name(record->phase), record->value);
+  }
+}
+
+int main(int argc, char** argv) {
+  int chrome = argc == 3 && strcmp(argv[1], "-c") == 0;
+  if (argc != 2 + chrome) {
+    fprintf(stderr, "usage: %s [-c] trace-file\n", argv[0]);
+    return 2;
+  }
+  const char* path = argv[argc - 1];
+
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    perror(path);
+    return 1;
+  }
+  if ((size_t)st.st_size < sizeof(struct trace_header)) {
+    fprintf(stderr, "%s: not a trace file\n", path);
+    return 1;
+  }
+  const struct trace_header* header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (header == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  if (header->magic != TRACE_MAGIC || header->record_size != sizeof(struct trace_record) ||
+      header->capacity == 0 ||
+      sizeof(struct trace_header) + (size_t)header->capacity * sizeof(struct trace_record) > (size_t)st.st_size) {
+    fprintf(stderr, "%s: not a trace file\n", path);
+    return 1;
+  }
+
+  // Copy the live part of the ring, oldest first, dropping slots being rewritten
+  const struct trace_record* ring = (const struct trace_record*)(header + 1);
+  uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+  uint64_t start = head > header->capacity ? head - header->capacity : 0;
+  struct trace_record* records = malloc(sizeof(struct trace_record) * (head - start + 1));
+  size_t count = 0;
+  if (records == NULL) {
+    perror("malloc");
+    return 1;
+  }
+  for (uint64_t i = start; i < head; i++) {
+    const struct trace_record* slot = &ring[i % header->capacity];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != i + 1) {
+      continue;
+    }
+    records[count] = *slot;
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == i + 1) {
+      count++;
+    }
+  }
+
+  if (chrome) {
+    print_chrome_trace(records, count);
+  } else {
+    print_jsonl(records, count);
+  }
+  free(records);
+  return 0;
+}